@@ -2,6 +2,9 @@
     Type: Custom Output(FFmpeg)
     FFmpeg Output Type : Output to URL
     File path or URL : \\.\pipe\obs_video
+                       (pipe_streams=N in streams.ini: \\.\pipe\obs_video_1 .. obs_video_<N-1>)
+    Remote encoder instead of the pipe: ingest=udp|rtp [<ip>:]<port> in streams.ini,
+    OBS URL udp://<this host>:<port>?pkt_size=1316 (or rtp://...).
     Container Format : mpegts
     Video Bitrate : 6000 Kbps
     Keyframe interval(frames) : 60
@@ -12,6 +15,7 @@
 
 #define WM_VIDEO_RESIZE (WM_USER + 1)
 #define WM_OBS_STARTED  (WM_USER + 2)
+#define WM_RECORDER_LOG (WM_USER + 3)
 
 #define WIN32_LEAN_AND_MEAN
 #define _CRT_SECURE_NO_WARNINGS 
@@ -36,9 +40,18 @@
 #include <wrl/client.h>
 #include <algorithm> 
 #include <queue>
+#include <deque>
 #include <mutex>
 #include <condition_variable>
 #include <chrono>
+#include <map>
+#include <memory>
+#include <set>
+#include <functional>
+#include <cmath>
+#include <emmintrin.h>
+#include <climits>
+#include <avrt.h>
 
 #pragma comment(lib, "ws2_32.lib")
 #pragma comment(lib, "gdi32.lib")
@@ -46,6 +59,7 @@
 #pragma comment(lib, "ole32.lib")
 #pragma comment(lib, "d3d11.lib")
 #pragma comment(lib, "dxgi.lib")
+#pragma comment(lib, "avrt.lib")
 #pragma comment(lib, "d3dcompiler.lib")
 #pragma comment(lib, "avcodec.lib")
 #pragma comment(lib, "avformat.lib")
@@ -65,10 +79,13 @@ extern "C" {
 #include <libavutil/hwcontext.h>
 #include <libavutil/hwcontext_d3d11va.h>
 #include <libavutil/imgutils.h>
+#include <libavutil/pixdesc.h>
 #include <libavutil/error.h>
 #include <libswscale/swscale.h>
 }
 
+#include "SharedFrameRing.h"
+
 using Microsoft::WRL::ComPtr;
 
 // --- КОНСТАНТЫ И ГЛОБАЛЬНЫЕ ПЕРЕМЕННЫЕ ---
@@ -93,18 +110,23 @@ const int UDP_PACKET_SIZE = 1316; // MPEG-TS friendly size (188 * 7)
 #define ID_CHK_CUSTOM   108
 #define ID_COMBO_RES    109
 #define ID_EDIT_FPS     110
+#define ID_CHK_RECORD   111
+#define ID_BTN_REPLAY   112
+#define ID_CHK_SHM      113
+#define ID_CHK_RTP      114
 
 // Структура для кодеков
 struct CodecOption {
     std::string name;
     std::string ffmpegName;
-    int id; // Внутренний ID (0 - OBS/x264, 1 - DXGI Raw)
+    int id; // Внутренний ID (0 - OBS/x264, 1 - DXGI Raw, 2 - DXGI + встроенный энкодер)
     int obsId; // ID для конфига OBS
 };
 
 const std::vector<CodecOption> AVAILABLE_CODECS = {
     { "libx264 (Default)", "libx264", 0, 27 },       // Режим 0: OBS + Pipe
-    { "Raw (DXGI Screen Capture)", "rawvideo", 1, 0 } // Режим 1: Без OBS, прямой захват
+    { "Raw (DXGI Screen Capture)", "rawvideo", 1, 0 }, // Режим 1: Без OBS, прямой захват
+    { "H.264 (DXGI + Encoder)", "libx264", 2, 0 }    // Режим 2: Прямой захват + MPEG-TS в процессе
 };
 
 const std::vector<int> AVAILABLE_FPS = { 15, 30, 45, 60, 90, 120, 144, 165 };
@@ -117,6 +139,8 @@ std::atomic<bool> g_Running(true);
 std::atomic<bool> g_RestartRequested(false);
 std::atomic<bool> g_IsShowStream(false);
 std::atomic<bool> g_IsStreamNetwork(false);
+std::atomic<bool> g_IsRecording(false);
+std::atomic<bool> g_IsSharedMemory(false);
 
 HWND g_hMainWindow = nullptr;
 HWND g_hVideoWindow = nullptr;
@@ -130,6 +154,10 @@ HWND g_hComboCodec = nullptr;
 HWND g_hChkShow = nullptr;
 HWND g_hChkStream = nullptr;
 HWND g_hChkCustom = nullptr;
+HWND g_hChkRecord = nullptr;
+HWND g_hBtnReplay = nullptr;
+HWND g_hChkShm = nullptr;
+HWND g_hChkRtp = nullptr;
 
 HANDLE g_hJob = nullptr;
 SOCKET g_UdpSocket = INVALID_SOCKET;
@@ -143,6 +171,547 @@ void LogToGUI(const std::string& message) {
     SendMessageA(g_hConsoleWindow, EM_REPLACESEL, 0, (LPARAM)line.c_str());
 }
 
+// ==========================================
+// ПОТОКИ: РОЛИ, ПРИОРИТЕТЫ, ПРИВЯЗКА К ЯДРАМ
+// ==========================================
+// Каждый поток конвейера при старте получает роль (ThreadRoleScope). Роль задаёт приоритет,
+// маску ядер, задачу MMCSS и изоляцию: ядра изолированной роли исключаются из маски остальных
+// ролей и из набора ядер job system. Настраивается строками thread= в streams.ini и применяется
+// к потокам, созданным после чтения файла (каждый запуск движка).
+enum class ThreadRole { Capture, Decode, Reader, Network, Worker, Recorder, Count };
+const int THREAD_ROLE_COUNT = (int)ThreadRole::Count;
+const char* THREAD_ROLE_NAMES[THREAD_ROLE_COUNT] = { "capture", "decode", "reader", "network", "worker", "recorder" };
+
+struct ThreadPolicy {
+    int priority = THREAD_PRIORITY_NORMAL;
+    DWORD_PTR affinity = 0; // 0 - все неизолированные ядра (группа 0)
+    std::string mmcssTask;  // пусто - без MMCSS
+    bool isolate = false;
+};
+
+struct ThreadTopology {
+    ThreadPolicy roles[THREAD_ROLE_COUNT];
+
+    ThreadTopology() {
+        roles[(int)ThreadRole::Capture] = { THREAD_PRIORITY_ABOVE_NORMAL, 0, "Capture", false };
+        roles[(int)ThreadRole::Decode] = { THREAD_PRIORITY_ABOVE_NORMAL, 0, "Playback", false };
+        roles[(int)ThreadRole::Reader] = { THREAD_PRIORITY_HIGHEST, 0, "", false };
+        roles[(int)ThreadRole::Network] = { THREAD_PRIORITY_ABOVE_NORMAL, 0, "", false };
+        roles[(int)ThreadRole::Worker] = { THREAD_PRIORITY_NORMAL, 0, "", false };
+        roles[(int)ThreadRole::Recorder] = { THREAD_PRIORITY_BELOW_NORMAL, 0, "", false };
+    }
+
+    DWORD_PTR IsolatedMask(ThreadRole except = ThreadRole::Count) const {
+        DWORD_PTR mask = 0;
+        for (int i = 0; i < THREAD_ROLE_COUNT; i++) {
+            if (i != (int)except && roles[i].isolate) mask |= roles[i].affinity;
+        }
+        return mask;
+    }
+
+    // <role> <idle|lowest|below_normal|normal|above_normal|highest|time_critical> <any|0,1,4-7> [mmcss=<задача>] [isolate]
+    bool Parse(std::istringstream& args) {
+        static const std::pair<const char*, int> priorities[] = {
+            { "idle", THREAD_PRIORITY_IDLE }, { "lowest", THREAD_PRIORITY_LOWEST }, { "below_normal", THREAD_PRIORITY_BELOW_NORMAL },
+            { "normal", THREAD_PRIORITY_NORMAL }, { "above_normal", THREAD_PRIORITY_ABOVE_NORMAL }, { "highest", THREAD_PRIORITY_HIGHEST },
+            { "time_critical", THREAD_PRIORITY_TIME_CRITICAL },
+        };
+        std::string roleName, priorityName, cores, option;
+        args >> roleName >> priorityName >> cores;
+        if (args.fail()) return false;
+
+        int role = -1;
+        for (int i = 0; i < THREAD_ROLE_COUNT; i++) if (roleName == THREAD_ROLE_NAMES[i]) role = i;
+        if (role < 0) return false;
+        ThreadPolicy policy;
+        policy.priority = INT_MIN;
+        for (const auto& p : priorities) if (priorityName == p.first) policy.priority = p.second;
+        if (policy.priority == INT_MIN || !ParseCoreList(cores, policy.affinity)) return false;
+
+        while (args >> option) {
+            if (option.rfind("mmcss=", 0) == 0) policy.mmcssTask = option.substr(6);
+            else if (option == "isolate") policy.isolate = true;
+            else return false;
+        }
+        if (policy.isolate && policy.affinity == 0) return false;
+        roles[role] = policy;
+        return true;
+    }
+
+private:
+    static bool ParseCoreList(const std::string& text, DWORD_PTR& mask) {
+        mask = 0;
+        if (text == "any") return true;
+        std::istringstream list(text);
+        std::string item;
+        while (std::getline(list, item, ',')) {
+            int first = -1, last = -1;
+            if (sscanf(item.c_str(), "%d-%d", &first, &last) != 2) last = first;
+            if (first < 0 || last < first || last >= (int)(sizeof(DWORD_PTR) * 8)) return false;
+            for (int c = first; c <= last; c++) mask |= (DWORD_PTR)1 << c;
+        }
+        return mask != 0;
+    }
+};
+
+std::mutex g_TopologyMutex;
+ThreadTopology g_Topology;
+
+void SetThreadTopology(const ThreadTopology& topology) {
+    std::lock_guard<std::mutex> lock(g_TopologyMutex);
+    g_Topology = topology;
+}
+
+ThreadTopology GetThreadTopology() {
+    std::lock_guard<std::mutex> lock(g_TopologyMutex);
+    return g_Topology;
+}
+
+// Задержка пробуждения: от момента, когда поток должен был проснуться (дедлайн кадра,
+// пакет в пустой очереди), до момента, когда он реально получил ядро.
+// Считается по потоку: у одной роли может быть несколько потоков (декодеры доп. потоков).
+struct ThreadWakeStats {
+    uint64_t wakeups = 0;
+    uint64_t wakeDelayTotalUs = 0;
+    uint64_t wakeDelayMaxUs = 0;
+    uint64_t lateWakeups = 0; // > 2 мс
+};
+
+thread_local ThreadWakeStats t_WakeStats;
+
+void RecordWakeDelay(int64_t delayUs) {
+    if (delayUs < 0) return;
+    ThreadWakeStats& s = t_WakeStats;
+    s.wakeups++;
+    s.wakeDelayTotalUs += delayUs;
+    if (delayUs > 2000) s.lateWakeups++;
+    if ((uint64_t)delayUs > s.wakeDelayMaxUs) s.wakeDelayMaxUs = (uint64_t)delayUs;
+}
+
+// Применяет политику роли к текущему потоку. Возвращает хэндл MMCSS (или nullptr) для AvRevertMmThreadCharacteristics.
+HANDLE ApplyThreadPolicy(ThreadRole role, bool keepAffinity = false) {
+    ThreadTopology topology = GetThreadTopology();
+    const ThreadPolicy& policy = topology.roles[(int)role];
+    HANDLE thread = GetCurrentThread();
+    SetThreadPriority(thread, policy.priority);
+
+    if (!keepAffinity || policy.affinity) {
+        DWORD_PTR processMask = 0, systemMask = 0;
+        GetProcessAffinityMask(GetCurrentProcess(), &processMask, &systemMask);
+        DWORD_PTR mask = policy.affinity ? policy.affinity : processMask & ~topology.IsolatedMask(role);
+        mask &= processMask;
+        if (mask) SetThreadAffinityMask(thread, mask);
+    }
+
+    if (policy.mmcssTask.empty()) return nullptr;
+    DWORD taskIndex = 0;
+    std::wstring task(policy.mmcssTask.begin(), policy.mmcssTask.end());
+    return AvSetMmThreadCharacteristicsW(task.c_str(), &taskIndex);
+}
+
+uint64_t ThreadCpuTimeUs() {
+    FILETIME created, exited, kernel, user;
+    if (!GetThreadTimes(GetCurrentThread(), &created, &exited, &kernel, &user)) return 0;
+    auto toUs = [](const FILETIME& ft) { return (((uint64_t)ft.dwHighDateTime << 32) | ft.dwLowDateTime) / 10; };
+    return toUs(kernel) + toUs(user);
+}
+
+// Для потоков конвейера: политика на время жизни объекта, при выходе - статистика в лог.
+// Не для потоков, которые join-ит UI поток (LogToGUI делает SendMessage).
+class ThreadRoleScope {
+    ThreadRole m_role;
+    HANDLE m_mmcss = nullptr;
+    ULONG64 m_startCycles = 0;
+    uint64_t m_startCpuUs = 0;
+
+public:
+    explicit ThreadRoleScope(ThreadRole role) : m_role(role) {
+        m_mmcss = ApplyThreadPolicy(role);
+        QueryThreadCycleTime(GetCurrentThread(), &m_startCycles);
+        m_startCpuUs = ThreadCpuTimeUs();
+        t_WakeStats = ThreadWakeStats();
+    }
+
+    ~ThreadRoleScope() {
+        HANDLE thread = GetCurrentThread();
+        ULONG64 cycles = 0;
+        QueryThreadCycleTime(thread, &cycles);
+        uint64_t cpuUs = ThreadCpuTimeUs() - m_startCpuUs;
+        if (m_mmcss) AvRevertMmThreadCharacteristics(m_mmcss);
+        SetThreadPriority(thread, THREAD_PRIORITY_NORMAL);
+        DWORD_PTR processMask = 0, systemMask = 0;
+        if (GetProcessAffinityMask(GetCurrentProcess(), &processMask, &systemMask)) SetThreadAffinityMask(thread, processMask);
+
+        const ThreadWakeStats& s = t_WakeStats;
+        std::string line = std::string("Thread ") + THREAD_ROLE_NAMES[(int)m_role] + ": CPU " + std::to_string(cpuUs / 1000) +
+            " ms, " + std::to_string((cycles - m_startCycles) / 1000000) + " Mcycles";
+        if (s.wakeups > 0) {
+            line += ", wake delay avg " + std::to_string(s.wakeDelayTotalUs / s.wakeups) + " us / max " +
+                std::to_string(s.wakeDelayMaxUs) + " us, late (>2 ms) " + std::to_string(s.lateWakeups) +
+                " of " + std::to_string(s.wakeups);
+        }
+        LogToGUI(line);
+    }
+};
+
+// ==========================================
+// ПУЛ ПОТОКОВ (JOB SYSTEM)
+// ==========================================
+// Один пул на процесс: по воркеру на физическое ядро (кроме первого), у каждого своя
+// очередь, свободные воркеры воруют задачи у соседей. Вызывающий поток тоже выполняет
+// задачи, пока ждёт свою группу. Поэтому несколько потоков/стримов делят одни и те же
+// ядра и не плодят лишних потоков.
+const int JOB_MIN_BAND_ROWS = 64;
+
+class TaskGroup {
+    friend class JobSystem;
+    std::atomic<int> m_pending{ 0 };
+};
+
+class JobSystem {
+    struct Task {
+        std::function<void()> fn;
+        TaskGroup* group = nullptr;
+    };
+    struct WorkerQueue {
+        std::mutex m;
+        std::deque<Task> tasks;
+    };
+
+    std::vector<std::unique_ptr<WorkerQueue>> m_queues;
+    std::vector<std::thread> m_threads;
+    std::mutex m_sleepMutex;
+    std::condition_variable m_sleepCv;
+    std::atomic<int> m_queued{ 0 };
+    std::atomic<unsigned> m_nextQueue{ 0 };
+    std::atomic<bool> m_stop{ false };
+    std::once_flag m_startOnce;
+
+    static thread_local int t_workerIndex;
+
+    // По одному логическому процессору на физическое ядро: SMT-соседи делят те же ALU и кэш
+    static std::vector<GROUP_AFFINITY> EnumeratePhysicalCores() {
+        std::vector<GROUP_AFFINITY> cores;
+        DWORD len = 0;
+        GetLogicalProcessorInformationEx(RelationProcessorCore, nullptr, &len);
+        std::vector<uint8_t> buf(len);
+        if (len == 0 || !GetLogicalProcessorInformationEx(RelationProcessorCore, (PSYSTEM_LOGICAL_PROCESSOR_INFORMATION_EX)buf.data(), &len)) return cores;
+        for (DWORD offset = 0; offset < len;) {
+            auto info = (PSYSTEM_LOGICAL_PROCESSOR_INFORMATION_EX)(buf.data() + offset);
+            GROUP_AFFINITY affinity = info->Processor.GroupMask[0];
+            affinity.Mask &= ~(affinity.Mask - 1);
+            cores.push_back(affinity);
+            offset += info->Size;
+        }
+        return cores;
+    }
+
+    void Start() {
+        std::vector<GROUP_AFFINITY> cores = EnumeratePhysicalCores();
+        // Ядра изолированных ролей (thread=... isolate) воркерам не достаются
+        DWORD_PTR isolated = GetThreadTopology().IsolatedMask(ThreadRole::Worker);
+        cores.erase(std::remove_if(cores.begin(), cores.end(), [isolated](const GROUP_AFFINITY& a) {
+            return a.Group == 0 && (a.Mask & isolated) != 0;
+        }), cores.end());
+        size_t workers = cores.size() > 1 ? cores.size() - 1 : 0;
+        if (cores.empty()) workers = std::max(1u, std::thread::hardware_concurrency()) - 1;
+        for (size_t i = 0; i < workers; i++) m_queues.push_back(std::make_unique<WorkerQueue>());
+        for (size_t i = 0; i < workers; i++) {
+            GROUP_AFFINITY affinity = {};
+            if (i + 1 < cores.size()) affinity = cores[i + 1];
+            m_threads.emplace_back([this, i, affinity] { WorkerLoop((int)i, affinity); });
+        }
+    }
+
+    void EnsureStarted() {
+        std::call_once(m_startOnce, [this] { Start(); });
+    }
+
+    bool PopTask(int self, Task& task) {
+        int count = (int)m_queues.size();
+        // Своя очередь с конца (горячий кэш), чужие с начала
+        if (self >= 0) {
+            WorkerQueue& q = *m_queues[self];
+            std::lock_guard<std::mutex> lock(q.m);
+            if (!q.tasks.empty()) {
+                task = std::move(q.tasks.back());
+                q.tasks.pop_back();
+                m_queued--;
+                return true;
+            }
+        }
+        int start = self >= 0 ? self + 1 : 0;
+        for (int i = 0; i < count; i++) {
+            WorkerQueue& q = *m_queues[(start + i) % count];
+            std::lock_guard<std::mutex> lock(q.m);
+            if (!q.tasks.empty()) {
+                task = std::move(q.tasks.front());
+                q.tasks.pop_front();
+                m_queued--;
+                return true;
+            }
+        }
+        return false;
+    }
+
+    static void RunTask(Task& task) {
+        task.fn();
+        task.group->m_pending--;
+    }
+
+    void WorkerLoop(int index, GROUP_AFFINITY affinity) {
+        t_workerIndex = index;
+        if (affinity.Mask) SetThreadGroupAffinity(GetCurrentThread(), &affinity, nullptr);
+        HANDLE mmcss = ApplyThreadPolicy(ThreadRole::Worker, affinity.Mask != 0);
+        Task task;
+        while (!m_stop) {
+            if (PopTask(index, task)) {
+                RunTask(task);
+                continue;
+            }
+            std::unique_lock<std::mutex> lock(m_sleepMutex);
+            m_sleepCv.wait(lock, [this] { return m_stop || m_queued > 0; });
+        }
+        if (mmcss) AvRevertMmThreadCharacteristics(mmcss);
+    }
+
+public:
+    ~JobSystem() {
+        {
+            std::lock_guard<std::mutex> lock(m_sleepMutex);
+            m_stop = true;
+        }
+        m_sleepCv.notify_all();
+        for (std::thread& t : m_threads) t.join();
+    }
+
+    int WorkerCount() {
+        EnsureStarted();
+        return (int)m_queues.size();
+    }
+
+    void Run(TaskGroup& group, std::function<void()> fn) {
+        EnsureStarted();
+        if (m_queues.empty()) {
+            fn();
+            return;
+        }
+        group.m_pending++;
+        int index = t_workerIndex >= 0 ? t_workerIndex : (int)(m_nextQueue++ % m_queues.size());
+        {
+            WorkerQueue& q = *m_queues[index];
+            std::lock_guard<std::mutex> lock(q.m);
+            q.tasks.push_back({ std::move(fn), &group });
+        }
+        {
+            std::lock_guard<std::mutex> lock(m_sleepMutex);
+            m_queued++;
+        }
+        m_sleepCv.notify_one();
+    }
+
+    // Ожидающий поток не простаивает, а выполняет любые задачи из очередей
+    void Wait(TaskGroup& group) {
+        Task task;
+        while (group.m_pending > 0) {
+            if (PopTask(t_workerIndex, task)) RunTask(task);
+            else std::this_thread::yield();
+        }
+    }
+
+    // Делит [0, count) на диапазоны не меньше grain, по одному на воркер плюс вызывающий поток
+    void ParallelFor(int count, int grain, const std::function<void(int, int)>& fn) {
+        int parts = std::min(WorkerCount() + 1, count / std::max(grain, 1));
+        if (parts <= 1) {
+            if (count > 0) fn(0, count);
+            return;
+        }
+        TaskGroup group;
+        for (int i = 1; i < parts; i++) {
+            int begin = (int)((int64_t)count * i / parts);
+            int end = (int)((int64_t)count * (i + 1) / parts);
+            Run(group, [&fn, begin, end] { fn(begin, end); });
+        }
+        fn(0, (int)((int64_t)count / parts));
+        Wait(group);
+    }
+};
+
+thread_local int JobSystem::t_workerIndex = -1;
+
+JobSystem g_Jobs;
+
+// sws_scale по горизонтальным полосам: у каждой полосы свой SwsContext, полосы идут параллельно.
+// Масштаб 1:1 по вертикали, поэтому полосы независимы.
+class BandedScaler {
+    std::vector<SwsContext*> m_bands;
+    std::vector<int> m_bandStart;
+    int m_width = 0, m_height = 0;
+    AVPixelFormat m_srcFmt = AV_PIX_FMT_NONE, m_dstFmt = AV_PIX_FMT_NONE;
+
+    // Сдвигает указатели плоскостей на row строк изображения с учётом субдискретизации цветности
+    static void OffsetPlanes(AVPixelFormat fmt, const uint8_t* const in[4], const int stride[4], int row, uint8_t* out[4]) {
+        const AVPixFmtDescriptor* desc = av_pix_fmt_desc_get(fmt);
+        for (int p = 0; p < 4; p++) {
+            if (!in[p]) {
+                out[p] = nullptr;
+                continue;
+            }
+            int shift = (p == 1 || p == 2) && desc && !(desc->flags & AV_PIX_FMT_FLAG_PAL) ? desc->log2_chroma_h : 0;
+            out[p] = (uint8_t*)in[p] + (ptrdiff_t)(row >> shift) * stride[p];
+        }
+    }
+
+public:
+    ~BandedScaler() { Reset(); }
+
+    void Reset() {
+        for (SwsContext* ctx : m_bands) sws_freeContext(ctx);
+        m_bands.clear();
+        m_bandStart.clear();
+        m_width = m_height = 0;
+    }
+
+    bool Configure(int width, int height, AVPixelFormat srcFmt, AVPixelFormat dstFmt) {
+        if (width == m_width && height == m_height && srcFmt == m_srcFmt && dstFmt == m_dstFmt) return !m_bands.empty();
+        Reset();
+        m_width = width;
+        m_height = height;
+        m_srcFmt = srcFmt;
+        m_dstFmt = dstFmt;
+
+        int bands = std::max(1, std::min(g_Jobs.WorkerCount() + 1, height / JOB_MIN_BAND_ROWS));
+        for (int i = 0; i <= bands; i++) {
+            // Границы кратны 16: чётны для NV12/420 и выровнены для SIMD-путей swscale
+            m_bandStart.push_back(i == bands ? height : (int)((int64_t)height * i / bands) & ~15);
+        }
+        for (int i = 0; i < bands; i++) {
+            int rows = m_bandStart[i + 1] - m_bandStart[i];
+            SwsContext* ctx = sws_getContext(width, rows, srcFmt, width, rows, dstFmt, SWS_POINT, nullptr, nullptr, nullptr);
+            if (!ctx) {
+                Reset();
+                return false;
+            }
+            m_bands.push_back(ctx);
+        }
+        return true;
+    }
+
+    void Scale(const uint8_t* const src[4], const int srcStride[4], uint8_t* const dst[4], const int dstStride[4]) {
+        g_Jobs.ParallelFor((int)m_bands.size(), 1, [&](int begin, int end) {
+            for (int i = begin; i < end; i++) {
+                uint8_t* s[4];
+                uint8_t* d[4];
+                OffsetPlanes(m_srcFmt, src, srcStride, m_bandStart[i], s);
+                OffsetPlanes(m_dstFmt, dst, dstStride, m_bandStart[i], d);
+                sws_scale(m_bands[i], s, srcStride, 0, m_bandStart[i + 1] - m_bandStart[i], d, dstStride);
+            }
+        });
+    }
+};
+
+// ==========================================
+// ПУЛ ПАКЕТОВ (AVPacket + PAYLOAD)
+// ==========================================
+// Оболочки AVPacket и буферы access unit переиспользуются между читателем и декодером,
+// так что в установившемся режиме на пакет нет ни одного malloc/free.
+// Буферы раздаются по классам размеров через AVBufferPool; больше старшего класса - обычный av_buffer_alloc.
+const size_t PACKET_POOL_CLASSES[] = { 64 * 1024, 256 * 1024, 1024 * 1024, 4 * 1024 * 1024 };
+const size_t PACKET_POOL_MAX_SHELLS = 1024;
+
+class PacketPool {
+    static const int CLASS_COUNT = sizeof(PACKET_POOL_CLASSES) / sizeof(PACKET_POOL_CLASSES[0]);
+
+    std::mutex m_mutex;
+    std::vector<AVPacket*> m_shells;
+    AVBufferPool* m_pools[CLASS_COUNT] = {};
+    std::once_flag m_poolsOnce;
+
+#if LIBAVUTIL_VERSION_MAJOR >= 57
+    static AVBufferRef* AllocPooled(void* opaque, size_t size) {
+#else
+    static AVBufferRef* AllocPooled(void* opaque, int size) {
+#endif
+        ((PacketPool*)opaque)->payloadAllocs++;
+        return av_buffer_alloc(size);
+    }
+
+public:
+    std::atomic<uint64_t> shellAllocs{ 0 };
+    std::atomic<uint64_t> shellReuses{ 0 };
+    std::atomic<uint64_t> payloadAllocs{ 0 };
+    std::atomic<uint64_t> payloadRequests{ 0 };
+    std::atomic<uint64_t> oversizeAllocs{ 0 };
+
+    ~PacketPool() {
+        for (AVPacket*& pkt : m_shells) av_packet_free(&pkt);
+        // Буферы, ещё живущие в пакетах, пул освободит при возврате
+        for (AVBufferPool*& pool : m_pools) av_buffer_pool_uninit(&pool);
+    }
+
+    AVPacket* Acquire() {
+        {
+            std::lock_guard<std::mutex> lock(m_mutex);
+            if (!m_shells.empty()) {
+                AVPacket* pkt = m_shells.back();
+                m_shells.pop_back();
+                shellReuses++;
+                return pkt;
+            }
+        }
+        shellAllocs++;
+        return av_packet_alloc();
+    }
+
+    // Замена av_packet_free для пакетов из очереди
+    void Release(AVPacket** pkt) {
+        if (!*pkt) return;
+        av_packet_unref(*pkt);
+        {
+            std::lock_guard<std::mutex> lock(m_mutex);
+            if (m_shells.size() < PACKET_POOL_MAX_SHELLS) {
+                m_shells.push_back(*pkt);
+                *pkt = nullptr;
+                return;
+            }
+        }
+        av_packet_free(pkt);
+    }
+
+    // Буфер вместимостью не меньше capacity (+ padding, который в capacity не входит)
+    AVBufferRef* AllocPayload(size_t capacity) {
+        std::call_once(m_poolsOnce, [this] {
+            for (int i = 0; i < CLASS_COUNT; i++) {
+                m_pools[i] = av_buffer_pool_init2((int)(PACKET_POOL_CLASSES[i] + AV_INPUT_BUFFER_PADDING_SIZE), this, AllocPooled, nullptr);
+            }
+        });
+        payloadRequests++;
+        for (int i = 0; i < CLASS_COUNT; i++) {
+            if (capacity <= PACKET_POOL_CLASSES[i] && m_pools[i]) return av_buffer_pool_get(m_pools[i]);
+        }
+        oversizeAllocs++;
+        return av_buffer_alloc((int)(capacity + AV_INPUT_BUFFER_PADDING_SIZE));
+    }
+
+    // Переносит used байт в буфер следующего подходящего класса
+    bool GrowPayload(AVBufferRef** buf, size_t used, size_t capacity) {
+        AVBufferRef* grown = AllocPayload(capacity);
+        if (!grown) return false;
+        if (*buf) memcpy(grown->data, (*buf)->data, used);
+        av_buffer_unref(buf);
+        *buf = grown;
+        return true;
+    }
+
+    std::string Stats() {
+        uint64_t requests = payloadRequests, allocs = payloadAllocs, oversize = oversizeAllocs;
+        return "Packet pool: shells " + std::to_string(shellAllocs) + " allocated / " + std::to_string(shellReuses) + " reused, payload " +
+            std::to_string(allocs + oversize) + " allocated / " + std::to_string(requests - allocs - oversize) + " reused";
+    }
+};
+
+PacketPool g_PacketPool;
+
 // ==========================================
 // THREAD-SAFE PACKET QUEUE
 // ==========================================
@@ -152,18 +721,26 @@ private:
     std::mutex m;
     std::condition_variable cv;
     std::atomic<bool> finished;
+    std::chrono::steady_clock::time_point firstPushTime;
 public:
     PacketQueue() : finished(false) {}
 
     void push(AVPacket* pkt) {
         std::lock_guard<std::mutex> lock(m);
+        if (q.empty()) firstPushTime = std::chrono::steady_clock::now();
         q.push(pkt);
         cv.notify_one();
     }
 
-    AVPacket* pop(bool& isFinished) {
+    // wakeDelayUs: если пришлось ждать - время от push до пробуждения потребителя, иначе -1
+    AVPacket* pop(bool& isFinished, int64_t* wakeDelayUs = nullptr) {
         std::unique_lock<std::mutex> lock(m);
+        bool waited = q.empty() && !finished;
         cv.wait(lock, [this] { return !q.empty() || finished; });
+        if (wakeDelayUs) {
+            *wakeDelayUs = waited && !q.empty()
+                ? std::chrono::duration_cast<std::chrono::microseconds>(std::chrono::steady_clock::now() - firstPushTime).count() : -1;
+        }
 
         if (q.empty()) {
             isFinished = finished;
@@ -187,7 +764,7 @@ public:
         while (!q.empty()) {
             AVPacket* pkt = q.front();
             q.pop();
-            av_packet_free(&pkt);
+            g_PacketPool.Release(&pkt);
         }
     }
 };
@@ -195,6 +772,273 @@ public:
 // ==========================================
 // СЕТЕВАЯ ЧАСТЬ
 // ==========================================
+// --- RTP + NACK (опциональная надёжность) ---
+// С включённым "RTP + NACK" каждая датаграмма получает RTP заголовок и сохраняется
+// в истории. Приёмник присылает RTCP Generic NACK (RFC 4585) на NACK_PORT, и пакет
+// переотправляется, только если он ещё не устарел и позволяет бюджет переотправки.
+const int NACK_PORT = UDP_PORT + 1;
+const int RTP_HEADER_SIZE = 12;
+const int RTP_PT_MP2T = 33;
+const int RTP_PT_RAW = 96;
+// История покрывает RTP_HISTORY_MAX_AGE_MS при номинальном битрейте выхода (SizeHistory при
+// настройке потока, сырой 1080p кадр - это ~4700 датаграмм). Память выделяется при первой RTP
+// отправке, до блокировок. Слот ~1.3 KB: на выход от ~5.4 MB до ~86 MB в худшем случае.
+const int RTP_HISTORY_MIN_SLOTS = 4096; // степень двойки
+const int RTP_HISTORY_MAX_SLOTS = 1 << 16; // всё пространство номеров RTP
+const int RTP_HISTORY_HEADROOM = 2; // запас на всплески: ключевые кадры, кадр целиком за раз
+const int64_t RTP_HISTORY_MAX_AGE_MS = 250; // старше - уже не успеет к плейауту
+const double RTP_RETRANSMIT_SHARE = 0.2; // доля от живого трафика
+const double RTP_RETRANSMIT_BURST = 512 * 1024;
+const int NACK_STATS_INTERVAL_MS = 10000;
+// Scatter-gather отправка: датаграмма из сегментов строк. Строка не короче
+// UDP_GATHER_MIN_ROW_BYTES, чтобы датаграмма гарантированно уложилась в сегменты.
+const bool USE_GATHER_SEND = true;
+const int UDP_GATHER_MAX_SEGMENTS = 32;
+const int UDP_GATHER_MIN_ROW_BYTES = UDP_PACKET_SIZE / (UDP_GATHER_MAX_SEGMENTS - 2) + 1;
+
+std::atomic<bool> g_IsReliableUdp(false);
+
+class UdpOutput {
+    struct HistorySlot {
+        uint8_t data[RTP_HEADER_SIZE + UDP_PACKET_SIZE];
+        int len = 0;
+        uint16_t seq = 0;
+        int64_t sentMs = 0;
+    };
+
+    std::vector<HistorySlot> m_history;
+    std::atomic<size_t> m_historySlots{ RTP_HISTORY_MIN_SLOTS }; // нужный размер
+    std::atomic<size_t> m_historySize{ 0 }; // выделенный размер
+    std::mutex m_mutex; // история и токены; держится на одну датаграмму
+    std::mutex m_sendMutex; // датаграммы одного кадра не перемешиваются с чужими
+    uint16_t m_seq = 0;
+    double m_tokens = RTP_RETRANSMIT_BURST;
+
+public:
+    sockaddr_in addr = {};
+    uint32_t ssrc = 0;
+    std::atomic<int> payloadType{ RTP_PT_MP2T };
+
+    std::atomic<uint64_t> resent{ 0 };
+    std::atomic<uint64_t> expired{ 0 };
+    std::atomic<uint64_t> rateLimited{ 0 };
+
+    void Init(uint32_t ip, int port) {
+        addr.sin_family = AF_INET;
+        addr.sin_port = htons(port);
+        addr.sin_addr.s_addr = ip;
+        ssrc = ((uint32_t)GetTickCount() * 2654435761u) ^ (uint32_t)GetCurrentProcessId() ^ (uint32_t)port;
+    }
+
+    // Размер истории по номинальному битрейту выхода; применяется при следующей RTP отправке
+    void SizeHistory(int64_t bytesPerSecond) {
+        int64_t packets = bytesPerSecond * RTP_HISTORY_MAX_AGE_MS / 1000 / UDP_PACKET_SIZE * RTP_HISTORY_HEADROOM;
+        size_t slots = RTP_HISTORY_MIN_SLOTS;
+        while ((int64_t)slots < packets && slots < RTP_HISTORY_MAX_SLOTS) slots *= 2;
+        m_historySlots = slots;
+    }
+
+    // originUs: время захвата кадра (LatencyNowUs), уходит в RTP timestamp; 0 - время отправки
+    void Send(SOCKET sock, const uint8_t* data, int size, int64_t originUs = 0) {
+        SendRows(sock, data, size, size, 1, originUs);
+    }
+
+    // Кадр из rows строк по rowBytes с шагом pitch (например, mapped staging texture).
+    // Датаграммы собираются из WSABUF прямо по строкам, без промежуточной копии кадра.
+    // WSASendTo без overlapped возвращает управление, когда стек уже забрал данные,
+    // поэтому Unmap сразу после вызова безопасен. В RTP режиме пакет всё равно
+    // копируется один раз - в слот истории, из которого возможна переотправка.
+    bool SendRows(SOCKET sock, const uint8_t* base, int pitch, int rowBytes, int rows, int64_t originUs = 0) {
+        if (rows > 1 && rowBytes < UDP_GATHER_MIN_ROW_BYTES) return false;
+        int size = rowBytes * rows;
+        int row = 0, rowOffset = 0;
+        WSABUF bufs[UDP_GATHER_MAX_SEGMENTS];
+        auto gather = [&](int chunkSize) {
+            int count = 0;
+            while (chunkSize > 0) {
+                int take = std::min(chunkSize, rowBytes - rowOffset);
+                bufs[count].buf = (CHAR*)(base + (size_t)row * pitch + rowOffset);
+                bufs[count].len = (ULONG)take;
+                count++;
+                chunkSize -= take;
+                rowOffset += take;
+                if (rowOffset == rowBytes) {
+                    row++;
+                    rowOffset = 0;
+                }
+            }
+            return (DWORD)count;
+        };
+
+        if (!g_IsReliableUdp) {
+            int sent = 0;
+            while (sent < size) {
+                int chunkSize = std::min(UDP_PACKET_SIZE, size - sent);
+                DWORD bytesSent = 0;
+                WSASendTo(sock, bufs, gather(chunkSize), &bytesSent, 0, (sockaddr*)&addr, sizeof(addr), nullptr, nullptr);
+                sent += chunkSize;
+            }
+            return true;
+        }
+
+        size_t slots = m_historySlots;
+        if (m_historySize != slots) {
+            // Выделение и обнуление - вне блокировок: NACK и другие отправки не ждут
+            std::vector<HistorySlot> history(slots);
+            std::lock_guard<std::mutex> lock(m_mutex);
+            m_history.swap(history);
+            m_historySize = slots;
+        }
+
+        int64_t nowMs = NowMs();
+        uint32_t rtpTime = originUs > 0 ? (uint32_t)(originUs * 9 / 100) : (uint32_t)(nowMs * 90);
+        std::lock_guard<std::mutex> sendLock(m_sendMutex);
+
+        int sent = 0;
+        while (sent < size) {
+            int chunkSize = std::min(UDP_PACKET_SIZE, size - sent);
+            bool last = (sent + chunkSize == size);
+            // NACK ждёт только одну датаграмму, а не весь кадр
+            std::lock_guard<std::mutex> lock(m_mutex);
+            uint16_t seq = m_seq++;
+
+            // Пакет собирается сразу в слоте истории, отправляется оттуда же
+            HistorySlot& slot = m_history[seq & (m_history.size() - 1)];
+            uint8_t* p = slot.data;
+            p[0] = 0x80;
+            p[1] = (uint8_t)((last ? 0x80 : 0) | (payloadType & 0x7F));
+            p[2] = (uint8_t)(seq >> 8);
+            p[3] = (uint8_t)seq;
+            WriteBE32(p + 4, rtpTime);
+            WriteBE32(p + 8, ssrc);
+            uint8_t* dst = p + RTP_HEADER_SIZE;
+            DWORD count = gather(chunkSize);
+            for (DWORD i = 0; i < count; i++) {
+                memcpy(dst, bufs[i].buf, bufs[i].len);
+                dst += bufs[i].len;
+            }
+            slot.len = RTP_HEADER_SIZE + chunkSize;
+            slot.seq = seq;
+            slot.sentMs = nowMs;
+
+            sendto(sock, (const char*)slot.data, slot.len, 0, (sockaddr*)&addr, sizeof(addr));
+            m_tokens = std::min(RTP_RETRANSMIT_BURST, m_tokens + chunkSize * RTP_RETRANSMIT_SHARE);
+            sent += chunkSize;
+        }
+        return true;
+    }
+
+    void Retransmit(SOCKET sock, uint16_t seq) {
+        int64_t nowMs = NowMs();
+        std::lock_guard<std::mutex> lock(m_mutex);
+        if (m_history.empty()) return;
+        HistorySlot& slot = m_history[seq & (m_history.size() - 1)];
+        if (slot.len == 0 || slot.seq != seq || nowMs - slot.sentMs > RTP_HISTORY_MAX_AGE_MS) {
+            expired++;
+            return;
+        }
+        if (m_tokens < slot.len) {
+            rateLimited++;
+            return;
+        }
+        m_tokens -= slot.len;
+
+        // Переотправка туда же, куда идёт поток. Адрес отправителя NACK не проверен (UDP легко
+        // подделать), и ответ на него превращал бы сервер в усилитель трафика на чужой адрес.
+        sendto(sock, (const char*)slot.data, slot.len, 0, (sockaddr*)&addr, sizeof(addr));
+        resent++;
+    }
+
+    static int64_t NowMs() {
+        return std::chrono::duration_cast<std::chrono::milliseconds>(std::chrono::steady_clock::now().time_since_epoch()).count();
+    }
+
+private:
+    static void WriteBE32(uint8_t* p, uint32_t v) {
+        p[0] = (uint8_t)(v >> 24);
+        p[1] = (uint8_t)(v >> 16);
+        p[2] = (uint8_t)(v >> 8);
+        p[3] = (uint8_t)v;
+    }
+};
+
+UdpOutput g_MainOutput;
+std::vector<UdpOutput*> g_UdpOutputs;
+std::mutex g_UdpOutputsMutex;
+SOCKET g_NackSocket = INVALID_SOCKET;
+std::thread g_NackThread;
+
+void RegisterUdpOutput(UdpOutput* output) {
+    std::lock_guard<std::mutex> lock(g_UdpOutputsMutex);
+    g_UdpOutputs.push_back(output);
+}
+
+void UnregisterUdpOutput(UdpOutput* output) {
+    std::lock_guard<std::mutex> lock(g_UdpOutputsMutex);
+    g_UdpOutputs.erase(std::remove(g_UdpOutputs.begin(), g_UdpOutputs.end(), output), g_UdpOutputs.end());
+}
+
+// Разбор RTCP compound пакета: интересуют только RTPFB (205) / FMT 1 (Generic NACK)
+void HandleRtcpPacket(const uint8_t* buf, int len) {
+    while (len >= 12) {
+        int fmt = buf[0] & 0x1F;
+        int pt = buf[1];
+        int words = (buf[2] << 8) | buf[3];
+        int pktLen = (words + 1) * 4;
+        if ((buf[0] >> 6) != 2 || pktLen > len) return;
+
+        if (pt == 205 && fmt == 1) {
+            uint32_t mediaSsrc = ((uint32_t)buf[8] << 24) | ((uint32_t)buf[9] << 16) | ((uint32_t)buf[10] << 8) | buf[11];
+            std::lock_guard<std::mutex> lock(g_UdpOutputsMutex);
+            for (UdpOutput* output : g_UdpOutputs) {
+                if (output->ssrc != mediaSsrc) continue;
+                for (int off = 12; off + 4 <= pktLen; off += 4) {
+                    uint16_t pid = (uint16_t)((buf[off] << 8) | buf[off + 1]);
+                    uint16_t blp = (uint16_t)((buf[off + 2] << 8) | buf[off + 3]);
+                    output->Retransmit(g_UdpSocket, pid);
+                    for (int bit = 0; bit < 16; bit++) {
+                        if (blp & (1 << bit)) output->Retransmit(g_UdpSocket, (uint16_t)(pid + bit + 1));
+                    }
+                }
+            }
+        }
+        buf += pktLen;
+        len -= pktLen;
+    }
+}
+
+void RunNackListenerThread() {
+    HANDLE mmcss = ApplyThreadPolicy(ThreadRole::Network);
+    uint8_t buf[1500];
+    int64_t lastStatsMs = UdpOutput::NowMs();
+    uint64_t lastResent = 0, lastExpired = 0, lastLimited = 0;
+    while (g_Running) {
+        int len = recv(g_NackSocket, (char*)buf, sizeof(buf), 0);
+        if (len > 0) HandleRtcpPacket(buf, len);
+
+        int64_t nowMs = UdpOutput::NowMs();
+        if (nowMs - lastStatsMs < NACK_STATS_INTERVAL_MS) continue;
+        lastStatsMs = nowMs;
+        uint64_t resent = 0, expired = 0, limited = 0;
+        {
+            std::lock_guard<std::mutex> lock(g_UdpOutputsMutex);
+            for (UdpOutput* output : g_UdpOutputs) {
+                resent += output->resent;
+                expired += output->expired;
+                limited += output->rateLimited;
+            }
+        }
+        if (resent != lastResent || expired != lastExpired || limited != lastLimited) {
+            LogToGUI("NACK: " + std::to_string(resent - lastResent) + " resent, " + std::to_string(expired - lastExpired) +
+                " expired, " + std::to_string(limited - lastLimited) + " rate-limited");
+        }
+        lastResent = resent;
+        lastExpired = expired;
+        lastLimited = limited;
+    }
+    if (mmcss) AvRevertMmThreadCharacteristics(mmcss);
+}
+
 void InitNetwork() {
     WSADATA wsaData;
     WSAStartup(MAKEWORD(2, 2), &wsaData);
@@ -209,501 +1053,3711 @@ void InitNetwork() {
         g_UdpDestAddr.sin_family = AF_INET;
         g_UdpDestAddr.sin_port = htons(UDP_PORT);
         g_UdpDestAddr.sin_addr.s_addr = INADDR_BROADCAST;
+
+        g_MainOutput.Init(INADDR_BROADCAST, UDP_PORT);
+        RegisterUdpOutput(&g_MainOutput);
+    }
+
+    g_NackSocket = socket(AF_INET, SOCK_DGRAM, IPPROTO_UDP);
+    if (g_NackSocket != INVALID_SOCKET) {
+        sockaddr_in local = {};
+        local.sin_family = AF_INET;
+        local.sin_port = htons(NACK_PORT);
+        local.sin_addr.s_addr = INADDR_ANY;
+        DWORD timeoutMs = 200;
+        setsockopt(g_NackSocket, SOL_SOCKET, SO_RCVTIMEO, (char*)&timeoutMs, sizeof(timeoutMs));
+        if (bind(g_NackSocket, (sockaddr*)&local, sizeof(local)) == 0) {
+            g_NackThread = std::thread(RunNackListenerThread);
+        }
+        else {
+            closesocket(g_NackSocket);
+            g_NackSocket = INVALID_SOCKET;
+        }
     }
 }
 
-void SendUdpData(const uint8_t* data, int size) {
+void ShutdownNetwork() {
+    if (g_NackThread.joinable()) g_NackThread.join();
+    if (g_NackSocket != INVALID_SOCKET) closesocket(g_NackSocket);
+    if (g_UdpSocket != INVALID_SOCKET) closesocket(g_UdpSocket);
+    WSACleanup();
+}
+
+void SendUdpData(const uint8_t* data, int size, int64_t originUs = 0) {
     if (!g_IsStreamNetwork || g_UdpSocket == INVALID_SOCKET) return;
-    int sent = 0;
-    while (sent < size) {
-        int chunkSize = std::min(UDP_PACKET_SIZE, size - sent);
-        sendto(g_UdpSocket, (const char*)(data + sent), chunkSize, 0, (sockaddr*)&g_UdpDestAddr, sizeof(g_UdpDestAddr));
-        sent += chunkSize;
-    }
+    g_MainOutput.Send(g_UdpSocket, data, size, originUs);
 }
 
 // ==========================================
-// ЛОГИКА РЕСАЙЗА (GUI)
+// ЗАДЕРЖКА (LATENCY PROBES)
 // ==========================================
-void UpdateVideoLayout(int contentW, int contentH) {
-    if (!g_hMainWindow || !g_hVideoWindow) return;
-    if (contentW <= 0 || contentH <= 0) return;
-
-    RECT rcMain;
-    GetClientRect(g_hMainWindow, &rcMain);
+// Каждый кадр несёт время своего начала: AcquireFrame в режиме захвата, чтение из pipe в режиме OBS.
+// Стадии отмечают задержку от этого момента, раз в 10 с в лог пишутся p50/p95/p99.
+// В RTP режиме время захвата уходит в RTP timestamp (90 кГц от того же steady clock).
+// Поэтому приёмник на той же машине (latency_loopback=1 в streams.ini) меряет полный путь
+// до собранного кадра. Вместе с source=synthetic это нагрузочный прогон без рабочего стола.
+const int LATENCY_SAMPLES = 4096;
+const int LATENCY_REPORT_INTERVAL_MS = 10000;
+const size_t LATENCY_MAX_PENDING = 512;
+
+enum LatencyStage { LAT_READBACK, LAT_SENT, LAT_PRESENT, LAT_RECEIVED, LAT_DEQUEUED, LAT_DECODED, LAT_STAGE_COUNT };
+const char* LATENCY_STAGE_NAMES[LAT_STAGE_COUNT] = {
+    "capture->readback", "capture->sent", "origin->present", "capture->received", "ingest->dequeue", "ingest->decoded"
+};
 
-    int availW = rcMain.right - rcMain.left;
-    int startY = TOP_PANEL_HEIGHT + CONSOLE_HEIGHT;
-    int availH = (rcMain.bottom - rcMain.top) - startY;
+int64_t LatencyNowUs() {
+    return std::chrono::duration_cast<std::chrono::microseconds>(std::chrono::steady_clock::now().time_since_epoch()).count();
+}
 
-    if (availH <= 0) return;
-    float scaleX = (float)availW / contentW;
-    float scaleY = (float)availH / contentH;
-    float scale = std::min(scaleX, scaleY);
-    int newW = (int)(contentW * scale);
-    int newH = (int)(contentH * scale);
+class LatencyProbe {
+    struct StageSamples {
+        std::vector<int64_t> ring;
+        uint64_t count = 0;
+    };
 
-    int x = (availW - newW) / 2;
-    int y = startY + (availH - newH) / 2;
+    std::mutex m_mutex;
+    StageSamples m_stages[LAT_STAGE_COUNT];
+    std::map<int64_t, int64_t> m_ingestByPts; // pipe: pts -> время чтения первого байта AU
+    int64_t m_lastReportUs = 0;
 
-    SetWindowPos(g_hVideoWindow, NULL, x, y, newW, newH, SWP_NOZORDER | SWP_NOACTIVATE);
-}
+public:
+    std::atomic<int> budgetMs{ 0 }; // 0 - без проверки
+    std::atomic<uint64_t> incompleteFrames{ 0 };
 
-// ==========================================
-// ШЕЙДЕРЫ И РЕНДЕР
-// ==========================================
+    void Record(LatencyStage stage, int64_t originUs) {
+        if (originUs > 0) RecordSample(stage, LatencyNowUs() - originUs);
+    }
 
-const char* HLSL_NV12_TO_RGB = R"(
-    Texture2D<float> InputY : register(t0);
-    Texture2D<float2> InputUV : register(t1);
-    RWTexture2D<float4> OutputRGB : register(u0);
+    void RecordSample(LatencyStage stage, int64_t latencyUs) {
+        int64_t nowUs = LatencyNowUs();
+        std::string report;
+        {
+            std::lock_guard<std::mutex> lock(m_mutex);
+            StageSamples& s = m_stages[stage];
+            if (s.ring.empty()) s.ring.resize(LATENCY_SAMPLES);
+            s.ring[s.count++ % LATENCY_SAMPLES] = latencyUs;
+            if (m_lastReportUs == 0) m_lastReportUs = nowUs;
+            if (nowUs - m_lastReportUs >= LATENCY_REPORT_INTERVAL_MS * 1000ll) {
+                m_lastReportUs = nowUs;
+                report = BuildReportLocked();
+            }
+        }
+        // LogToGUI делает SendMessage: только вне блокировки
+        if (!report.empty()) LogToGUI(report);
+    }
 
-    [numthreads(8, 8, 1)]
-    void CSMain(uint3 dispatchThreadId : SV_DispatchThreadID) {
-        uint2 pos = dispatchThreadId.xy;
-        uint width, height;
-        OutputRGB.GetDimensions(width, height);
-        if (pos.x >= width || pos.y >= height) return;
-        
-        float Y = InputY[uint2(pos.x, pos.y)];
-        float2 UV = InputUV[uint2(pos.x / 2, pos.y / 2)];
-        float U = UV.x - 0.5f;
-        float V = UV.y - 0.5f;
+    void MarkIngest(int64_t pts, int64_t ingestUs) {
+        if (pts == AV_NOPTS_VALUE) return;
+        std::lock_guard<std::mutex> lock(m_mutex);
+        m_ingestByPts[pts] = ingestUs;
+        while (m_ingestByPts.size() > LATENCY_MAX_PENDING) m_ingestByPts.erase(m_ingestByPts.begin());
+    }
 
-        float r = Y + 1.13983f * V;
-        float g = Y - 0.39465f * U - 0.58060f * V;
-        float b = Y + 2.03211f * U;
-        OutputRGB[pos] = float4(r, g, b, 1.0f);
+    int64_t IngestTime(int64_t pts) {
+        std::lock_guard<std::mutex> lock(m_mutex);
+        auto it = m_ingestByPts.find(pts);
+        return it == m_ingestByPts.end() ? 0 : it->second;
     }
-)";
 
-const char* HLSL_RESIZE = R"(
-    Texture2D<float4> Input : register(t0);
-    RWTexture2D<float4> Output : register(u0);
-    cbuffer Params : register(b0) { uint srcW; uint srcH; uint dstW; uint dstH; };
+    void Report() {
+        std::string report;
+        {
+            std::lock_guard<std::mutex> lock(m_mutex);
+            report = BuildReportLocked();
+        }
+        if (!report.empty()) LogToGUI(report);
+    }
 
-    [numthreads(16, 16, 1)]
-    void CSMain(uint3 id : SV_DispatchThreadID) {
-        if (id.x >= dstW || id.y >= dstH) return;
-        uint sx = (id.x * srcW) / dstW;
-        uint sy = (id.y * srcH) / dstH;
-        Output[id.xy] = Input[uint2(sx, sy)];
+    void Reset() {
+        std::lock_guard<std::mutex> lock(m_mutex);
+        for (StageSamples& s : m_stages) s.count = 0;
+        m_ingestByPts.clear();
+        m_lastReportUs = 0;
+        incompleteFrames = 0;
     }
-)";
 
-#define ALIGN_32(x) (((x) + 31) & ~31)
+private:
+    static std::string FormatMs(int64_t us) {
+        char buf[32];
+        snprintf(buf, sizeof(buf), "%.1f", us / 1000.0);
+        return buf;
+    }
 
-struct ResizeParams {
-    uint32_t srcW, srcH, dstW, dstH;
+    std::string BuildReportLocked() {
+        std::string out;
+        int64_t endToEndP99 = -1;
+        for (int i = 0; i < LAT_STAGE_COUNT; i++) {
+            StageSamples& s = m_stages[i];
+            size_t n = (size_t)std::min<uint64_t>(s.count, LATENCY_SAMPLES);
+            if (n == 0) continue;
+            std::vector<int64_t> sorted(s.ring.begin(), s.ring.begin() + n);
+            std::sort(sorted.begin(), sorted.end());
+            auto pct = [&](double p) { return sorted[std::min(n - 1, (size_t)(p * n))]; };
+            if (!out.empty()) out += "\r\n";
+            out += std::string("Latency ") + LATENCY_STAGE_NAMES[i] + ": p50 " + FormatMs(pct(0.5)) + " / p95 " + FormatMs(pct(0.95)) +
+                " / p99 " + FormatMs(pct(0.99)) + " / max " + FormatMs(sorted[n - 1]) + " ms (" + std::to_string(n) + " samples)";
+            if (i == LAT_RECEIVED || (i == LAT_PRESENT && endToEndP99 < 0)) endToEndP99 = pct(0.99);
+        }
+        if (incompleteFrames > 0) out += "\r\nLatency: " + std::to_string(incompleteFrames) + " frames received incomplete";
+        int budget = budgetMs;
+        if (budget > 0 && endToEndP99 > budget * 1000ll) {
+            out += "\r\nLatency budget exceeded: p99 " + FormatMs(endToEndP99) + " ms > " + std::to_string(budget) + " ms";
+        }
+        return out;
+    }
 };
 
-class D3DRenderer {
-    ComPtr<ID3D11Device> m_device;
-    ComPtr<ID3D11DeviceContext> m_context;
-    ComPtr<IDXGISwapChain1> m_swapChain;
-
-    // OBS Mode
-    ComPtr<ID3D11ComputeShader> m_csNv12ToRgb;
-    ComPtr<ID3D11Texture2D> m_workTexture;
-
-    // DXGI Mode
-    ComPtr<ID3D11ComputeShader> m_csResize;
-    ComPtr<ID3D11Buffer> m_cbResizeParams;
-    ComPtr<ID3D11Texture2D> m_scaledTexture;
-    ComPtr<ID3D11Texture2D> m_captureCopyTexture;
-
-    ComPtr<ID3D11Texture2D> m_stagingTexture;
-    struct SwsContext* m_swsCtx = nullptr;
-    int m_swsWidth = 0;
-    int m_swsHeight = 0;
-    enum AVPixelFormat m_swsFmt = AV_PIX_FMT_NONE;
-    uint8_t* m_nv12Buffer = nullptr;
-    int m_nv12Stride = 0;
+LatencyProbe g_Latency;
+
+// Приёмник на loopback: слушает broadcast поток на UDP_PORT, кадр считается полученным
+// по marker-биту последнего RTP пакета. Считаются только сырые кадры (RTP_PT_RAW):
+// у них в timestamp время захвата, у MPEG-TS - время отправки.
+std::atomic<bool> g_LatencyReceiverRunning(false);
+std::thread g_LatencyReceiverThread;
+
+void RunLatencyReceiverThread(SOCKET sock) {
+    HANDLE mmcss = ApplyThreadPolicy(ThreadRole::Network);
+    std::vector<uint8_t> buf(RTP_HEADER_SIZE + UDP_PACKET_SIZE);
+    uint32_t frameTs = 0;
+    uint16_t expectedSeq = 0;
+    bool inFrame = false, frameOk = false, haveSeq = false;
+    while (g_LatencyReceiverRunning) {
+        int len = recv(sock, (char*)buf.data(), (int)buf.size(), 0);
+        if (len < RTP_HEADER_SIZE || (buf[0] >> 6) != 2 || (buf[1] & 0x7F) != RTP_PT_RAW) continue;
+        bool marker = (buf[1] & 0x80) != 0;
+        uint16_t seq = (uint16_t)((buf[2] << 8) | buf[3]);
+        uint32_t ts = ((uint32_t)buf[4] << 24) | (buf[5] << 16) | (buf[6] << 8) | buf[7];
+
+        if (!inFrame || ts != frameTs) {
+            if (inFrame) g_Latency.incompleteFrames++;
+            inFrame = true;
+            // Потерянное начало кадра видно по разрыву с концом предыдущего
+            frameOk = !haveSeq || seq == expectedSeq;
+            frameTs = ts;
+        }
+        else if (seq != expectedSeq) {
+            frameOk = false;
+        }
+        expectedSeq = seq + 1;
+        haveSeq = true;
+        if (!marker) continue;
 
-    int m_width = 0, m_height = 0;
-    HWND m_hwndVideo;
-    HWND m_hwndMain;
-public:
-    D3DRenderer(HWND hVideo, HWND hMain) : m_hwndVideo(hVideo), m_hwndMain(hMain) {
-        InitD3D(hVideo);
-        InitShaders();
+        inFrame = false;
+        if (!frameOk) {
+            g_Latency.incompleteFrames++;
+            continue;
+        }
+        // Разница по модулю 2^32 в единицах 90 кГц
+        uint32_t now90 = (uint32_t)(LatencyNowUs() * 9 / 100);
+        g_Latency.RecordSample(LAT_RECEIVED, (int64_t)(uint32_t)(now90 - ts) * 100 / 9);
     }
+    if (mmcss) AvRevertMmThreadCharacteristics(mmcss);
+    closesocket(sock);
+}
 
-    ~D3DRenderer() {
-        if (m_swsCtx) sws_freeContext(m_swsCtx);
-        if (m_nv12Buffer) _aligned_free(m_nv12Buffer);
+void StartLatencyReceiver() {
+    if (g_LatencyReceiverRunning) return;
+    SOCKET sock = socket(AF_INET, SOCK_DGRAM, IPPROTO_UDP);
+    if (sock == INVALID_SOCKET) return;
+    BOOL reuse = TRUE;
+    setsockopt(sock, SOL_SOCKET, SO_REUSEADDR, (char*)&reuse, sizeof(reuse));
+    int recvBuff = 1024 * 1024 * 16;
+    setsockopt(sock, SOL_SOCKET, SO_RCVBUF, (char*)&recvBuff, sizeof(recvBuff));
+    DWORD timeoutMs = 200;
+    setsockopt(sock, SOL_SOCKET, SO_RCVTIMEO, (char*)&timeoutMs, sizeof(timeoutMs));
+    sockaddr_in local = {};
+    local.sin_family = AF_INET;
+    local.sin_port = htons(UDP_PORT);
+    local.sin_addr.s_addr = INADDR_ANY;
+    if (bind(sock, (sockaddr*)&local, sizeof(local)) != 0) {
+        LogToGUI("Latency receiver: bind failed.");
+        closesocket(sock);
+        return;
     }
+    if (!g_IsReliableUdp) LogToGUI("Latency receiver: enable \"RTP + NACK\" to get frame timestamps.");
+    g_LatencyReceiverRunning = true;
+    g_LatencyReceiverThread = std::thread(RunLatencyReceiverThread, sock);
+}
 
-    ID3D11Device* GetDevice() { return m_device.Get(); }
-
-    void ResizeSwapChain(int w, int h) {
-        if (m_width == w && m_height == h) return;
+void StopLatencyReceiver() {
+    g_LatencyReceiverRunning = false;
+    if (g_LatencyReceiverThread.joinable()) g_LatencyReceiverThread.join();
+}
 
-        m_context->ClearState();
-        m_context->OMSetRenderTargets(0, nullptr, nullptr);
+// ==========================================
+// ЗАПИСЬ (СЕГМЕНТЫ НА ДИСКЕ)
+// ==========================================
+// Производители (ReadPacket / захват) только копируют данные в кольцевой буфер.
+// Отдельный поток пишет их в заранее выделенные сегменты через MapViewOfFile,
+// поэтому поток захвата/декодирования никогда не ждёт диск.
+// Запись включают флажок Record и старт движка (BeginSession), производители лишь отбрасывают
+// данные, пока она выключена.
+const uint64_t RECORD_SEGMENT_SIZE = 256ull * 1024 * 1024;
+const uint64_t RECORD_RING_SIZE = 64ull * 1024 * 1024;
+const int64_t RECORD_INDEX_INTERVAL_US = 500000;
+const uint32_t RECORD_FRAME_MAGIC = 0x314D5246; // "FRM1"
+const int RECORD_KEEP_SEGMENTS = 16; // 4 GB на диске, более старые сегменты удаляются
+const uint64_t RECORD_TS_PACKET_SIZE = 188;
+
+enum class RecordKind { TransportStream, RawFrames };
+
+// Заголовок перед каждым кадром в .raw сегментах
+struct RecordFrameHeader {
+    uint32_t magic;
+    uint32_t size;
+    int64_t timestampUs;
+    uint32_t width;
+    uint32_t height;
+};
 
-        m_width = w;
-        m_height = h;
+class SegmentRecorder {
+    struct RingRecord {
+        uint32_t size;
+        uint32_t gap; // перед записью данные отбрасывались (кольцо было полным)
+        int64_t timestampUs;
+    };
+
+    std::vector<uint8_t> m_ring;
+    uint64_t m_head = 0; // committed by producer
+    uint64_t m_tail = 0; // consumed by writer
+    std::mutex m_mutex;
+    std::mutex m_pushMutex;
+    std::mutex m_controlMutex; // Start / Stop / сессия; производители его не берут
+    std::condition_variable m_cv;
+    std::thread m_writer; // живёт до Shutdown, сессии открывает и закрывает сам
+    bool m_active = false;
+    bool m_stop = false;
+    bool m_openRequested = false; // Start ждёт, пока писатель допишет прошлую сессию
+    RecordKind m_requestKind = RecordKind::TransportStream;
+    bool m_shutdown = false;
+    bool m_gap = false;
+    RecordKind m_kind = RecordKind::TransportStream;
+    std::chrono::steady_clock::time_point m_startTime;
+
+    // Сессия движка (под m_controlMutex): определяет вид записи
+    bool m_session = false;
+    RecordKind m_sessionKind = RecordKind::TransportStream;
+
+    // Writer thread state
+    fs::path m_dir;
+    HANDLE m_hFile = INVALID_HANDLE_VALUE;
+    HANDLE m_hMapping = nullptr;
+    uint8_t* m_view = nullptr;
+    uint64_t m_segmentUsed = 0;
+    int m_segmentIndex = -1;
+    int64_t m_lastIndexUs = 0;
+    std::ofstream m_index;
+    std::deque<std::pair<int, std::string>> m_indexRows;
+    bool m_tsSynced = false;
+    uint64_t m_tsPos = 0; // байт TS после синхронизации
+    bool m_writeFailed = false;
+
+    // Сообщения писателя: LogToGUI из него нельзя (Shutdown ждёт его), выводит UI поток по WM_RECORDER_LOG
+    std::vector<std::string> m_messages;
+    std::atomic<bool> m_messagesPending{ false };
+
+    std::atomic<uint64_t> m_bytesWritten{ 0 };
+    std::atomic<uint64_t> m_dropped{ 0 };
 
-        m_workTexture.Reset();
-        m_scaledTexture.Reset();
-        m_captureCopyTexture.Reset();
+public:
+    ~SegmentRecorder() { Shutdown(); }
 
-        if (m_nv12Buffer) { _aligned_free(m_nv12Buffer); m_nv12Buffer = nullptr; }
+    void WriteStream(const uint8_t* data, int size) {
+        Push(RecordKind::TransportStream, nullptr, data, size);
+    }
 
-        m_nv12Stride = ALIGN_32(w);
-        size_t dataSize = m_nv12Stride * h + m_nv12Stride * (h / 2);
-        m_nv12Buffer = (uint8_t*)_aligned_malloc(dataSize, 32);
-        if (m_nv12Buffer) memset(m_nv12Buffer, 0, dataSize);
+    void WriteFrame(const uint8_t* data, int size, int width, int height) {
+        RecordFrameHeader hdr = { RECORD_FRAME_MAGIC, (uint32_t)size, 0, (uint32_t)width, (uint32_t)height };
+        Push(RecordKind::RawFrames, &hdr, data, size);
+    }
 
-        if (m_swapChain) {
-            m_swapChain->ResizeBuffers(0, w, h, DXGI_FORMAT_UNKNOWN, 0);
+    // Запуск движка: запись включается сразу, если стоит флажок Record
+    void BeginSession(RecordKind kind) {
+        {
+            std::lock_guard<std::mutex> control(m_controlMutex);
+            m_session = true;
+            m_sessionKind = kind;
         }
-        PostMessage(m_hwndMain, WM_VIDEO_RESIZE, (WPARAM)w, (LPARAM)h);
+        if (g_IsRecording) Start();
     }
 
-    // --- GPU DOWNSCALE & SEND (DXGI MODE) ---
-    void ProcessDXGIFrame(ID3D11Texture2D* srcTexture, int targetW, int targetH) {
-        if (!srcTexture) return;
-        D3D11_TEXTURE2D_DESC srcDesc;
-        srcTexture->GetDesc(&srcDesc);
+    void EndSession() {
+        {
+            std::lock_guard<std::mutex> control(m_controlMutex);
+            m_session = false;
+        }
+        Stop();
+    }
 
-        ID3D11Texture2D* texToProcess = srcTexture;
+    // Флажок Record или начало сессии. Производители запись не запускают.
+    // Сессию открывает писатель, дописав предыдущую: UI поток не ждёт диск.
+    void Start() {
+        std::lock_guard<std::mutex> control(m_controlMutex);
+        if (!m_session) return;
+        {
+            std::lock_guard<std::mutex> lock(m_mutex);
+            if (m_shutdown || m_active) return;
+            m_openRequested = true;
+            m_requestKind = m_sessionKind;
+        }
+        if (!m_writer.joinable()) m_writer = std::thread(&SegmentRecorder::WriterLoop, this);
+        m_cv.notify_all();
+    }
 
-        if (srcDesc.Width != (UINT)targetW || srcDesc.Height != (UINT)targetH) {
-            EnsureTexture(m_scaledTexture, targetW, targetH, DXGI_FORMAT_B8G8R8A8_UNORM, D3D11_BIND_UNORDERED_ACCESS | D3D11_BIND_SHADER_RESOURCE);
+    // Только сигнал: остаток кольца и сброс сегмента писатель доделывает сам и сообщает итог
+    void Stop() {
+        std::lock_guard<std::mutex> control(m_controlMutex);
+        StopLocked();
+    }
 
-            if (!(srcDesc.BindFlags & D3D11_BIND_SHADER_RESOURCE)) {
-                EnsureTexture(m_captureCopyTexture, srcDesc.Width, srcDesc.Height, srcDesc.Format, D3D11_BIND_SHADER_RESOURCE);
-                m_context->CopyResource(m_captureCopyTexture.Get(), srcTexture);
-                texToProcess = m_captureCopyTexture.Get();
-            }
+    // Выход из программы: ждём, пока писатель допишет всё на диск
+    void Shutdown() {
+        std::lock_guard<std::mutex> control(m_controlMutex);
+        StopLocked();
+        {
+            std::lock_guard<std::mutex> lock(m_mutex);
+            m_shutdown = true;
+        }
+        m_cv.notify_all();
+        if (m_writer.joinable()) m_writer.join();
+    }
 
-            PerformResize(texToProcess, m_scaledTexture.Get(), srcDesc.Width, srcDesc.Height, targetW, targetH);
-            texToProcess = m_scaledTexture.Get();
+    // UI поток по WM_RECORDER_LOG; производители тоже подбирают сообщения в Push
+    void FlushLog() {
+        std::vector<std::string> messages;
+        {
+            std::lock_guard<std::mutex> lock(m_mutex);
+            if (m_messages.empty()) return;
+            messages.swap(m_messages);
+            m_messagesPending = false;
         }
-        else {
-            EnsureTexture(m_scaledTexture, targetW, targetH, DXGI_FORMAT_B8G8R8A8_UNORM, D3D11_BIND_UNORDERED_ACCESS | D3D11_BIND_SHADER_RESOURCE);
-            m_context->CopyResource(m_scaledTexture.Get(), srcTexture);
-            texToProcess = m_scaledTexture.Get();
+        for (const auto& msg : messages) LogToGUI(msg);
+    }
+
+private:
+    void StopLocked() {
+        {
+            std::lock_guard<std::mutex> lock(m_mutex);
+            m_openRequested = false; // ещё не открытая сессия отменяется
+            if (!m_active) return;
+            m_active = false; // с этого момента Push отбрасывает данные
+            m_stop = true;
         }
+        m_cv.notify_all();
+    }
 
-        if (g_IsShowStream) {
-            ResizeSwapChain(targetW, targetH);
-            ComPtr<ID3D11Texture2D> backBuffer;
-            HRESULT hr = m_swapChain->GetBuffer(0, __uuidof(ID3D11Texture2D), (void**)&backBuffer);
-            if (SUCCEEDED(hr) && backBuffer) {
-                m_context->CopySubresourceRegion(backBuffer.Get(), 0, 0, 0, 0, texToProcess, 0, nullptr);
+    // Поток писателя
+    bool OpenSession(RecordKind kind) {
+        wchar_t buffer[MAX_PATH];
+        bool ok = GetModuleFileNameW(NULL, buffer, MAX_PATH) != 0;
+
+        SYSTEMTIME st;
+        GetLocalTime(&st);
+        char stamp[32];
+        snprintf(stamp, sizeof(stamp), "%04d%02d%02d_%02d%02d%02d", st.wYear, st.wMonth, st.wDay, st.wHour, st.wMinute, st.wSecond);
+
+        std::error_code ec;
+        if (ok) {
+            m_dir = fs::path(buffer).parent_path() / "recordings" / stamp;
+            fs::create_directories(m_dir, ec);
+            if (ec) {
+                Report("Recording: cannot create " + m_dir.string());
+                ok = false;
             }
-            m_swapChain->Present(0, 0);
         }
-
-        if (g_IsStreamNetwork) {
-            SendTextureOverUDP(texToProcess, targetW, targetH);
+        if (!ok) {
+            std::lock_guard<std::mutex> lock(m_mutex);
+            m_openRequested = false;
+            return false;
+        }
+        m_indexRows.clear();
+        m_index.open(m_dir / "index.csv", std::ios::trunc);
+        m_index << "segment,offset,timestamp_us\n";
+
+        m_kind = kind;
+        m_segmentIndex = -1;
+        m_segmentUsed = 0;
+        m_lastIndexUs = -RECORD_INDEX_INTERVAL_US;
+        m_tsSynced = false;
+        m_tsPos = 0;
+        m_writeFailed = false;
+        m_bytesWritten = 0;
+        m_dropped = 0;
+        bool cancelled;
+        {
+            // Производитель может быть между резервированием и коммитом m_head
+            std::lock_guard<std::mutex> pushLock(m_pushMutex);
+            std::lock_guard<std::mutex> lock(m_mutex);
+            cancelled = !m_openRequested || m_shutdown; // Stop успел прийти, пока создавался каталог
+            if (!cancelled) {
+                m_openRequested = false;
+                if (m_ring.empty()) m_ring.resize((size_t)RECORD_RING_SIZE);
+                m_head = m_tail = 0;
+                m_stop = false;
+                m_gap = false;
+                m_startTime = std::chrono::steady_clock::now();
+                m_active = true;
+            }
+        }
+        if (cancelled) {
+            m_index.close();
+            fs::remove_all(m_dir, ec);
+            return false;
         }
+        Report("Recording to " + m_dir.string());
+        return true;
     }
 
-    void RenderFrame(AVFrame* frame) {
-        if (!frame || !m_swapChain) return;
-        if (!g_IsShowStream) return;
+    void Push(RecordKind kind, RecordFrameHeader* frameHeader, const uint8_t* data, int size) {
+        if (size <= 0) return;
+        if (m_messagesPending) FlushLog();
+        std::lock_guard<std::mutex> pushLock(m_pushMutex);
+        PushLocked(kind, frameHeader, data, size);
+    }
 
-        ResizeSwapChain(frame->width, frame->height);
-        if (frame->format == AV_PIX_FMT_D3D11) {
-            ID3D11Texture2D* srcTexture = (ID3D11Texture2D*)frame->data[0];
-            int srcIndex = (intptr_t)frame->data[1];
-            EnsureTexture(m_workTexture, frame->width, frame->height, DXGI_FORMAT_NV12, D3D11_BIND_SHADER_RESOURCE);
-            m_context->CopySubresourceRegion(m_workTexture.Get(), 0, 0, 0, 0, srcTexture, srcIndex, nullptr);
-            RunComputeShaderNV12();
+    void PushLocked(RecordKind kind, RecordFrameHeader* frameHeader, const uint8_t* data, int size) {
+        size_t headerSize = frameHeader ? sizeof(RecordFrameHeader) : 0;
+        size_t total = sizeof(RingRecord) + headerSize + size;
+        uint64_t head;
+        int64_t ts;
+        bool gap;
+        {
+            std::lock_guard<std::mutex> lock(m_mutex);
+            if (!m_active || m_kind != kind) return;
+            if (total > RECORD_RING_SIZE - (m_head - m_tail)) {
+                m_dropped++;
+                m_gap = true;
+                return;
+            }
+            head = m_head;
+            gap = m_gap;
+            m_gap = false;
+            ts = std::chrono::duration_cast<std::chrono::microseconds>(std::chrono::steady_clock::now() - m_startTime).count();
         }
-        else {
-            RenderSoftwareFrame(frame);
+
+        // Копирование без блокировки: писатель не читает дальше m_head
+        RingRecord rec = { (uint32_t)(headerSize + size), gap ? 1u : 0u, ts };
+        CopyIn(head, &rec, sizeof(rec));
+        head += sizeof(rec);
+        if (frameHeader) {
+            frameHeader->timestampUs = ts;
+            CopyIn(head, frameHeader, headerSize);
+            head += headerSize;
         }
-        m_swapChain->Present(0, 0);
-    }
+        CopyIn(head, data, size);
 
-private:
-    void PerformResize(ID3D11Texture2D* input, ID3D11Texture2D* output, int srcW, int srcH, int dstW, int dstH) {
-        D3D11_MAPPED_SUBRESOURCE mapped;
-        if (SUCCEEDED(m_context->Map(m_cbResizeParams.Get(), 0, D3D11_MAP_WRITE_DISCARD, 0, &mapped))) {
-            ResizeParams* p = (ResizeParams*)mapped.pData;
-            p->srcW = srcW; p->srcH = srcH; p->dstW = dstW; p->dstH = dstH;
-            m_context->Unmap(m_cbResizeParams.Get(), 0);
+        {
+            std::lock_guard<std::mutex> lock(m_mutex);
+            m_head += total;
         }
+        m_cv.notify_one();
+    }
 
-        ComPtr<ID3D11ShaderResourceView> srv;
-        m_device->CreateShaderResourceView(input, nullptr, &srv);
+    void Report(const std::string& msg) {
+        {
+            std::lock_guard<std::mutex> lock(m_mutex);
+            m_messages.push_back(msg);
+            m_messagesPending = true;
+        }
+        if (g_hMainWindow) PostMessage(g_hMainWindow, WM_RECORDER_LOG, 0, 0);
+    }
 
-        ComPtr<ID3D11UnorderedAccessView> uav;
-        m_device->CreateUnorderedAccessView(output, nullptr, &uav);
+    void CopyIn(uint64_t pos, const void* src, size_t size) {
+        size_t off = (size_t)(pos % RECORD_RING_SIZE);
+        size_t first = std::min(size, (size_t)RECORD_RING_SIZE - off);
+        memcpy(m_ring.data() + off, src, first);
+        if (first < size) memcpy(m_ring.data(), (const uint8_t*)src + first, size - first);
+    }
 
-        m_context->CSSetShader(m_csResize.Get(), nullptr, 0);
-        m_context->CSSetConstantBuffers(0, 1, m_cbResizeParams.GetAddressOf());
-        m_context->CSSetShaderResources(0, 1, srv.GetAddressOf());
-        m_context->CSSetUnorderedAccessViews(0, 1, uav.GetAddressOf(), nullptr);
+    void CopyOut(uint64_t pos, void* dst, size_t size) {
+        size_t off = (size_t)(pos % RECORD_RING_SIZE);
+        size_t first = std::min(size, (size_t)RECORD_RING_SIZE - off);
+        memcpy(dst, m_ring.data() + off, first);
+        if (first < size) memcpy((uint8_t*)dst + first, m_ring.data(), size - first);
+    }
 
-        UINT threadsX = (dstW + 15) / 16;
-        UINT threadsY = (dstH + 15) / 16;
-        m_context->Dispatch(threadsX, threadsY, 1);
+    uint8_t RingByte(uint64_t pos) const { return m_ring[(size_t)(pos % RECORD_RING_SIZE)]; }
 
-        ID3D11UnorderedAccessView* nullUAV[] = { nullptr };
-        m_context->CSSetUnorderedAccessViews(0, 1, nullUAV, nullptr);
-        ID3D11ShaderResourceView* nullSRV[] = { nullptr };
-        m_context->CSSetShaderResources(0, 1, nullSRV);
+    void WriterLoop() {
+        while (true) {
+            RecordKind kind;
+            {
+                std::unique_lock<std::mutex> lock(m_mutex);
+                m_cv.wait(lock, [this] { return m_openRequested || m_shutdown; });
+                if (m_shutdown) break;
+                kind = m_requestKind;
+            }
+            if (!OpenSession(kind)) continue;
+
+            HANDLE mmcss = ApplyThreadPolicy(ThreadRole::Recorder);
+            WriteSession();
+            CloseSegment();
+            m_index.close();
+            if (mmcss) AvRevertMmThreadCharacteristics(mmcss);
+            Report("Recording stopped: " + std::to_string(m_segmentIndex + 1) + " segment(s), " +
+                std::to_string(m_bytesWritten.load() / (1024 * 1024)) + " MB, " + std::to_string(m_dropped.load()) + " dropped");
+        }
     }
 
-    void SendTextureOverUDP(ID3D11Texture2D* tex, int w, int h) {
-        EnsureStagingTexture(w, h);
-        m_context->CopyResource(m_stagingTexture.Get(), tex);
+    // До Stop и опустошения кольца
+    void WriteSession() {
+        while (true) {
+            uint64_t head, tail;
+            {
+                std::unique_lock<std::mutex> lock(m_mutex);
+                m_cv.wait(lock, [this] { return m_head != m_tail || m_stop; });
+                if (m_head == m_tail && m_stop) break;
+                head = m_head;
+                tail = m_tail;
+            }
 
-        D3D11_MAPPED_SUBRESOURCE mapped;
-        HRESULT hr = m_context->Map(m_stagingTexture.Get(), 0, D3D11_MAP_READ, 0, &mapped);
-        if (SUCCEEDED(hr)) {
-            uint8_t* ptr = (uint8_t*)mapped.pData;
-            std::vector<uint8_t> rgbBuffer;
-            rgbBuffer.resize(w * h * 3);
-
-            for (int y = 0; y < h; y++) {
-                uint8_t* rowSrc = ptr + y * mapped.RowPitch;
-                uint8_t* rowDst = rgbBuffer.data() + y * w * 3;
-                for (int x = 0; x < w; x++) {
-                    uint8_t b = rowSrc[x * 4 + 0];
-                    uint8_t g = rowSrc[x * 4 + 1];
-                    uint8_t r = rowSrc[x * 4 + 2];
-                    rowDst[x * 3 + 0] = r;
-                    rowDst[x * 3 + 1] = g;
-                    rowDst[x * 3 + 2] = b;
-                }
+            while (tail != head) {
+                RingRecord rec;
+                CopyOut(tail, &rec, sizeof(rec));
+                uint64_t payload = tail + sizeof(rec);
+                if (m_writeFailed) m_dropped++;
+                else if (m_kind == RecordKind::TransportStream) WriteTsRecord(payload, rec);
+                else WriteFrameRecord(payload, rec);
+                tail = payload + rec.size;
+
+                std::lock_guard<std::mutex> lock(m_mutex);
+                m_tail = tail;
             }
-            SendUdpData(rgbBuffer.data(), (int)rgbBuffer.size());
-            m_context->Unmap(m_stagingTexture.Get(), 0);
         }
     }
 
-    void RenderSoftwareFrame(AVFrame* frame) {
-        EnsureTexture(m_workTexture, frame->width, frame->height, DXGI_FORMAT_NV12, D3D11_BIND_SHADER_RESOURCE);
-        if (!m_nv12Buffer) return;
-
-        if (!m_swsCtx || m_swsWidth != frame->width || m_swsHeight != frame->height || m_swsFmt != frame->format) {
-            if (m_swsCtx) sws_freeContext(m_swsCtx);
-            m_swsWidth = frame->width;
-            m_swsHeight = frame->height;
-            m_swsFmt = (AVPixelFormat)frame->format;
-            m_swsCtx = sws_getContext(frame->width, frame->height, (AVPixelFormat)frame->format, frame->width, frame->height, AV_PIX_FMT_NV12, SWS_POINT, nullptr, nullptr, nullptr);
+    // Кадр не разрывается между сегментами
+    void WriteFrameRecord(uint64_t ringPos, const RingRecord& rec) {
+        if (rec.size > RECORD_SEGMENT_SIZE) {
+            m_dropped++;
+            return;
+        }
+        if (!m_view || m_segmentUsed + rec.size > RECORD_SEGMENT_SIZE) {
+            CloseSegment();
+            if (!OpenSegment()) return;
         }
-        if (!m_swsCtx) return;
 
-        uint8_t* dstData[4] = { m_nv12Buffer, m_nv12Buffer + (m_nv12Stride * frame->height), nullptr, nullptr };
-        int dstLinesize[4] = { m_nv12Stride, m_nv12Stride, 0, 0 };
-        sws_scale(m_swsCtx, frame->data, frame->linesize, 0, frame->height, dstData, dstLinesize);
-        m_context->UpdateSubresource(m_workTexture.Get(), 0, nullptr, m_nv12Buffer, m_nv12Stride, 0);
-        RunComputeShaderNV12();
-    }
+        if (rec.timestampUs - m_lastIndexUs >= RECORD_INDEX_INTERVAL_US || m_segmentUsed == 0) AddIndex(m_segmentUsed, rec.timestampUs);
 
-    void RunComputeShaderNV12() {
-        ComPtr<ID3D11Texture2D> backBuffer;
-        HRESULT hr = m_swapChain->GetBuffer(0, __uuidof(ID3D11Texture2D), (void**)&backBuffer);
-        if (FAILED(hr)) return;
+        CopyOut(ringPos, m_view + m_segmentUsed, rec.size);
+        m_segmentUsed += rec.size;
+        m_bytesWritten += rec.size;
+    }
 
-        ComPtr<ID3D11UnorderedAccessView> backBufferUAV;
-        m_device->CreateUnorderedAccessView(backBuffer.Get(), nullptr, &backBufferUAV);
+    // TS пишется сплошным потоком, сегменты и записи индекса - по границе 188-байтного пакета
+    void WriteTsRecord(uint64_t ringPos, const RingRecord& rec) {
+        uint64_t pos = 0;
+        if (rec.gap && m_tsSynced) {
+            // Разрыв потока: недописанный пакет откатываем, синхронизируемся заново
+            uint64_t partial = m_tsPos % RECORD_TS_PACKET_SIZE;
+            m_segmentUsed -= partial;
+            m_tsPos -= partial;
+            m_bytesWritten -= partial;
+            m_tsSynced = false;
+        }
+        if (!m_tsSynced) {
+            // Запись могла начаться с середины пакета (pipe): ждём два sync байта через пакет
+            while (pos + RECORD_TS_PACKET_SIZE < rec.size &&
+                (RingByte(ringPos + pos) != 0x47 || RingByte(ringPos + pos + RECORD_TS_PACKET_SIZE) != 0x47)) pos++;
+            if (pos + RECORD_TS_PACKET_SIZE >= rec.size) return;
+            m_tsSynced = true;
+        }
 
-        ComPtr<ID3D11Device3> device3;
-        m_device.As(&device3);
+        while (pos < rec.size) {
+            if (!m_view && !OpenSegment()) return;
+            // Сегмент начинается с пакета и закрывается на последней границе пакета, которая в него помещается
+            uint64_t left = rec.size - pos;
+            uint64_t room = RECORD_SEGMENT_SIZE - RECORD_SEGMENT_SIZE % RECORD_TS_PACKET_SIZE - m_segmentUsed;
+            bool full = left >= room;
+            uint64_t n = full ? room : left;
+
+            uint64_t boundary = (RECORD_TS_PACKET_SIZE - m_tsPos % RECORD_TS_PACKET_SIZE) % RECORD_TS_PACKET_SIZE;
+            if (boundary < n && (m_segmentUsed == 0 || rec.timestampUs - m_lastIndexUs >= RECORD_INDEX_INTERVAL_US)) {
+                AddIndex(m_segmentUsed + boundary, rec.timestampUs);
+            }
 
-        D3D11_SHADER_RESOURCE_VIEW_DESC1 srvDesc1 = {};
-        srvDesc1.ViewDimension = D3D11_SRV_DIMENSION_TEXTURE2D;
-        srvDesc1.Texture2D.MipLevels = 1;
-        srvDesc1.Format = DXGI_FORMAT_R8_UNORM;
-        ComPtr<ID3D11ShaderResourceView1> ySRV;
-        device3->CreateShaderResourceView1(m_workTexture.Get(), &srvDesc1, &ySRV);
+            CopyOut(ringPos + pos, m_view + m_segmentUsed, (size_t)n);
+            m_segmentUsed += n;
+            m_tsPos += n;
+            m_bytesWritten += n;
+            pos += n;
+            if (full) CloseSegment();
+        }
+    }
 
-        srvDesc1.Format = DXGI_FORMAT_R8G8_UNORM;
-        srvDesc1.Texture2D.PlaneSlice = 1;
-        ComPtr<ID3D11ShaderResourceView1> uvSRV;
-        device3->CreateShaderResourceView1(m_workTexture.Get(), &srvDesc1, &uvSRV);
+    void AddIndex(uint64_t offset, int64_t timestampUs) {
+        std::string row = SegmentName(m_segmentIndex) + "," + std::to_string(offset) + "," + std::to_string(timestampUs) + "\n";
+        m_index << row;
+        m_indexRows.emplace_back(m_segmentIndex, row);
+        m_lastIndexUs = timestampUs;
+    }
 
-        ID3D11ShaderResourceView* inputSRVs[] = { ySRV.Get(), uvSRV.Get() };
-        m_context->CSSetShader(m_csNv12ToRgb.Get(), nullptr, 0);
-        m_context->CSSetShaderResources(0, 2, inputSRVs);
-        ID3D11UnorderedAccessView* outputUAVs[] = { backBufferUAV.Get() };
-        m_context->CSSetUnorderedAccessViews(0, 1, outputUAVs, nullptr);
-        m_context->Dispatch((m_width + 7) / 8, (m_height + 7) / 8, 1);
+    std::string SegmentName(int index) {
+        char name[64];
+        snprintf(name, sizeof(name), "segment_%05d.%s", index, m_kind == RecordKind::TransportStream ? "ts" : "raw");
+        return name;
+    }
 
-        ID3D11UnorderedAccessView* nullUAV[] = { nullptr };
-        m_context->CSSetUnorderedAccessViews(0, 1, nullUAV, nullptr);
-        ID3D11ShaderResourceView* nullSRV[] = { nullptr, nullptr };
-        m_context->CSSetShaderResources(0, 2, nullSRV);
+    // Скользящее окно: удаляем сегмент, вышедший за RECORD_KEEP_SEGMENTS, и его строки индекса
+    void DropOldSegment() {
+        int oldest = m_segmentIndex - RECORD_KEEP_SEGMENTS;
+        if (oldest < 0) return;
+        std::error_code ec;
+        fs::remove(m_dir / SegmentName(oldest), ec);
+
+        while (!m_indexRows.empty() && m_indexRows.front().first <= oldest) m_indexRows.pop_front();
+        m_index.close();
+        m_index.open(m_dir / "index.csv", std::ios::trunc);
+        m_index << "segment,offset,timestamp_us\n";
+        for (const auto& row : m_indexRows) m_index << row.second;
     }
 
-    void EnsureTexture(ComPtr<ID3D11Texture2D>& tex, int width, int height, DXGI_FORMAT fmt, UINT bindFlags) {
-        if (tex) {
-            D3D11_TEXTURE2D_DESC desc;
-            tex->GetDesc(&desc);
-            if (desc.Width == width && desc.Height == height && desc.Format == fmt) return;
+    bool OpenSegment() {
+        m_segmentIndex++;
+        DropOldSegment();
+        fs::path path = m_dir / SegmentName(m_segmentIndex);
+        m_hFile = CreateFileW(path.c_str(), GENERIC_READ | GENERIC_WRITE, FILE_SHARE_READ, nullptr, CREATE_ALWAYS, FILE_ATTRIBUTE_NORMAL | FILE_FLAG_SEQUENTIAL_SCAN, nullptr);
+        if (m_hFile == INVALID_HANDLE_VALUE) {
+            Report("Recording: cannot create " + path.string());
+            m_writeFailed = true;
+            m_dropped++;
+            return false;
         }
-        D3D11_TEXTURE2D_DESC desc = {};
-        desc.Width = width; desc.Height = height;
-        desc.MipLevels = 1; desc.ArraySize = 1;
-        desc.Format = fmt;
-        desc.SampleDesc.Count = 1;
-        desc.Usage = D3D11_USAGE_DEFAULT;
-        desc.BindFlags = bindFlags;
-        m_device->CreateTexture2D(&desc, nullptr, &tex);
+        // Маппинг сразу резервирует весь сегмент на диске
+        m_hMapping = CreateFileMappingW(m_hFile, nullptr, PAGE_READWRITE, (DWORD)(RECORD_SEGMENT_SIZE >> 32), (DWORD)(RECORD_SEGMENT_SIZE & 0xFFFFFFFF), nullptr);
+        if (m_hMapping) m_view = (uint8_t*)MapViewOfFile(m_hMapping, FILE_MAP_WRITE, 0, 0, 0);
+        if (!m_view) {
+            Report("Recording: cannot map segment.");
+            CloseSegment();
+            m_writeFailed = true;
+            m_dropped++;
+            return false;
+        }
+        m_segmentUsed = 0;
+        return true;
     }
 
-    void EnsureStagingTexture(int width, int height) {
-        if (m_stagingTexture) {
-            D3D11_TEXTURE2D_DESC desc;
-            m_stagingTexture->GetDesc(&desc);
-            if (desc.Width == width && desc.Height == height) return;
+    void CloseSegment() {
+        if (m_view) {
+            FlushViewOfFile(m_view, 0);
+            UnmapViewOfFile(m_view);
+            m_view = nullptr;
+        }
+        if (m_hMapping) {
+            CloseHandle(m_hMapping);
+            m_hMapping = nullptr;
+        }
+        if (m_hFile != INVALID_HANDLE_VALUE) {
+            // Обрезаем предвыделенный хвост
+            LARGE_INTEGER size;
+            size.QuadPart = (LONGLONG)m_segmentUsed;
+            SetFilePointerEx(m_hFile, size, nullptr, FILE_BEGIN);
+            SetEndOfFile(m_hFile);
+            CloseHandle(m_hFile);
+            m_hFile = INVALID_HANDLE_VALUE;
         }
-        D3D11_TEXTURE2D_DESC desc = {};
-        desc.Width = width; desc.Height = height;
-        desc.MipLevels = 1; desc.ArraySize = 1;
-        desc.Format = DXGI_FORMAT_B8G8R8A8_UNORM;
-        desc.SampleDesc.Count = 1;
-        desc.Usage = D3D11_USAGE_STAGING;
-        desc.CPUAccessFlags = D3D11_CPU_ACCESS_READ;
-        m_device->CreateTexture2D(&desc, nullptr, &m_stagingTexture);
     }
+};
 
-    void InitD3D(HWND hwnd) {
-        D3D_FEATURE_LEVEL levels[] = { D3D_FEATURE_LEVEL_11_1, D3D_FEATURE_LEVEL_11_0 };
-        UINT flags = D3D11_CREATE_DEVICE_BGRA_SUPPORT;
-        D3D11CreateDevice(nullptr, D3D_DRIVER_TYPE_HARDWARE, nullptr, flags, levels, 2, D3D11_SDK_VERSION, &m_device, nullptr, &m_context);
+SegmentRecorder g_Recorder;
 
-        ComPtr<IDXGIFactory2> factory;
-        CreateDXGIFactory1(__uuidof(IDXGIFactory2), (void**)&factory);
-        DXGI_SWAP_CHAIN_DESC1 scDesc = {};
-        scDesc.Format = DXGI_FORMAT_B8G8R8A8_UNORM;
-        scDesc.SampleDesc.Count = 1;
-        scDesc.BufferUsage = DXGI_USAGE_UNORDERED_ACCESS | DXGI_USAGE_RENDER_TARGET_OUTPUT;
-        scDesc.BufferCount = 2;
-        scDesc.SwapEffect = DXGI_SWAP_EFFECT_FLIP_DISCARD;
-        scDesc.Scaling = DXGI_SCALING_STRETCH;
+// ==========================================
+// INSTANT REPLAY (ПОСЛЕДНИЕ N СЕКУНД)
+// ==========================================
+// Сжатые пакеты лежат в одном заранее выделенном буфере (slab ring).
+// Вытеснение идёт целыми GOP, так что окно всегда начинается с ключевого кадра.
+// Окно и бюджет памяти: replay=<секунды> [MB] в streams.ini.
+const int REPLAY_WINDOW_DEFAULT_S = 60;
+const int REPLAY_WINDOW_MIN_S = 30;
+const int REPLAY_WINDOW_MAX_S = 120;
+const int REPLAY_BUDGET_DEFAULT_MB = 64;
+const int REPLAY_BUDGET_MAX_MB = 1024;
+const char* REPLAY_CONTAINER = "mpegts";
+const char* REPLAY_EXTENSION = ".ts";
+
+class ReplayBuffer {
+    struct Entry {
+        size_t offset;
+        int size;
+        int64_t pts;
+        int64_t dts;
+        int64_t duration;
+        int flags;
+        int64_t arrivalUs;
+    };
+
+    std::vector<uint8_t> m_slab;
+    size_t m_budgetBytes = (size_t)REPLAY_BUDGET_DEFAULT_MB * 1024 * 1024;
+    int64_t m_windowUs = REPLAY_WINDOW_DEFAULT_S * 1000000ll;
+    std::deque<Entry> m_entries;
+    size_t m_writePos = 0;
+    size_t m_usedBytes = 0;
+    AVCodecParameters* m_codecPar = nullptr;
+    AVRational m_timeBase = { 1, 90000 };
+    std::mutex m_mutex;
+    std::atomic<bool> m_dumping{ false };
+    std::thread m_dumpThread; // join-ится, чтобы выход не обрывал файл на середине
 
-        factory->CreateSwapChainForHwnd(m_device.Get(), hwnd, &scDesc, nullptr, nullptr, &m_swapChain);
+public:
+    ~ReplayBuffer() {
+        WaitDump();
+        avcodec_parameters_free(&m_codecPar);
     }
 
-    void InitShaders() {
-        ComPtr<ID3DBlob> blob, err;
-        D3DCompile(HLSL_NV12_TO_RGB, strlen(HLSL_NV12_TO_RGB), nullptr, nullptr, nullptr, "CSMain", "cs_5_0", 0, 0, &blob, &err);
-        if (blob) m_device->CreateComputeShader(blob->GetBufferPointer(), blob->GetBufferSize(), nullptr, &m_csNv12ToRgb);
-        blob.Reset();
+    // Дожидается записи файла; при выходе вызывается из main() после закрытия окна
+    void WaitDump() {
+        if (m_dumpThread.joinable()) m_dumpThread.join();
+    }
 
-        D3DCompile(HLSL_RESIZE, strlen(HLSL_RESIZE), nullptr, nullptr, nullptr, "CSMain", "cs_5_0", 0, 0, &blob, &err);
-        if (blob) m_device->CreateComputeShader(blob->GetBufferPointer(), blob->GetBufferSize(), nullptr, &m_csResize);
+    // Из streams.ini при старте движка; новый бюджет выделяется при следующем Configure
+    void SetLimits(int windowSec, int budgetMb) {
+        std::lock_guard<std::mutex> lock(m_mutex);
+        m_windowUs = windowSec * 1000000ll;
+        m_budgetBytes = (size_t)budgetMb * 1024 * 1024;
+    }
 
-        D3D11_BUFFER_DESC bd = {};
-        bd.ByteWidth = sizeof(ResizeParams);
-        bd.Usage = D3D11_USAGE_DYNAMIC;
-        bd.BindFlags = D3D11_BIND_CONSTANT_BUFFER;
-        bd.CPUAccessFlags = D3D11_CPU_ACCESS_WRITE;
-        m_device->CreateBuffer(&bd, nullptr, &m_cbResizeParams);
+    void Configure(const AVCodecParameters* par, AVRational timeBase) {
+        std::lock_guard<std::mutex> lock(m_mutex);
+        if (m_slab.size() != m_budgetBytes) std::vector<uint8_t>(m_budgetBytes).swap(m_slab);
+        if (!m_codecPar) m_codecPar = avcodec_parameters_alloc();
+        avcodec_parameters_copy(m_codecPar, par);
+        m_timeBase = timeBase;
+        m_entries.clear();
+        m_writePos = 0;
+        m_usedBytes = 0;
     }
-};
 
-// ==========================================
-// ЛОГИКА КОНФИГА
-// ==========================================
+    void Push(const AVPacket* pkt) {
+        if (pkt->size <= 0) return;
+        bool isKey = (pkt->flags & AV_PKT_FLAG_KEY) != 0;
+        int64_t nowUs = std::chrono::duration_cast<std::chrono::microseconds>(std::chrono::steady_clock::now().time_since_epoch()).count();
+
+        std::lock_guard<std::mutex> lock(m_mutex);
+        if (m_slab.empty() || !m_codecPar || (size_t)pkt->size >= m_slab.size() / 4) return;
+        // Окно всегда начинается с ключевого кадра
+        if (m_entries.empty() && !isKey) return;
+
+        size_t offset;
+        while (!Allocate(pkt->size, offset)) EvictGop();
+        if (m_entries.empty() && !isKey) return;
+        memcpy(m_slab.data() + offset, pkt->data, pkt->size);
+        m_entries.push_back({ offset, pkt->size, pkt->pts, pkt->dts, pkt->duration, pkt->flags, nowUs });
+        m_usedBytes += pkt->size;
+
+        // Храним не больше окна, но не трогаем последний GOP
+        while (m_entries.size() > 1 && nowUs - m_entries.front().arrivalUs > m_windowUs) {
+            if (!HasSecondGop()) break;
+            EvictGop();
+        }
+    }
 
-void ModifyBasicIni(int width, int height, int fps, int codecIndex) {
-    wchar_t buffer[MAX_PATH];
-    if (GetModuleFileNameW(NULL, buffer, MAX_PATH) == 0) return;
+    void DumpAsync() {
+        if (m_dumping.exchange(true)) {
+            LogToGUI("Replay: dump already in progress.");
+            return;
+        }
+        // Предыдущая запись уже закончилась (m_dumping был сброшен)
+        WaitDump();
+
+        std::vector<uint8_t> data;
+        std::vector<Entry> entries;
+        AVCodecParameters* par = avcodec_parameters_alloc();
+        AVRational timeBase;
+        {
+            // Снимок под замком, запись в файл уже без него: живой поток не ждёт диск
+            std::lock_guard<std::mutex> lock(m_mutex);
+            if (m_entries.empty() || !m_codecPar) {
+                avcodec_parameters_free(&par);
+                m_dumping = false;
+                LogToGUI("Replay: buffer is empty.");
+                return;
+            }
+            data.resize(m_usedBytes);
+            entries.reserve(m_entries.size());
+            size_t pos = 0;
+            for (const Entry& e : m_entries) {
+                memcpy(data.data() + pos, m_slab.data() + e.offset, e.size);
+                Entry copy = e;
+                copy.offset = pos;
+                entries.push_back(copy);
+                pos += e.size;
+            }
+            avcodec_parameters_copy(par, m_codecPar);
+            timeBase = m_timeBase;
+        }
 
-    fs::path exeDir = fs::path(buffer).parent_path();
-    fs::path iniPath = exeDir / "config" / "obs-studio" / "basic" / "profiles" / "Untitled" / "basic.ini";
+        m_dumpThread = std::thread([this, data = std::move(data), entries = std::move(entries), par, timeBase]() mutable {
+            WriteReplayFile(data, entries, par, timeBase);
+            avcodec_parameters_free(&par);
+            m_dumping = false;
+        });
+    }
 
-    if (!fs::exists(iniPath)) return;
-    const CodecOption& selCodec = AVAILABLE_CODECS[codecIndex];
-    std::vector<std::string> lines;
+private:
+    bool Allocate(int size, size_t& offset) {
+        size_t cap = m_slab.size();
+        if (m_entries.empty()) {
+            offset = 0;
+            m_writePos = size;
+            return (size_t)size <= cap;
+        }
+        size_t head = m_entries.front().offset;
+        if (m_writePos >= head) {
+            if (m_writePos + size <= cap) {
+                offset = m_writePos;
+                m_writePos += size;
+                return true;
+            }
+            if ((size_t)size < head) {
+                offset = 0;
+                m_writePos = size;
+                return true;
+            }
+            return false;
+        }
+        if (m_writePos + size < head) {
+            offset = m_writePos;
+            m_writePos += size;
+            return true;
+        }
+        return false;
+    }
+
+    bool HasSecondGop() {
+        for (size_t i = 1; i < m_entries.size(); i++) {
+            if (m_entries[i].flags & AV_PKT_FLAG_KEY) return true;
+        }
+        return false;
+    }
+
+    void EvictGop() {
+        if (m_entries.empty()) return;
+        do {
+            m_usedBytes -= m_entries.front().size;
+            m_entries.pop_front();
+        } while (!m_entries.empty() && !(m_entries.front().flags & AV_PKT_FLAG_KEY));
+    }
+
+    void WriteReplayFile(const std::vector<uint8_t>& data, const std::vector<Entry>& entries, const AVCodecParameters* par, AVRational timeBase) {
+        wchar_t buffer[MAX_PATH];
+        if (GetModuleFileNameW(NULL, buffer, MAX_PATH) == 0) return;
+        SYSTEMTIME st;
+        GetLocalTime(&st);
+        char name[64];
+        snprintf(name, sizeof(name), "replay_%04d%02d%02d_%02d%02d%02d%s", st.wYear, st.wMonth, st.wDay, st.wHour, st.wMinute, st.wSecond, REPLAY_EXTENSION);
+        fs::path dir = fs::path(buffer).parent_path() / "replays";
+        std::error_code ec;
+        fs::create_directories(dir, ec);
+        std::string path = (dir / name).string();
+
+        AVFormatContext* oc = nullptr;
+        if (avformat_alloc_output_context2(&oc, nullptr, REPLAY_CONTAINER, path.c_str()) < 0 || !oc) {
+            LogToGUI("Replay: cannot create muxer.");
+            return;
+        }
+        AVStream* stream = avformat_new_stream(oc, nullptr);
+        avcodec_parameters_copy(stream->codecpar, par);
+        stream->codecpar->codec_tag = 0;
+        stream->time_base = timeBase;
+
+        if (avio_open(&oc->pb, path.c_str(), AVIO_FLAG_WRITE) < 0 || avformat_write_header(oc, nullptr) < 0) {
+            LogToGUI("Replay: cannot open " + path);
+            if (oc->pb) avio_closep(&oc->pb);
+            avformat_free_context(oc);
+            return;
+        }
+
+        // Сдвигаем метки времени к нулю
+        int64_t base = entries.front().dts != AV_NOPTS_VALUE ? entries.front().dts : entries.front().pts;
+        if (base == AV_NOPTS_VALUE) base = 0;
+        AVPacket* pkt = av_packet_alloc();
+        for (const Entry& e : entries) {
+            pkt->data = (uint8_t*)data.data() + e.offset;
+            pkt->size = e.size;
+            pkt->pts = e.pts != AV_NOPTS_VALUE ? e.pts - base : AV_NOPTS_VALUE;
+            pkt->dts = e.dts != AV_NOPTS_VALUE ? e.dts - base : AV_NOPTS_VALUE;
+            pkt->duration = e.duration;
+            pkt->flags = e.flags;
+            pkt->stream_index = stream->index;
+            av_packet_rescale_ts(pkt, timeBase, stream->time_base);
+            av_write_frame(oc, pkt);
+        }
+        pkt->data = nullptr;
+        pkt->size = 0;
+        av_packet_free(&pkt);
+        av_write_trailer(oc);
+        avio_closep(&oc->pb);
+        avformat_free_context(oc);
+
+        double seconds = (entries.back().arrivalUs - entries.front().arrivalUs) / 1e6;
+        LogToGUI("Replay saved: " + path + " (" + std::to_string((int)seconds) + " s, " + std::to_string(data.size() / 1024) + " KB)");
+    }
+};
+
+ReplayBuffer g_Replay;
+
+// ==========================================
+// ВСТРОЕННЫЙ ЭНКОДЕР (DXGI -> MPEG-TS -> UDP)
+// ==========================================
+// Аппаратные энкодеры пробуются первыми, libx264 - запасной вариант.
+const char* ENCODER_CANDIDATES[] = { "h264_nvenc", "h264_qsv", "h264_amf", "libx264" };
+const int64_t ENCODER_BITRATE = 6000000;
+const int ENCODER_GOP_SECONDS = 1;
+const int ENCODER_STATS_INTERVAL_SEC = 5;
+
+class FrameEncoder {
+    AVCodecContext* m_encCtx = nullptr;
+    AVFormatContext* m_muxCtx = nullptr;
+    AVStream* m_stream = nullptr;
+    AVFrame* m_frame = nullptr;
+    AVPacket* m_pkt = nullptr;
+    BandedScaler m_scaler;
+    int64_t m_frameIndex = 0;
+    bool m_forceKeyframe = false;
+    UdpOutput* m_output = nullptr;
+
+    // Статистика задержки энкодера
+    std::chrono::steady_clock::time_point m_statStart;
+    double m_encodeMsTotal = 0;
+    int m_statFrames = 0;
+
+public:
+    ~FrameEncoder() { Close(); }
+
+    // Основной поток (g_MainOutput) дополнительно пишется в запись и replay буфер
+    bool Open(int width, int height, int fps, UdpOutput* output = &g_MainOutput) {
+        Close();
+        m_output = output;
+        for (const char* name : ENCODER_CANDIDATES) {
+            const AVCodec* codec = avcodec_find_encoder_by_name(name);
+            if (!codec) continue;
+
+            m_encCtx = avcodec_alloc_context3(codec);
+            m_encCtx->width = width;
+            m_encCtx->height = height;
+            m_encCtx->time_base = { 1, fps };
+            m_encCtx->framerate = { fps, 1 };
+            m_encCtx->pix_fmt = AV_PIX_FMT_NV12;
+            m_encCtx->gop_size = fps * ENCODER_GOP_SECONDS;
+            m_encCtx->max_b_frames = 0;
+            m_encCtx->bit_rate = ENCODER_BITRATE;
+            m_encCtx->flags |= AV_CODEC_FLAG_LOW_DELAY;
+
+            AVDictionary* opts = nullptr;
+            SetLowLatencyOptions(name, &opts);
+            int err = avcodec_open2(m_encCtx, codec, &opts);
+            av_dict_free(&opts);
+            if (err >= 0) {
+                LogToGUI(std::string("Encoder: ") + name);
+                break;
+            }
+            avcodec_free_context(&m_encCtx);
+        }
+        if (!m_encCtx) {
+            LogToGUI("Encoder: no usable H.264 encoder found.");
+            return false;
+        }
+
+        m_frame = av_frame_alloc();
+        m_frame->format = AV_PIX_FMT_NV12;
+        m_frame->width = width;
+        m_frame->height = height;
+        m_pkt = av_packet_alloc();
+        bool scalerReady = m_scaler.Configure(width, height, AV_PIX_FMT_BGRA, AV_PIX_FMT_NV12);
+        if (av_frame_get_buffer(m_frame, 32) < 0 || !scalerReady || !OpenMuxer()) {
+            LogToGUI("Encoder: initialization failed.");
+            Close();
+            return false;
+        }
+
+        if (IsPrimary()) g_Replay.Configure(m_stream->codecpar, m_stream->time_base);
+        m_statStart = std::chrono::steady_clock::now();
+        return true;
+    }
+
+    void Close() {
+        if (m_encCtx && m_muxCtx) {
+            avcodec_send_frame(m_encCtx, nullptr);
+            DrainPackets();
+            av_write_trailer(m_muxCtx);
+        }
+        if (m_muxCtx) {
+            if (m_muxCtx->pb) {
+                av_freep(&m_muxCtx->pb->buffer);
+                avio_context_free(&m_muxCtx->pb);
+            }
+            avformat_free_context(m_muxCtx);
+            m_muxCtx = nullptr;
+            m_stream = nullptr;
+        }
+        m_scaler.Reset();
+        av_packet_free(&m_pkt);
+        av_frame_free(&m_frame);
+        avcodec_free_context(&m_encCtx);
+        m_frameIndex = 0;
+    }
+
+    void EncodeBGRA(const uint8_t* data, int pitch) {
+        if (!m_encCtx) return;
+        if (av_frame_make_writable(m_frame) < 0) return;
+
+        auto t0 = std::chrono::steady_clock::now();
+        const uint8_t* srcData[4] = { data, nullptr, nullptr, nullptr };
+        int srcLinesize[4] = { pitch, 0, 0, 0 };
+        m_scaler.Scale(srcData, srcLinesize, m_frame->data, m_frame->linesize);
+        m_frame->pts = m_frameIndex++;
+        m_frame->pict_type = m_forceKeyframe ? AV_PICTURE_TYPE_I : AV_PICTURE_TYPE_NONE;
+        m_forceKeyframe = false;
+
+        if (avcodec_send_frame(m_encCtx, m_frame) >= 0) DrainPackets();
+
+        auto t1 = std::chrono::steady_clock::now();
+        m_encodeMsTotal += std::chrono::duration<double, std::milli>(t1 - t0).count();
+        m_statFrames++;
+        double elapsed = std::chrono::duration<double>(t1 - m_statStart).count();
+        if (elapsed >= ENCODER_STATS_INTERVAL_SEC) {
+            char msg[128];
+            snprintf(msg, sizeof(msg), "Encoder :%d: %.1f fps, %.2f ms avg convert+encode", ntohs(m_output->addr.sin_port), m_statFrames / elapsed, m_encodeMsTotal / m_statFrames);
+            LogToGUI(msg);
+            m_statStart = t1;
+            m_encodeMsTotal = 0;
+            m_statFrames = 0;
+        }
+    }
+
+    // Пропущенный тик (статичная картинка): pts следующего кадра остаётся привязан ко времени
+    void SkipFrame() { m_frameIndex++; }
+    void RequestKeyframe() { m_forceKeyframe = true; }
+
+private:
+    bool IsPrimary() const { return m_output == &g_MainOutput; }
+
+    static void SetLowLatencyOptions(const char* name, AVDictionary** opts) {
+        std::string n = name;
+        if (n == "libx264") {
+            av_dict_set(opts, "preset", "veryfast", 0);
+            av_dict_set(opts, "tune", "zerolatency", 0);
+        }
+        else if (n == "h264_nvenc") {
+            av_dict_set(opts, "preset", "p1", 0);
+            av_dict_set(opts, "tune", "ull", 0);
+            av_dict_set(opts, "zerolatency", "1", 0);
+        }
+        else if (n == "h264_qsv") {
+            av_dict_set(opts, "preset", "veryfast", 0);
+            av_dict_set(opts, "async_depth", "1", 0);
+        }
+        else if (n == "h264_amf") {
+            av_dict_set(opts, "usage", "ultralowlatency", 0);
+        }
+    }
+
+#if LIBAVFORMAT_VERSION_MAJOR >= 61
+    static int WriteTsPacket(void* opaque, const uint8_t* buf, int size) {
+#else
+    static int WriteTsPacket(void* opaque, uint8_t* buf, int size) {
+#endif
+        FrameEncoder* self = (FrameEncoder*)opaque;
+        if (!self->IsPrimary()) {
+            if (g_IsStreamNetwork && g_UdpSocket != INVALID_SOCKET) self->m_output->Send(g_UdpSocket, buf, size);
+            return size;
+        }
+        if (g_IsStreamNetwork) SendUdpData(buf, size);
+        if (g_IsRecording) g_Recorder.WriteStream(buf, size);
+        return size;
+    }
+
+    bool OpenMuxer() {
+        if (avformat_alloc_output_context2(&m_muxCtx, nullptr, "mpegts", nullptr) < 0 || !m_muxCtx) return false;
+
+        // Буфер AVIO = одна UDP датаграмма (7 TS пакетов)
+        unsigned char* ioBuffer = (unsigned char*)av_malloc(UDP_PACKET_SIZE);
+        m_muxCtx->pb = avio_alloc_context(ioBuffer, UDP_PACKET_SIZE, 1, this, nullptr, WriteTsPacket, nullptr);
+        if (!m_muxCtx->pb) return false;
+        m_muxCtx->flush_packets = 1;
+
+        m_stream = avformat_new_stream(m_muxCtx, nullptr);
+        if (!m_stream) return false;
+        avcodec_parameters_from_context(m_stream->codecpar, m_encCtx);
+        m_stream->time_base = m_encCtx->time_base;
+
+        AVDictionary* opts = nullptr;
+        av_dict_set(&opts, "mpegts_flags", "resend_headers", 0);
+        av_dict_set(&opts, "muxdelay", "0", 0);
+        int err = avformat_write_header(m_muxCtx, &opts);
+        av_dict_free(&opts);
+        return err >= 0;
+    }
+
+    void DrainPackets() {
+        while (avcodec_receive_packet(m_encCtx, m_pkt) >= 0) {
+            av_packet_rescale_ts(m_pkt, m_encCtx->time_base, m_stream->time_base);
+            m_pkt->stream_index = m_stream->index;
+            if (IsPrimary()) g_Replay.Push(m_pkt);
+            av_write_frame(m_muxCtx, m_pkt);
+            av_packet_unref(m_pkt);
+        }
+    }
+};
+
+// ==========================================
+// SHARED MEMORY ВЫХОД (ЛОКАЛЬНЫЕ ПОТРЕБИТЕЛИ)
+// ==========================================
+// Формат описан в SharedFrameRing.h. Кадр конвертируется прямо в слот,
+// так что локальный читатель получает его без единой копии.
+class SharedFrameSink {
+    HANDLE m_hMapping = nullptr;
+    HANDLE m_events[2] = { nullptr, nullptr };
+    uint8_t* m_view = nullptr;
+    SfrHeader* m_header = nullptr;
+    SfrSlotHeader* m_writing = nullptr;
+    int64_t m_frameId = 0;
+    std::chrono::steady_clock::time_point m_startTime;
+
+public:
+    ~SharedFrameSink() { Close(); }
+
+    bool IsOpen() const { return m_header != nullptr; }
+
+    bool Open(uint32_t maxFrameSize) {
+        if (m_header && m_header->maxFrameSize >= maxFrameSize) return true;
+        Close();
+
+        uint32_t slotStride = (SFR_SLOT_HEADER_SIZE + maxFrameSize + 63) & ~63u;
+        uint64_t total = SFR_HEADER_SIZE + (uint64_t)slotStride * SFR_SLOT_COUNT;
+        m_hMapping = CreateFileMappingW(INVALID_HANDLE_VALUE, nullptr, PAGE_READWRITE, (DWORD)(total >> 32), (DWORD)(total & 0xFFFFFFFF), SFR_DEFAULT_NAME);
+        bool existed = (GetLastError() == ERROR_ALREADY_EXISTS);
+        if (m_hMapping) m_view = (uint8_t*)MapViewOfFile(m_hMapping, FILE_MAP_ALL_ACCESS, 0, 0, 0);
+        if (!m_view) {
+            LogToGUI("Shared memory: cannot create mapping.");
+            Close();
+            return false;
+        }
+
+        m_header = (SfrHeader*)m_view;
+        // Старый маппинг ещё держат читатели: размер менять нельзя
+        if (existed && (m_header->magic != SFR_MAGIC || m_header->slotStride < slotStride)) {
+            LogToGUI("Shared memory: mapping in use by readers with a smaller frame size.");
+            Close();
+            return false;
+        }
+        if (!existed) {
+            m_header->version = SFR_VERSION;
+            m_header->slotCount = SFR_SLOT_COUNT;
+            m_header->slotStride = slotStride;
+            m_header->maxFrameSize = maxFrameSize;
+            m_header->lastFrameId = 0;
+            MemoryBarrier();
+            m_header->magic = SFR_MAGIC;
+        }
+        m_frameId = m_header->lastFrameId;
+
+        for (int i = 0; i < 2; i++) {
+            std::wstring evName = std::wstring(SFR_DEFAULT_NAME) + SFR_EVENT_SUFFIX + (i ? L"1" : L"0");
+            m_events[i] = CreateEventW(nullptr, TRUE, FALSE, evName.c_str());
+        }
+        m_startTime = std::chrono::steady_clock::now();
+        LogToGUI("Shared memory output: " + std::to_string(SFR_SLOT_COUNT) + " slots x " + std::to_string(maxFrameSize / 1024) + " KB");
+        return true;
+    }
+
+    void Close() {
+        if (m_view) UnmapViewOfFile(m_view);
+        if (m_hMapping) CloseHandle(m_hMapping);
+        for (HANDLE& ev : m_events) {
+            if (ev) CloseHandle(ev);
+            ev = nullptr;
+        }
+        m_view = nullptr;
+        m_header = nullptr;
+        m_hMapping = nullptr;
+        m_writing = nullptr;
+    }
+
+    // Возвращает слот для записи кадра; до EndWrite читатели считают его невалидным
+    uint8_t* BeginWrite(uint32_t size) {
+        if (!m_header || size > m_header->maxFrameSize) return nullptr;
+        m_writing = SfrGetSlot(m_view, m_header, m_frameId + 1);
+        InterlockedIncrement(&m_writing->seq);
+        return SfrSlotData(m_writing);
+    }
+
+    void EndWrite(SfrPixelFormat format, int width, int height, int stride, uint32_t size) {
+        if (!m_writing) return;
+        m_frameId++;
+        m_writing->format = format;
+        m_writing->width = width;
+        m_writing->height = height;
+        m_writing->stride = stride;
+        m_writing->size = size;
+        m_writing->frameId = m_frameId;
+        m_writing->timestampUs = std::chrono::duration_cast<std::chrono::microseconds>(std::chrono::steady_clock::now() - m_startTime).count();
+        InterlockedIncrement(&m_writing->seq);
+        InterlockedExchange64(&m_header->lastFrameId, m_frameId);
+        m_writing = nullptr;
+
+        if (m_events[0] && m_events[1]) {
+            ResetEvent(m_events[(m_frameId + 1) & 1]);
+            SetEvent(m_events[m_frameId & 1]);
+        }
+    }
+};
+
+SharedFrameSink g_SharedFrames;
+
+// ==========================================
+// ROI (ОБЛАСТИ ИНТЕРЕСА) И УПРАВЛЕНИЕ
+// ==========================================
+// Прямоугольник ROI задаётся в streams.ini и может меняться на лету через
+// управляющий UDP порт (только loopback):
+//   roi <id> <x> <y> <w> <h>
+//   roi <id> window <заголовок окна>
+//   health  (последний декодированный кадр; пока опросы идут, декодер держит ключевые кадры)
+const int CONTROL_PORT = UDP_PORT + 2;
+const int64_t HEALTH_LEASE_MS = 5000;
+
+struct RoiRect {
+    int x = 0, y = 0, w = 0, h = 0;
+};
+
+class RoiRegistry {
+    struct Entry {
+        RoiRect rect;
+        std::string windowTitle;
+        HWND hwnd = nullptr;
+    };
+
+    std::map<int, Entry> m_entries;
+    std::mutex m_mutex;
+    int m_originX = 0, m_originY = 0;
+
+public:
+    void SetDesktopOrigin(int x, int y) {
+        std::lock_guard<std::mutex> lock(m_mutex);
+        m_originX = x;
+        m_originY = y;
+    }
+
+    void SetRect(int id, const RoiRect& rect) {
+        std::lock_guard<std::mutex> lock(m_mutex);
+        Entry& e = m_entries[id];
+        e.rect = rect;
+        e.windowTitle.clear();
+        e.hwnd = nullptr;
+    }
+
+    void SetWindow(int id, const std::string& title) {
+        std::lock_guard<std::mutex> lock(m_mutex);
+        Entry& e = m_entries[id];
+        e.windowTitle = title;
+        e.hwnd = nullptr;
+    }
+
+    // Текущий прямоугольник в координатах захваченной текстуры, обрезанный по её границам
+    bool Resolve(int id, int srcW, int srcH, RoiRect& out) {
+        std::lock_guard<std::mutex> lock(m_mutex);
+        auto it = m_entries.find(id);
+        if (it == m_entries.end()) return false;
+        Entry& e = it->second;
+
+        RoiRect r = e.rect;
+        if (!e.windowTitle.empty()) {
+            if (!e.hwnd || !IsWindow(e.hwnd)) e.hwnd = FindWindowA(nullptr, e.windowTitle.c_str());
+            RECT wr;
+            if (!e.hwnd || IsIconic(e.hwnd) || !GetWindowRect(e.hwnd, &wr)) return false;
+            r = { wr.left - m_originX, wr.top - m_originY, wr.right - wr.left, wr.bottom - wr.top };
+        }
+
+        int x0 = std::max(0, r.x), y0 = std::max(0, r.y);
+        int x1 = std::min(srcW, r.x + r.w), y1 = std::min(srcH, r.y + r.h);
+        out = { x0, y0, (x1 - x0) & ~1, (y1 - y0) & ~1 };
+        return out.w >= 16 && out.h >= 16;
+    }
+};
+
+RoiRegistry g_Rois;
+SOCKET g_ControlSocket = INVALID_SOCKET;
+std::thread g_ControlThread;
+
+// --- РЕДКИЕ ПОТРЕБИТЕЛИ ПИКСЕЛЕЙ ---
+// Пока зарегистрирован хотя бы один, декодер без превью держит ключевые кадры (GetDecodeDemand)
+std::atomic<int> g_LowRatePixelConsumers(0);
+std::atomic<int64_t> g_LastDecodedUs(0);
+std::atomic<int> g_LastDecodedWidth(0);
+std::atomic<int> g_LastDecodedHeight(0);
+
+void RegisterLowRatePixelConsumer() { g_LowRatePixelConsumers++; }
+void UnregisterLowRatePixelConsumer() { g_LowRatePixelConsumers--; }
+
+// Health check: каждый запрос продлевает аренду на HEALTH_LEASE_MS, истечение снимает регистрацию
+bool g_HealthLeaseActive = false; // только поток управления
+int64_t g_HealthLeaseUntilMs = 0;
+
+std::string HandleHealthCommand() {
+    if (!g_HealthLeaseActive) {
+        RegisterLowRatePixelConsumer();
+        g_HealthLeaseActive = true;
+    }
+    g_HealthLeaseUntilMs = UdpOutput::NowMs() + HEALTH_LEASE_MS;
+
+    int64_t lastUs = g_LastDecodedUs;
+    if (lastUs == 0) return "ok: no decoded frame yet";
+    return "ok: " + std::to_string(g_LastDecodedWidth.load()) + "x" + std::to_string(g_LastDecodedHeight.load()) +
+        " decoded " + std::to_string((LatencyNowUs() - lastUs) / 1000) + " ms ago";
+}
+
+void ExpireHealthLease(bool force) {
+    if (!g_HealthLeaseActive || (!force && UdpOutput::NowMs() < g_HealthLeaseUntilMs)) return;
+    UnregisterLowRatePixelConsumer();
+    g_HealthLeaseActive = false;
+}
+
+std::string HandleControlCommand(const std::string& cmd) {
+    std::istringstream args(cmd);
+    std::string verb;
+    int id = 0;
+    args >> verb;
+    if (verb == "health") return HandleHealthCommand();
+    args >> id;
+    if (verb != "roi" || args.fail()) return "error: expected 'roi <id> ...' or 'health'";
+
+    std::string mode;
+    args >> mode;
+    if (mode == "window") {
+        std::string title;
+        std::getline(args >> std::ws, title);
+        if (title.empty()) return "error: missing window title";
+        g_Rois.SetWindow(id, title);
+        return "ok";
+    }
+
+    RoiRect rect;
+    try {
+        rect.x = std::stoi(mode);
+    }
+    catch (...) { return "error: bad rectangle"; }
+    args >> rect.y >> rect.w >> rect.h;
+    if (args.fail() || rect.w <= 0 || rect.h <= 0) return "error: bad rectangle";
+    g_Rois.SetRect(id, rect);
+    return "ok";
+}
+
+void RunControlServerThread() {
+    HANDLE mmcss = ApplyThreadPolicy(ThreadRole::Network);
+    char buf[512];
+    while (g_Running) {
+        sockaddr_in from = {};
+        int fromLen = sizeof(from);
+        int len = recvfrom(g_ControlSocket, buf, sizeof(buf) - 1, 0, (sockaddr*)&from, &fromLen);
+        ExpireHealthLease(false);
+        if (len <= 0) continue;
+        buf[len] = 0;
+        std::string cmd(buf);
+        while (!cmd.empty() && (cmd.back() == '\n' || cmd.back() == '\r')) cmd.pop_back();
+        std::string reply = HandleControlCommand(cmd);
+        sendto(g_ControlSocket, reply.c_str(), (int)reply.size(), 0, (sockaddr*)&from, fromLen);
+    }
+    ExpireHealthLease(true);
+    if (mmcss) AvRevertMmThreadCharacteristics(mmcss);
+}
+
+void StartControlServer() {
+    g_ControlSocket = socket(AF_INET, SOCK_DGRAM, IPPROTO_UDP);
+    if (g_ControlSocket == INVALID_SOCKET) return;
+    sockaddr_in local = {};
+    local.sin_family = AF_INET;
+    local.sin_port = htons(CONTROL_PORT);
+    local.sin_addr.s_addr = htonl(INADDR_LOOPBACK);
+    DWORD timeoutMs = 200;
+    setsockopt(g_ControlSocket, SOL_SOCKET, SO_RCVTIMEO, (char*)&timeoutMs, sizeof(timeoutMs));
+    if (bind(g_ControlSocket, (sockaddr*)&local, sizeof(local)) != 0) {
+        closesocket(g_ControlSocket);
+        g_ControlSocket = INVALID_SOCKET;
+        return;
+    }
+    g_ControlThread = std::thread(RunControlServerThread);
+}
+
+void StopControlServer() {
+    if (g_ControlThread.joinable()) g_ControlThread.join();
+    if (g_ControlSocket != INVALID_SOCKET) closesocket(g_ControlSocket);
+    g_ControlSocket = INVALID_SOCKET;
+}
+
+// ==========================================
+// CPU МАСШТАБИРОВАНИЕ (SSE2)
+// ==========================================
+// Раздельный (separable) фильтр: сначала вертикальный проход по строкам источника (SSE2),
+// затем горизонтальный по таблице коэффициентов. Таблицы считаются один раз в Configure.
+// Работает с 8-битными изображениями в 1, 2 или 4 канала: BGRA, а для NV12 - плоскости Y (1) и UV (2).
+// Для 2:1 и 3:2 (большинство пар из AVAILABLE_RESOLUTIONS) есть отдельные пути без таблиц.
+enum class ScaleFilter { Gpu, Box, Bilinear };
+
+const int SCALE_WEIGHT_BITS = 14;
+const int SCALE_WEIGHT_ONE = 1 << SCALE_WEIGHT_BITS;
+
+class CpuScaler {
+    struct FilterTable {
+        int taps = 0;
+        std::vector<int> start;       // первый отсчёт источника для каждого выходного
+        std::vector<int16_t> weights; // taps весов на каждый выходной, сумма = SCALE_WEIGHT_ONE
+    };
+
+    enum class FastPath { None, Half, ThreeToTwo };
+
+    int m_srcW = 0, m_srcH = 0, m_dstW = 0, m_dstH = 0, m_channels = 0;
+    ScaleFilter m_filter = ScaleFilter::Box;
+    FastPath m_fastPath = FastPath::None;
+    FilterTable m_horizontal, m_vertical;
+
+    // Box: вес = доля пересечения пикселя источника с областью выходного пикселя.
+    // Bilinear: треугольник шириной max(1, scale), иначе при уменьшении он вырождается в point.
+    static FilterTable BuildTable(int srcSize, int dstSize, ScaleFilter filter) {
+        FilterTable t;
+        double scale = (double)srcSize / dstSize;
+        double support = filter == ScaleFilter::Box ? scale / 2 : std::max(1.0, scale);
+        t.taps = std::min(srcSize, (int)ceil(support * 2) + 1);
+        t.start.resize(dstSize);
+        t.weights.assign((size_t)dstSize * t.taps, 0);
+
+        std::vector<double> w(t.taps);
+        for (int i = 0; i < dstSize; i++) {
+            double center = (i + 0.5) * scale;
+            int first = std::max(0, (int)floor(center - support));
+            first = std::min(first, std::max(0, srcSize - t.taps));
+            double sum = 0;
+            for (int k = 0; k < t.taps; k++) {
+                int s = first + k;
+                double v = 0;
+                if (s < srcSize) {
+                    if (filter == ScaleFilter::Box) {
+                        double lo = std::max((double)s, center - support), hi = std::min(s + 1.0, center + support);
+                        v = std::max(0.0, hi - lo);
+                    }
+                    else {
+                        v = std::max(0.0, 1.0 - fabs(s + 0.5 - center) / support);
+                    }
+                }
+                w[k] = v;
+                sum += v;
+            }
+            // Целочисленные веса с остатком округления на самом весомом отсчёте
+            int total = 0, heaviest = 0;
+            for (int k = 0; k < t.taps; k++) {
+                int q = sum > 0 ? (int)lround(w[k] / sum * SCALE_WEIGHT_ONE) : (k == 0 ? SCALE_WEIGHT_ONE : 0);
+                t.weights[(size_t)i * t.taps + k] = (int16_t)q;
+                total += q;
+                if (w[k] > w[heaviest]) heaviest = k;
+            }
+            t.weights[(size_t)i * t.taps + heaviest] += (int16_t)(SCALE_WEIGHT_ONE - total);
+            t.start[i] = first;
+        }
+        return t;
+    }
+
+    // dst[x] = sum(rows[k][x] * w[k]) >> 14. Пары строк идут через _mm_madd_epi16.
+    static void VerticalPass(const uint8_t* const* rows, const int16_t* w, int taps, uint8_t* dst, int bytes) {
+        const __m128i zero = _mm_setzero_si128();
+        const __m128i round = _mm_set1_epi32(SCALE_WEIGHT_ONE / 2);
+        int x = 0;
+        for (; x + 16 <= bytes; x += 16) {
+            __m128i acc[4] = { round, round, round, round };
+            for (int k = 0; k < taps; k += 2) {
+                __m128i a = _mm_loadu_si128((const __m128i*)(rows[k] + x));
+                __m128i b = k + 1 < taps ? _mm_loadu_si128((const __m128i*)(rows[k + 1] + x)) : zero;
+                __m128i wk = _mm_set1_epi32((uint16_t)w[k] | ((k + 1 < taps ? (uint32_t)(uint16_t)w[k + 1] : 0u) << 16));
+                __m128i aLo = _mm_unpacklo_epi8(a, zero), aHi = _mm_unpackhi_epi8(a, zero);
+                __m128i bLo = _mm_unpacklo_epi8(b, zero), bHi = _mm_unpackhi_epi8(b, zero);
+                acc[0] = _mm_add_epi32(acc[0], _mm_madd_epi16(_mm_unpacklo_epi16(aLo, bLo), wk));
+                acc[1] = _mm_add_epi32(acc[1], _mm_madd_epi16(_mm_unpackhi_epi16(aLo, bLo), wk));
+                acc[2] = _mm_add_epi32(acc[2], _mm_madd_epi16(_mm_unpacklo_epi16(aHi, bHi), wk));
+                acc[3] = _mm_add_epi32(acc[3], _mm_madd_epi16(_mm_unpackhi_epi16(aHi, bHi), wk));
+            }
+            __m128i lo = _mm_packs_epi32(_mm_srai_epi32(acc[0], SCALE_WEIGHT_BITS), _mm_srai_epi32(acc[1], SCALE_WEIGHT_BITS));
+            __m128i hi = _mm_packs_epi32(_mm_srai_epi32(acc[2], SCALE_WEIGHT_BITS), _mm_srai_epi32(acc[3], SCALE_WEIGHT_BITS));
+            _mm_storeu_si128((__m128i*)(dst + x), _mm_packus_epi16(lo, hi));
+        }
+        for (; x < bytes; x++) {
+            int acc = SCALE_WEIGHT_ONE / 2;
+            for (int k = 0; k < taps; k++) acc += rows[k][x] * w[k];
+            dst[x] = (uint8_t)std::min(255, std::max(0, acc >> SCALE_WEIGHT_BITS));
+        }
+    }
+
+    void HorizontalPass(const uint8_t* src, uint8_t* dst) const {
+        const int taps = m_horizontal.taps, ch = m_channels;
+        for (int x = 0; x < m_dstW; x++) {
+            const uint8_t* s = src + m_horizontal.start[x] * ch;
+            const int16_t* w = &m_horizontal.weights[(size_t)x * taps];
+            for (int c = 0; c < ch; c++) {
+                int acc = SCALE_WEIGHT_ONE / 2;
+                for (int k = 0; k < taps; k++) acc += s[k * ch + c] * w[k];
+                dst[x * ch + c] = (uint8_t)std::min(255, std::max(0, acc >> SCALE_WEIGHT_BITS));
+            }
+        }
+    }
+
+    // 2:1 box: среднее двух строк через _mm_avg_epu8, затем пар соседних пикселей
+    void ScaleHalfRow(const uint8_t* row0, const uint8_t* row1, uint8_t* dst) const {
+        const int ch = m_channels;
+        int x = 0;
+        if (ch == 4) {
+            for (; x + 4 <= m_dstW; x += 4) {
+                __m128i a = _mm_avg_epu8(_mm_loadu_si128((const __m128i*)(row0 + x * 8)), _mm_loadu_si128((const __m128i*)(row1 + x * 8)));
+                __m128i b = _mm_avg_epu8(_mm_loadu_si128((const __m128i*)(row0 + x * 8 + 16)), _mm_loadu_si128((const __m128i*)(row1 + x * 8 + 16)));
+                __m128 af = _mm_castsi128_ps(a), bf = _mm_castsi128_ps(b);
+                __m128i even = _mm_castps_si128(_mm_shuffle_ps(af, bf, _MM_SHUFFLE(2, 0, 2, 0)));
+                __m128i odd = _mm_castps_si128(_mm_shuffle_ps(af, bf, _MM_SHUFFLE(3, 1, 3, 1)));
+                _mm_storeu_si128((__m128i*)(dst + x * 4), _mm_avg_epu8(even, odd));
+            }
+        }
+        for (; x < m_dstW; x++) {
+            for (int c = 0; c < ch; c++) {
+                int i0 = (2 * x) * ch + c, i1 = (2 * x + 1) * ch + c;
+                dst[x * ch + c] = (uint8_t)((row0[i0] + row0[i1] + row1[i0] + row1[i1] + 2) >> 2);
+            }
+        }
+    }
+
+    // 3:2 box: выходные пиксели покрывают 1.5 входных, веса 2/3 и 1/3
+    void ScaleThreeToTwoRow(const uint8_t* src, uint8_t* dst) const {
+        const int ch = m_channels;
+        for (int x = 0; x + 1 < m_dstW; x += 2) {
+            const uint8_t* s = src + (x / 2) * 3 * ch;
+            for (int c = 0; c < ch; c++) {
+                dst[x * ch + c] = (uint8_t)((2 * s[c] + s[ch + c] + 1) / 3);
+                dst[(x + 1) * ch + c] = (uint8_t)((s[ch + c] + 2 * s[2 * ch + c] + 1) / 3);
+            }
+        }
+    }
+
+    void ScaleRows(const uint8_t* src, int srcPitch, uint8_t* dst, int dstPitch, int y0, int y1) const {
+        if (m_fastPath == FastPath::Half) {
+            for (int y = y0; y < y1; y++) {
+                ScaleHalfRow(src + (size_t)(2 * y) * srcPitch, src + (size_t)(2 * y + 1) * srcPitch, dst + (size_t)y * dstPitch);
+            }
+            return;
+        }
+
+        thread_local std::vector<uint8_t> temp;
+        temp.resize((size_t)m_srcW * m_channels);
+        const uint8_t* rows[64];
+        for (int y = y0; y < y1; y++) {
+            const int16_t* w = &m_vertical.weights[(size_t)y * m_vertical.taps];
+            for (int k = 0; k < m_vertical.taps; k++) rows[k] = src + (size_t)(m_vertical.start[y] + k) * srcPitch;
+            VerticalPass(rows, w, m_vertical.taps, temp.data(), m_srcW * m_channels);
+            if (m_fastPath == FastPath::ThreeToTwo) ScaleThreeToTwoRow(temp.data(), dst + (size_t)y * dstPitch);
+            else HorizontalPass(temp.data(), dst + (size_t)y * dstPitch);
+        }
+    }
+
+public:
+    bool Configure(int srcW, int srcH, int dstW, int dstH, int channels, ScaleFilter filter) {
+        if (srcW == m_srcW && srcH == m_srcH && dstW == m_dstW && dstH == m_dstH && channels == m_channels && filter == m_filter) return true;
+        if (srcW < 1 || srcH < 1 || dstW < 1 || dstH < 1 || (channels != 1 && channels != 2 && channels != 4)) return false;
+        // Не больше 64 отсчётов по вертикали (уменьшение до ~30:1)
+        if (srcH / dstH > 30) return false;
+        m_srcW = srcW; m_srcH = srcH; m_dstW = dstW; m_dstH = dstH;
+        m_channels = channels;
+        m_filter = filter;
+
+        m_fastPath = FastPath::None;
+        if (filter == ScaleFilter::Box) {
+            if (srcW == dstW * 2 && srcH == dstH * 2) m_fastPath = FastPath::Half;
+            else if (srcW * 2 == dstW * 3 && dstW % 2 == 0) m_fastPath = FastPath::ThreeToTwo;
+        }
+        m_horizontal = BuildTable(srcW, dstW, filter);
+        m_vertical = BuildTable(srcH, dstH, filter);
+        return true;
+    }
+
+    void Scale(const uint8_t* src, int srcPitch, uint8_t* dst, int dstPitch) const {
+        g_Jobs.ParallelFor(m_dstH, JOB_MIN_BAND_ROWS / 2, [&](int y0, int y1) { ScaleRows(src, srcPitch, dst, dstPitch, y0, y1); });
+    }
+};
+
+// ==========================================
+// СТАТИЧНЫЙ КОНТЕНТ (АДАПТИВНАЯ ЧАСТОТА ЗАХВАТА)
+// ==========================================
+// Рабочий стол большую часть времени стоит, а курсор двигается. DXGI сообщает об этом сам:
+// LastPresentTime == 0 и AccumulatedFrames == 0 - обновился только указатель. Для случая
+// "перерисовали то же самое" есть отпечаток по всем пикселям кадра (даже одна строка - это "-" или курсор).
+// Пока картинка не меняется, раз в keepalive уходит полный кадр (у энкодера - ключевой, чтобы
+// подключившийся позже приёмник получил изображение). Первый изменившийся кадр сразу
+// возвращает полную частоту. В детекторе нет D3D: на входе метаданные и отпечаток.
+const int64_t STATIC_KEEPALIVE_DEFAULT_MS = 1000;
+const int STATIC_ENTER_FRAMES = 3; // столько неизменных тиков подряд, прежде чем снижать частоту
+// Без CPU потребителя (только превью) кадр не читается целиком: GPU сворачивает каждый блок
+// FINGERPRINT_GPU_DIVISOR x FINGERPRINT_GPU_DIVISOR в хэш всех его пикселей, читается только сетка хэшей
+const int FINGERPRINT_GPU_DIVISOR = 4;
+const int64_t CAPTURE_RATE_REPORT_US = 10000000;
+
+enum class FrameAction { Send, Keepalive, Skip };
+
+uint64_t FrameFingerprint(const uint8_t* data, int pitch, int rowBytes, int rows) {
+    uint64_t h = 1469598103934665603ULL;
+    for (int y = 0; y < rows; y++) {
+        const uint8_t* row = data + (size_t)y * pitch;
+        int x = 0;
+        for (; x + 8 <= rowBytes; x += 8) {
+            uint64_t w;
+            memcpy(&w, row + x, 8);
+            h = (h ^ w) * 1099511628211ULL;
+        }
+        if (x < rowBytes) {
+            uint64_t w = 0;
+            memcpy(&w, row + x, rowBytes - x);
+            h = (h ^ w) * 1099511628211ULL;
+        }
+    }
+    return h;
+}
+
+class StaticContentDetector {
+    int64_t m_keepaliveUs;
+    bool m_haveFingerprint = false;
+    uint64_t m_fingerprint = 0;
+    int m_unchangedRun = 0;
+    int64_t m_lastSentUs = 0;
+
+    int64_t m_windowStartUs = 0;
+    uint64_t m_ticks = 0, m_sent = 0, m_keepalives = 0, m_unchanged = 0;
+
+public:
+    // keepaliveUs == 0: адаптация выключена, каждый тик с кадром отправляется
+    explicit StaticContentDetector(int64_t keepaliveUs) : m_keepaliveUs(keepaliveUs) {}
+
+    bool Enabled() const { return m_keepaliveUs > 0; }
+    bool IsStatic() const { return m_unchangedRun >= STATIC_ENTER_FRAMES; }
+
+    // presented: у кадра новое изображение (по метаданным захвата). fingerprint - его отпечаток,
+    // если посчитан; совпадение с прошлым значит, что перерисовали то же самое.
+    FrameAction OnFrame(bool presented, const uint64_t* fingerprint, int64_t nowUs) {
+        bool changed = presented;
+        if (presented && fingerprint) {
+            changed = !m_haveFingerprint || *fingerprint != m_fingerprint;
+            m_fingerprint = *fingerprint;
+            m_haveFingerprint = true;
+        }
+        m_unchangedRun = changed ? 0 : m_unchangedRun + 1;
+
+        FrameAction action = FrameAction::Send;
+        if (Enabled() && IsStatic()) action = (nowUs - m_lastSentUs >= m_keepaliveUs) ? FrameAction::Keepalive : FrameAction::Skip;
+        if (action != FrameAction::Skip) m_lastSentUs = nowUs;
+
+        if (m_windowStartUs == 0) m_windowStartUs = nowUs;
+        m_ticks++;
+        if (!changed) m_unchanged++;
+        if (action != FrameAction::Skip) m_sent++;
+        if (action == FrameAction::Keepalive) m_keepalives++;
+        return action;
+    }
+
+    // Раз в CAPTURE_RATE_REPORT_US: фактическая частота отправки и доля тиков без изменений
+    bool Report(int64_t nowUs, std::string& line) {
+        if (m_ticks == 0 || nowUs - m_windowStartUs < CAPTURE_RATE_REPORT_US) return false;
+        double seconds = (nowUs - m_windowStartUs) / 1e6;
+        char buf[160];
+        snprintf(buf, sizeof(buf), "Capture rate: %.1f fps sent (%llu keepalive), idle %.0f%% of %llu ticks",
+            m_sent / seconds, (unsigned long long)m_keepalives, 100.0 * m_unchanged / m_ticks, (unsigned long long)m_ticks);
+        line = buf;
+        m_windowStartUs = nowUs;
+        m_ticks = m_sent = m_keepalives = m_unchanged = 0;
+        return true;
+    }
+};
+
+// ==========================================
+// SIMULCAST (НЕСКОЛЬКО РАЗРЕШЕНИЙ ИЗ ОДНОГО ЗАХВАТА)
+// ==========================================
+enum class RenditionFormat { Rgb24, Bgra, H264 };
+
+struct RenditionConfig {
+    int width = 0;
+    int height = 0;
+    RenditionFormat format = RenditionFormat::Rgb24;
+    int fpsDivisor = 1;
+    int port = 0;
+    int roiId = -1; // >= 0: поток области интереса из g_Rois
+};
+
+struct Rendition {
+    RenditionConfig config;
+    UdpOutput output;
+    FrameEncoder encoder; // объявлен после output: закрывается (и дописывает хвост) раньше
+    ComPtr<ID3D11Texture2D> crop;
+    ComPtr<ID3D11Texture2D> texture;
+    ComPtr<ID3D11Texture2D> staging;
+    std::vector<uint8_t> buffer;
+
+    ~Rendition() { UnregisterUdpOutput(&output); }
+};
+
+void ConvertBGRAToRGBRows(const uint8_t* src, int srcPitch, uint8_t* dst, int w, int y0, int y1) {
+    for (int y = y0; y < y1; y++) {
+        const uint8_t* rowSrc = src + y * srcPitch;
+        uint8_t* rowDst = dst + y * w * 3;
+        for (int x = 0; x < w; x++) {
+            uint8_t b = rowSrc[x * 4 + 0];
+            uint8_t g = rowSrc[x * 4 + 1];
+            uint8_t r = rowSrc[x * 4 + 2];
+            rowDst[x * 3 + 0] = r;
+            rowDst[x * 3 + 1] = g;
+            rowDst[x * 3 + 2] = b;
+        }
+    }
+}
+
+void ConvertBGRAToRGB(const uint8_t* src, int srcPitch, uint8_t* dst, int w, int h) {
+    g_Jobs.ParallelFor(h, JOB_MIN_BAND_ROWS, [&](int y0, int y1) { ConvertBGRAToRGBRows(src, srcPitch, dst, w, y0, y1); });
+}
+void CopyBGRARows(const uint8_t* src, int srcPitch, uint8_t* dst, int w, int h) {
+    g_Jobs.ParallelFor(h, JOB_MIN_BAND_ROWS, [&](int y0, int y1) {
+        for (int y = y0; y < y1; y++) memcpy(dst + y * w * 4, src + y * srcPitch, w * 4);
+    });
+}
+
+// ==========================================
+// ЛОГИКА РЕСАЙЗА (GUI)
+// ==========================================
+void UpdateVideoLayout(int contentW, int contentH) {
+    if (!g_hMainWindow || !g_hVideoWindow) return;
+    if (contentW <= 0 || contentH <= 0) return;
+
+    RECT rcMain;
+    GetClientRect(g_hMainWindow, &rcMain);
+
+    int availW = rcMain.right - rcMain.left;
+    int startY = TOP_PANEL_HEIGHT + CONSOLE_HEIGHT;
+    int availH = (rcMain.bottom - rcMain.top) - startY;
+
+    if (availH <= 0) return;
+    float scaleX = (float)availW / contentW;
+    float scaleY = (float)availH / contentH;
+    float scale = std::min(scaleX, scaleY);
+    int newW = (int)(contentW * scale);
+    int newH = (int)(contentH * scale);
+
+    int x = (availW - newW) / 2;
+    int y = startY + (availH - newH) / 2;
+
+    SetWindowPos(g_hVideoWindow, NULL, x, y, newW, newH, SWP_NOZORDER | SWP_NOACTIVATE);
+}
+
+// ==========================================
+// ШЕЙДЕРЫ И РЕНДЕР
+// ==========================================
+
+const char* HLSL_NV12_TO_RGB = R"(
+    Texture2D<float> InputY : register(t0);
+    Texture2D<float2> InputUV : register(t1);
+    RWTexture2D<float4> OutputRGB : register(u0);
+
+    [numthreads(8, 8, 1)]
+    void CSMain(uint3 dispatchThreadId : SV_DispatchThreadID) {
+        uint2 pos = dispatchThreadId.xy;
+        uint width, height;
+        OutputRGB.GetDimensions(width, height);
+        if (pos.x >= width || pos.y >= height) return;
+        
+        float Y = InputY[uint2(pos.x, pos.y)];
+        float2 UV = InputUV[uint2(pos.x / 2, pos.y / 2)];
+        float U = UV.x - 0.5f;
+        float V = UV.y - 0.5f;
+
+        float r = Y + 1.13983f * V;
+        float g = Y - 0.39465f * U - 0.58060f * V;
+        float b = Y + 2.03211f * U;
+        OutputRGB[pos] = float4(r, g, b, 1.0f);
+    }
+)";
+
+const char* HLSL_RESIZE = R"(
+    Texture2D<float4> Input : register(t0);
+    RWTexture2D<float4> Output : register(u0);
+    cbuffer Params : register(b0) { uint srcW; uint srcH; uint dstW; uint dstH; };
+
+    [numthreads(16, 16, 1)]
+    void CSMain(uint3 id : SV_DispatchThreadID) {
+        if (id.x >= dstW || id.y >= dstH) return;
+        uint sx = (id.x * srcW) / dstW;
+        uint sy = (id.y * srcH) / dstH;
+        Output[id.xy] = Input[uint2(sx, sy)];
+    }
+)";
+
+// Блок исходника -> FNV хэш всех его пикселей (отпечаток для StaticContentDetector)
+const char* HLSL_BLOCK_HASH = R"(
+    Texture2D<float4> Input : register(t0);
+    RWTexture2D<uint> Output : register(u0);
+    cbuffer Params : register(b0) { uint srcW; uint srcH; uint dstW; uint dstH; };
+
+    [numthreads(16, 16, 1)]
+    void CSMain(uint3 id : SV_DispatchThreadID) {
+        if (id.x >= dstW || id.y >= dstH) return;
+        uint x0 = (id.x * srcW) / dstW, x1 = ((id.x + 1) * srcW) / dstW;
+        uint y0 = (id.y * srcH) / dstH, y1 = ((id.y + 1) * srcH) / dstH;
+        uint h = 2166136261;
+        for (uint y = y0; y < y1; y++) {
+            for (uint x = x0; x < x1; x++) {
+                uint4 c = (uint4)round(Input[uint2(x, y)] * 255.0f);
+                h = (h ^ (c.r | (c.g << 8) | (c.b << 16))) * 16777619;
+            }
+        }
+        Output[id.xy] = h;
+    }
+)";
+
+#define ALIGN_32(x) (((x) + 31) & ~31)
+
+struct ResizeParams {
+    uint32_t srcW, srcH, dstW, dstH;
+};
+
+class D3DRenderer {
+    ComPtr<ID3D11Device> m_device;
+    ComPtr<ID3D11DeviceContext> m_context;
+    ComPtr<IDXGISwapChain1> m_swapChain;
+
+    // OBS Mode
+    ComPtr<ID3D11ComputeShader> m_csNv12ToRgb;
+    ComPtr<ID3D11Texture2D> m_workTexture;
+
+    // DXGI Mode
+    ComPtr<ID3D11ComputeShader> m_csResize;
+    ComPtr<ID3D11ComputeShader> m_csBlockHash;
+    ComPtr<ID3D11Buffer> m_cbResizeParams;
+    ComPtr<ID3D11Texture2D> m_scaledTexture;
+    ComPtr<ID3D11Texture2D> m_captureCopyTexture;
+
+    ComPtr<ID3D11Texture2D> m_stagingTexture;
+    ComPtr<ID3D11Texture2D> m_fingerprintTexture;
+    ComPtr<ID3D11Texture2D> m_fingerprintStaging;
+    BandedScaler m_softScaler;
+    // Ресайз на CPU: по выбору в streams.ini или если compute shader недоступен (WARP, базовый адаптер)
+    ScaleFilter m_scaleFilter = ScaleFilter::Gpu;
+    CpuScaler m_cpuScaler;
+    ComPtr<ID3D11Texture2D> m_captureStaging;
+    std::vector<uint8_t> m_cpuScaled;
+    uint8_t* m_nv12Buffer = nullptr;
+    int m_nv12Stride = 0;
+    std::vector<uint8_t> m_rgbBuffer;
+
+    // Simulcast: отсортированы по убыванию площади, каждый уровень строится из предыдущего
+    std::vector<std::unique_ptr<Rendition>> m_renditions;
+    std::vector<std::unique_ptr<Rendition>> m_rois;
+    uint64_t m_frameCounter = 0;
+    int64_t m_captureUs = 0;
+    bool m_stagingFresh = false; // m_stagingTexture уже содержит текущий m_scaledTexture
+    bool m_stagingMapped = false;
+    bool m_frameReady = false;   // m_scaledTexture содержит последний захваченный кадр
+    bool m_cpuFrameValid = false; // m_cpuScaled содержит текущий кадр (CPU ресайз)
+    bool m_scaledPending = false; // m_cpuScaled ещё не загружен в m_scaledTexture
+
+    int m_width = 0, m_height = 0;
+    HWND m_hwndVideo;
+    HWND m_hwndMain;
+public:
+    D3DRenderer(HWND hVideo, HWND hMain) : m_hwndVideo(hVideo), m_hwndMain(hMain) {
+        InitD3D(hVideo);
+        InitShaders();
+    }
+
+    ~D3DRenderer() {
+        if (m_nv12Buffer) _aligned_free(m_nv12Buffer);
+    }
+
+    ID3D11Device* GetDevice() { return m_device.Get(); }
+
+    void SetScaleFilter(ScaleFilter filter) { m_scaleFilter = filter; }
+
+    void SetRenditions(const std::vector<RenditionConfig>& configs, int fps) {
+        m_renditions.clear();
+        m_rois.clear();
+        m_frameCounter = 0;
+        for (const auto& cfg : configs) {
+            auto r = std::make_unique<Rendition>();
+            r->config = cfg;
+            r->output.Init(INADDR_BROADCAST, cfg.port);
+            r->output.payloadType = (cfg.format == RenditionFormat::H264) ? RTP_PT_MP2T : RTP_PT_RAW;
+            RegisterUdpOutput(&r->output);
+            if (cfg.format == RenditionFormat::H264 && !r->encoder.Open(cfg.width, cfg.height, std::max(1, fps / cfg.fpsDivisor), &r->output)) {
+                r->config.format = RenditionFormat::Rgb24;
+            }
+            int64_t frameBytes = (int64_t)cfg.width * cfg.height * (r->config.format == RenditionFormat::Bgra ? 4 : 3);
+            r->output.SizeHistory(r->config.format == RenditionFormat::H264 ? ENCODER_BITRATE / 8 : frameBytes * fps / cfg.fpsDivisor);
+            LogToGUI(std::string(cfg.roiId >= 0 ? "ROI " + std::to_string(cfg.roiId) : "Simulcast") + ": " + std::to_string(cfg.width) + "x" +
+                std::to_string(cfg.height) + " every " + std::to_string(cfg.fpsDivisor) + " frame(s) -> port " + std::to_string(cfg.port));
+            if (cfg.roiId >= 0) m_rois.push_back(std::move(r));
+            else m_renditions.push_back(std::move(r));
+        }
+        std::stable_sort(m_renditions.begin(), m_renditions.end(), [](const std::unique_ptr<Rendition>& a, const std::unique_ptr<Rendition>& b) {
+            return a->config.width * a->config.height > b->config.width * b->config.height;
+        });
+    }
+
+    void ResizeSwapChain(int w, int h) {
+        if (m_width == w && m_height == h) return;
+
+        m_context->ClearState();
+        m_context->OMSetRenderTargets(0, nullptr, nullptr);
+
+        m_width = w;
+        m_height = h;
+
+        m_workTexture.Reset();
+        m_captureCopyTexture.Reset();
+
+        if (m_nv12Buffer) { _aligned_free(m_nv12Buffer); m_nv12Buffer = nullptr; }
+
+        m_nv12Stride = ALIGN_32(w);
+        size_t dataSize = m_nv12Stride * h + m_nv12Stride * (h / 2);
+        m_nv12Buffer = (uint8_t*)_aligned_malloc(dataSize, 32);
+        if (m_nv12Buffer) memset(m_nv12Buffer, 0, dataSize);
+
+        if (m_swapChain) {
+            m_swapChain->ResizeBuffers(0, w, h, DXGI_FORMAT_UNKNOWN, 0);
+        }
+        PostMessage(m_hwndMain, WM_VIDEO_RESIZE, (WPARAM)w, (LPARAM)h);
+    }
+
+    // --- GPU DOWNSCALE & SEND (DXGI MODE) ---
+    // Кадр захвата -> m_scaledTexture (масштабирование или копия). false - кадр не подготовлен,
+    // его нужно пропустить, а не отправлять предыдущее содержимое m_scaledTexture.
+    bool PrepareFrame(ID3D11Texture2D* srcTexture, int targetW, int targetH) {
+        if (!srcTexture) return false;
+        D3D11_TEXTURE2D_DESC srcDesc;
+        srcTexture->GetDesc(&srcDesc);
+        m_stagingFresh = false;
+        m_frameReady = false;
+        m_cpuFrameValid = false;
+        m_scaledPending = false;
+
+        if (srcDesc.Width != (UINT)targetW || srcDesc.Height != (UINT)targetH) {
+            EnsureTexture(m_scaledTexture, targetW, targetH, DXGI_FORMAT_B8G8R8A8_UNORM, D3D11_BIND_UNORDERED_ACCESS | D3D11_BIND_SHADER_RESOURCE);
+
+            bool scaled = false;
+            if (m_scaleFilter != ScaleFilter::Gpu || !m_csResize) scaled = CpuResize(srcTexture, srcDesc, targetW, targetH);
+            if (!scaled) {
+                if (!m_csResize) return false;
+                // SRV-копия кадра нужна только шейдеру: CPU скейлер читает srcTexture сам
+                ID3D11Texture2D* texToProcess = srcTexture;
+                if (!(srcDesc.BindFlags & D3D11_BIND_SHADER_RESOURCE)) {
+                    EnsureTexture(m_captureCopyTexture, srcDesc.Width, srcDesc.Height, srcDesc.Format, D3D11_BIND_SHADER_RESOURCE);
+                    m_context->CopyResource(m_captureCopyTexture.Get(), srcTexture);
+                    texToProcess = m_captureCopyTexture.Get();
+                }
+                PerformResize(texToProcess, m_scaledTexture.Get(), srcDesc.Width, srcDesc.Height, targetW, targetH);
+            }
+        }
+        else {
+            EnsureTexture(m_scaledTexture, targetW, targetH, DXGI_FORMAT_B8G8R8A8_UNORM, D3D11_BIND_UNORDERED_ACCESS | D3D11_BIND_SHADER_RESOURCE);
+            m_context->CopyResource(m_scaledTexture.Get(), srcTexture);
+        }
+        m_frameReady = (m_scaledTexture != nullptr);
+        return m_frameReady;
+    }
+
+    bool HasPreparedFrame() const { return m_frameReady; }
+
+    // Отпечаток подготовленного кадра. Если кадр всё равно будет прочитан на CPU (энкодер, сеть,
+    // запись, shared memory), он читается тем же путём, что и при отправке, и SendTextureOverUDP /
+    // EncodeTexture не копируют его второй раз. Иначе читается только уменьшенная на GPU копия.
+    bool FingerprintFrame(int w, int h, FrameEncoder* encoder, uint64_t& fingerprint) {
+        if (!m_frameReady) return false;
+        bool cpuConsumer = encoder || g_IsStreamNetwork || g_IsRecording || g_IsSharedMemory;
+        if (!cpuConsumer && !m_cpuFrameValid && m_csBlockHash) return FingerprintDownscaled(w, h, fingerprint);
+        int pitch = 0;
+        const uint8_t* ptr = MapPreparedFrame(w, h, pitch);
+        if (!ptr) return false;
+        fingerprint = FrameFingerprint(ptr, pitch, w * 4, h);
+        UnmapPreparedFrame();
+        return true;
+    }
+
+    // Вывод подготовленного кадра. srcTexture == nullptr - повтор последнего кадра без нового
+    // захвата (keepalive после таймаута), ROI тогда пропускаются. refresh: энкодеру - ключевой кадр.
+    void OutputFrame(ID3D11Texture2D* srcTexture, int targetW, int targetH, FrameEncoder* encoder, int64_t captureUs, bool refresh) {
+        if (!m_frameReady) return;
+        m_frameCounter++;
+        m_captureUs = captureUs;
+        ID3D11Texture2D* texToProcess = m_scaledTexture.Get();
+
+        // После CPU ресайза текстура нужна только превью и simulcast
+        if (m_scaledPending && (g_IsShowStream || (g_IsStreamNetwork && !m_renditions.empty()))) {
+            m_context->UpdateSubresource(m_scaledTexture.Get(), 0, nullptr, m_cpuScaled.data(), targetW * 4, 0);
+            m_scaledPending = false;
+        }
+
+        if (g_IsShowStream && m_swapChain) {
+            ResizeSwapChain(targetW, targetH);
+            ComPtr<ID3D11Texture2D> backBuffer;
+            HRESULT hr = m_swapChain->GetBuffer(0, __uuidof(ID3D11Texture2D), (void**)&backBuffer);
+            if (SUCCEEDED(hr) && backBuffer) {
+                m_context->CopySubresourceRegion(backBuffer.Get(), 0, 0, 0, 0, texToProcess, 0, nullptr);
+                if (SUCCEEDED(m_swapChain->Present(0, 0))) g_Latency.Record(LAT_PRESENT, captureUs);
+            }
+        }
+
+        if (encoder) {
+            if (refresh) encoder->RequestKeyframe();
+            EncodeTexture(targetW, targetH, encoder);
+        }
+        else if (g_IsStreamNetwork || g_IsRecording || g_IsSharedMemory) {
+            SendTextureOverUDP(targetW, targetH);
+        }
+
+        if (g_IsStreamNetwork && !m_renditions.empty()) {
+            ProcessRenditions(texToProcess, targetW, targetH, refresh);
+        }
+        if (g_IsStreamNetwork && !m_rois.empty() && srcTexture) {
+            D3D11_TEXTURE2D_DESC srcDesc;
+            srcTexture->GetDesc(&srcDesc);
+            ProcessRois(srcTexture, srcDesc, refresh);
+        }
+        // Staging годится только в пределах одного тика: следующий вывод копирует кадр заново
+        m_stagingFresh = false;
+    }
+
+    // Тик без вывода: таймлайн энкодеров идёт дальше, чтобы pts совпадали со временем
+    void SkipFrame(FrameEncoder* encoder) {
+        m_frameCounter++;
+        if (encoder) encoder->SkipFrame();
+        for (auto* list : { &m_renditions, &m_rois }) {
+            for (auto& r : *list) {
+                if (r->config.format == RenditionFormat::H264 && m_frameCounter % r->config.fpsDivisor == 0) r->encoder.SkipFrame();
+            }
+        }
+    }
+
+    // true - кадр показан (Present выполнен)
+    bool RenderFrame(AVFrame* frame) {
+        if (!frame || !m_swapChain) return false;
+        if (!g_IsShowStream) return false;
+
+        ResizeSwapChain(frame->width, frame->height);
+        if (frame->format == AV_PIX_FMT_D3D11) {
+            ID3D11Texture2D* srcTexture = (ID3D11Texture2D*)frame->data[0];
+            int srcIndex = (intptr_t)frame->data[1];
+            EnsureTexture(m_workTexture, frame->width, frame->height, DXGI_FORMAT_NV12, D3D11_BIND_SHADER_RESOURCE);
+            m_context->CopySubresourceRegion(m_workTexture.Get(), 0, 0, 0, 0, srcTexture, srcIndex, nullptr);
+            if (!RunComputeShaderNV12()) return false;
+        }
+        else if (!RenderSoftwareFrame(frame)) {
+            return false;
+        }
+        return SUCCEEDED(m_swapChain->Present(0, 0));
+    }
+
+private:
+    // shader: по умолчанию m_csResize; с теми же параметрами работает и m_csBlockHash
+    void PerformResize(ID3D11Texture2D* input, ID3D11Texture2D* output, int srcW, int srcH, int dstW, int dstH, ID3D11ComputeShader* shader = nullptr) {
+        D3D11_MAPPED_SUBRESOURCE mapped;
+        if (SUCCEEDED(m_context->Map(m_cbResizeParams.Get(), 0, D3D11_MAP_WRITE_DISCARD, 0, &mapped))) {
+            ResizeParams* p = (ResizeParams*)mapped.pData;
+            p->srcW = srcW; p->srcH = srcH; p->dstW = dstW; p->dstH = dstH;
+            m_context->Unmap(m_cbResizeParams.Get(), 0);
+        }
+
+        ComPtr<ID3D11ShaderResourceView> srv;
+        m_device->CreateShaderResourceView(input, nullptr, &srv);
+
+        ComPtr<ID3D11UnorderedAccessView> uav;
+        m_device->CreateUnorderedAccessView(output, nullptr, &uav);
+
+        m_context->CSSetShader(shader ? shader : m_csResize.Get(), nullptr, 0);
+        m_context->CSSetConstantBuffers(0, 1, m_cbResizeParams.GetAddressOf());
+        m_context->CSSetShaderResources(0, 1, srv.GetAddressOf());
+        m_context->CSSetUnorderedAccessViews(0, 1, uav.GetAddressOf(), nullptr);
+
+        UINT threadsX = (dstW + 15) / 16;
+        UINT threadsY = (dstH + 15) / 16;
+        m_context->Dispatch(threadsX, threadsY, 1);
+
+        ID3D11UnorderedAccessView* nullUAV[] = { nullptr };
+        m_context->CSSetUnorderedAccessViews(0, 1, nullUAV, nullptr);
+        ID3D11ShaderResourceView* nullSRV[] = { nullptr };
+        m_context->CSSetShaderResources(0, 1, nullSRV);
+    }
+
+    // Результат остаётся в m_cpuScaled и отправляется оттуда; в m_scaledTexture загружается
+    // только если кадр нужен на GPU (см. OutputFrame)
+    bool CpuResize(ID3D11Texture2D* srcTexture, const D3D11_TEXTURE2D_DESC& srcDesc, int dstW, int dstH) {
+        ScaleFilter filter = m_scaleFilter == ScaleFilter::Gpu ? ScaleFilter::Bilinear : m_scaleFilter;
+        if (!m_cpuScaler.Configure(srcDesc.Width, srcDesc.Height, dstW, dstH, 4, filter)) return false;
+        EnsureStagingTexture(m_captureStaging, srcDesc.Width, srcDesc.Height);
+        if (!m_captureStaging) return false;
+        m_context->CopyResource(m_captureStaging.Get(), srcTexture);
+
+        D3D11_MAPPED_SUBRESOURCE mapped;
+        if (FAILED(m_context->Map(m_captureStaging.Get(), 0, D3D11_MAP_READ, 0, &mapped))) return false;
+        m_cpuScaled.resize((size_t)dstW * dstH * 4);
+        m_cpuScaler.Scale((const uint8_t*)mapped.pData, (int)mapped.RowPitch, m_cpuScaled.data(), dstW * 4);
+        m_context->Unmap(m_captureStaging.Get(), 0);
+        m_cpuFrameValid = true;
+        m_scaledPending = true;
+        return true;
+    }
+
+    // Хэши блоков считает GPU, поэтому изменение любого пикселя меняет отпечаток
+    bool FingerprintDownscaled(int w, int h, uint64_t& fingerprint) {
+        int fw = std::max(1, w / FINGERPRINT_GPU_DIVISOR), fh = std::max(1, h / FINGERPRINT_GPU_DIVISOR);
+        EnsureTexture(m_fingerprintTexture, fw, fh, DXGI_FORMAT_R32_UINT, D3D11_BIND_UNORDERED_ACCESS);
+        EnsureStagingTexture(m_fingerprintStaging, fw, fh, DXGI_FORMAT_R32_UINT);
+        if (!m_fingerprintTexture || !m_fingerprintStaging) return false;
+        PerformResize(m_scaledTexture.Get(), m_fingerprintTexture.Get(), w, h, fw, fh, m_csBlockHash.Get());
+        m_context->CopyResource(m_fingerprintStaging.Get(), m_fingerprintTexture.Get());
+
+        D3D11_MAPPED_SUBRESOURCE mapped;
+        if (FAILED(m_context->Map(m_fingerprintStaging.Get(), 0, D3D11_MAP_READ, 0, &mapped))) return false;
+        fingerprint = FrameFingerprint((const uint8_t*)mapped.pData, (int)mapped.RowPitch, fw * 4, fh);
+        m_context->Unmap(m_fingerprintStaging.Get(), 0);
+        return true;
+    }
+
+    // Подготовленный кадр для CPU: после CPU ресайза - прямо m_cpuScaled, иначе staging
+    // (копируется с GPU один раз за кадр)
+    const uint8_t* MapPreparedFrame(int w, int h, int& pitch) {
+        if (m_cpuFrameValid) {
+            pitch = w * 4;
+            return m_cpuScaled.data();
+        }
+        EnsureStagingTexture(w, h);
+        if (!m_stagingTexture) return nullptr;
+        if (!m_stagingFresh) {
+            m_context->CopyResource(m_stagingTexture.Get(), m_scaledTexture.Get());
+            m_stagingFresh = true;
+        }
+        D3D11_MAPPED_SUBRESOURCE mapped;
+        if (FAILED(m_context->Map(m_stagingTexture.Get(), 0, D3D11_MAP_READ, 0, &mapped))) return nullptr;
+        m_stagingMapped = true;
+        pitch = (int)mapped.RowPitch;
+        return (const uint8_t*)mapped.pData;
+    }
+
+    void UnmapPreparedFrame() {
+        if (m_stagingMapped) m_context->Unmap(m_stagingTexture.Get(), 0);
+        m_stagingMapped = false;
+    }
+
+    void SendTextureOverUDP(int w, int h) {
+        int pitch = 0;
+        const uint8_t* ptr = MapPreparedFrame(w, h, pitch);
+        if (ptr) {
+            uint32_t frameSize = (uint32_t)(w * h * 3);
+
+            // Локальные потребители получают кадр прямо из слота shared memory
+            uint8_t* rgbData = nullptr;
+            if (g_IsSharedMemory && g_SharedFrames.Open((uint32_t)(w * h * 4))) rgbData = g_SharedFrames.BeginWrite(frameSize);
+            bool inSharedMemory = (rgbData != nullptr);
+            if (!inSharedMemory) {
+                m_rgbBuffer.resize(frameSize);
+                rgbData = m_rgbBuffer.data();
+            }
+
+            ConvertBGRAToRGB(ptr, pitch, rgbData, w, h);
+            g_Latency.Record(LAT_READBACK, m_captureUs);
+            if (inSharedMemory) g_SharedFrames.EndWrite(SFR_FORMAT_RGB24, w, h, w * 3, frameSize);
+            if (g_IsStreamNetwork) SendUdpData(rgbData, (int)frameSize, m_captureUs);
+            if (g_IsRecording) g_Recorder.WriteFrame(rgbData, (int)frameSize, w, h);
+            g_Latency.Record(LAT_SENT, m_captureUs);
+            UnmapPreparedFrame();
+        }
+    }
+
+    // ROI вырезается из полного кадра до масштабирования: объём работы зависит от области, а не от экрана
+    void ProcessRois(ID3D11Texture2D* srcTexture, const D3D11_TEXTURE2D_DESC& srcDesc, bool refresh) {
+        for (auto& roi : m_rois) {
+            Rendition& r = *roi;
+            if (m_frameCounter % r.config.fpsDivisor != 0) continue;
+            RoiRect rect;
+            if (!g_Rois.Resolve(r.config.roiId, srcDesc.Width, srcDesc.Height, rect)) continue;
+
+            EnsureTexture(r.crop, rect.w, rect.h, srcDesc.Format, D3D11_BIND_SHADER_RESOURCE);
+            D3D11_BOX box = { (UINT)rect.x, (UINT)rect.y, 0, (UINT)(rect.x + rect.w), (UINT)(rect.y + rect.h), 1 };
+            m_context->CopySubresourceRegion(r.crop.Get(), 0, 0, 0, 0, srcTexture, 0, &box);
+
+            ID3D11Texture2D* tex = r.crop.Get();
+            if (rect.w != r.config.width || rect.h != r.config.height) {
+                EnsureTexture(r.texture, r.config.width, r.config.height, DXGI_FORMAT_B8G8R8A8_UNORM, D3D11_BIND_UNORDERED_ACCESS | D3D11_BIND_SHADER_RESOURCE);
+                PerformResize(tex, r.texture.Get(), rect.w, rect.h, r.config.width, r.config.height);
+                tex = r.texture.Get();
+            }
+            SendRendition(r, tex, refresh);
+        }
+    }
+
+    void ProcessRenditions(ID3D11Texture2D* mainTex, int mainW, int mainH, bool refresh) {
+        // Уровни строятся только до последнего, которому нужен этот кадр
+        int lastDue = -1;
+        for (int i = 0; i < (int)m_renditions.size(); i++) {
+            if (m_frameCounter % m_renditions[i]->config.fpsDivisor == 0) lastDue = i;
+        }
+
+        ID3D11Texture2D* prevTex = mainTex;
+        int prevW = mainW, prevH = mainH;
+        for (int i = 0; i <= lastDue; i++) {
+            Rendition& r = *m_renditions[i];
+            int w = r.config.width, h = r.config.height;
+
+            // Уменьшение из предыдущего уровня дешевле, чем из полного кадра
+            ID3D11Texture2D* src = prevTex;
+            int srcW = prevW, srcH = prevH;
+            if (w > prevW || h > prevH) {
+                src = mainTex;
+                srcW = mainW;
+                srcH = mainH;
+            }
+
+            ID3D11Texture2D* levelTex = src;
+            if (w != srcW || h != srcH) {
+                EnsureTexture(r.texture, w, h, DXGI_FORMAT_B8G8R8A8_UNORM, D3D11_BIND_UNORDERED_ACCESS | D3D11_BIND_SHADER_RESOURCE);
+                PerformResize(src, r.texture.Get(), srcW, srcH, w, h);
+                levelTex = r.texture.Get();
+            }
+
+            if (m_frameCounter % r.config.fpsDivisor == 0) SendRendition(r, levelTex, refresh);
+            prevTex = levelTex;
+            prevW = w;
+            prevH = h;
+        }
+    }
+
+    void SendRendition(Rendition& r, ID3D11Texture2D* tex, bool refresh) {
+        int w = r.config.width, h = r.config.height;
+        EnsureStagingTexture(r.staging, w, h);
+        m_context->CopyResource(r.staging.Get(), tex);
+
+        D3D11_MAPPED_SUBRESOURCE mapped;
+        if (FAILED(m_context->Map(r.staging.Get(), 0, D3D11_MAP_READ, 0, &mapped))) return;
+        const uint8_t* ptr = (const uint8_t*)mapped.pData;
+        switch (r.config.format) {
+        case RenditionFormat::H264:
+            if (refresh) r.encoder.RequestKeyframe();
+            r.encoder.EncodeBGRA(ptr, (int)mapped.RowPitch);
+            break;
+        case RenditionFormat::Bgra:
+            // Формат на проводе совпадает с текстурой: датаграммы идут прямо из mapped строк
+            if (USE_GATHER_SEND && r.output.SendRows(g_UdpSocket, ptr, (int)mapped.RowPitch, w * 4, h, m_captureUs)) break;
+            r.buffer.resize(w * h * 4);
+            CopyBGRARows(ptr, (int)mapped.RowPitch, r.buffer.data(), w, h);
+            r.output.Send(g_UdpSocket, r.buffer.data(), (int)r.buffer.size(), m_captureUs);
+            break;
+        case RenditionFormat::Rgb24:
+            r.buffer.resize(w * h * 3);
+            ConvertBGRAToRGB(ptr, (int)mapped.RowPitch, r.buffer.data(), w, h);
+            r.output.Send(g_UdpSocket, r.buffer.data(), (int)r.buffer.size(), m_captureUs);
+            break;
+        }
+        m_context->Unmap(r.staging.Get(), 0);
+    }
+
+    void EncodeTexture(int w, int h, FrameEncoder* encoder) {
+        int pitch = 0;
+        const uint8_t* ptr = MapPreparedFrame(w, h, pitch);
+        if (ptr) {
+            encoder->EncodeBGRA(ptr, pitch);
+            UnmapPreparedFrame();
+        }
+    }
+
+    bool RenderSoftwareFrame(AVFrame* frame) {
+        EnsureTexture(m_workTexture, frame->width, frame->height, DXGI_FORMAT_NV12, D3D11_BIND_SHADER_RESOURCE);
+        if (!m_nv12Buffer) return false;
+
+        if (!m_softScaler.Configure(frame->width, frame->height, (AVPixelFormat)frame->format, AV_PIX_FMT_NV12)) return false;
+
+        uint8_t* dstData[4] = { m_nv12Buffer, m_nv12Buffer + (m_nv12Stride * frame->height), nullptr, nullptr };
+        int dstLinesize[4] = { m_nv12Stride, m_nv12Stride, 0, 0 };
+        m_softScaler.Scale(frame->data, frame->linesize, dstData, dstLinesize);
+        m_context->UpdateSubresource(m_workTexture.Get(), 0, nullptr, m_nv12Buffer, m_nv12Stride, 0);
+        return RunComputeShaderNV12();
+    }
+
+    bool RunComputeShaderNV12() {
+        ComPtr<ID3D11Texture2D> backBuffer;
+        HRESULT hr = m_swapChain->GetBuffer(0, __uuidof(ID3D11Texture2D), (void**)&backBuffer);
+        if (FAILED(hr)) return false;
+
+        ComPtr<ID3D11UnorderedAccessView> backBufferUAV;
+        m_device->CreateUnorderedAccessView(backBuffer.Get(), nullptr, &backBufferUAV);
+
+        ComPtr<ID3D11Device3> device3;
+        m_device.As(&device3);
+
+        D3D11_SHADER_RESOURCE_VIEW_DESC1 srvDesc1 = {};
+        srvDesc1.ViewDimension = D3D11_SRV_DIMENSION_TEXTURE2D;
+        srvDesc1.Texture2D.MipLevels = 1;
+        srvDesc1.Format = DXGI_FORMAT_R8_UNORM;
+        ComPtr<ID3D11ShaderResourceView1> ySRV;
+        device3->CreateShaderResourceView1(m_workTexture.Get(), &srvDesc1, &ySRV);
+
+        srvDesc1.Format = DXGI_FORMAT_R8G8_UNORM;
+        srvDesc1.Texture2D.PlaneSlice = 1;
+        ComPtr<ID3D11ShaderResourceView1> uvSRV;
+        device3->CreateShaderResourceView1(m_workTexture.Get(), &srvDesc1, &uvSRV);
+
+        ID3D11ShaderResourceView* inputSRVs[] = { ySRV.Get(), uvSRV.Get() };
+        m_context->CSSetShader(m_csNv12ToRgb.Get(), nullptr, 0);
+        m_context->CSSetShaderResources(0, 2, inputSRVs);
+        ID3D11UnorderedAccessView* outputUAVs[] = { backBufferUAV.Get() };
+        m_context->CSSetUnorderedAccessViews(0, 1, outputUAVs, nullptr);
+        m_context->Dispatch((m_width + 7) / 8, (m_height + 7) / 8, 1);
+
+        ID3D11UnorderedAccessView* nullUAV[] = { nullptr };
+        m_context->CSSetUnorderedAccessViews(0, 1, nullUAV, nullptr);
+        ID3D11ShaderResourceView* nullSRV[] = { nullptr, nullptr };
+        m_context->CSSetShaderResources(0, 2, nullSRV);
+        return true;
+    }
+
+    void EnsureTexture(ComPtr<ID3D11Texture2D>& tex, int width, int height, DXGI_FORMAT fmt, UINT bindFlags) {
+        if (tex) {
+            D3D11_TEXTURE2D_DESC desc;
+            tex->GetDesc(&desc);
+            if (desc.Width == width && desc.Height == height && desc.Format == fmt) return;
+        }
+        D3D11_TEXTURE2D_DESC desc = {};
+        desc.Width = width; desc.Height = height;
+        desc.MipLevels = 1; desc.ArraySize = 1;
+        desc.Format = fmt;
+        desc.SampleDesc.Count = 1;
+        desc.Usage = D3D11_USAGE_DEFAULT;
+        desc.BindFlags = bindFlags;
+        m_device->CreateTexture2D(&desc, nullptr, &tex);
+    }
+
+    void EnsureStagingTexture(int width, int height) {
+        // Новая текстура пустая: отметка о скопированном кадре к ней не относится
+        if (EnsureStagingTexture(m_stagingTexture, width, height)) m_stagingFresh = false;
+    }
+
+    // true - текстура создана заново
+    bool EnsureStagingTexture(ComPtr<ID3D11Texture2D>& staging, int width, int height, DXGI_FORMAT fmt = DXGI_FORMAT_B8G8R8A8_UNORM) {
+        if (staging) {
+            D3D11_TEXTURE2D_DESC desc;
+            staging->GetDesc(&desc);
+            if (desc.Width == width && desc.Height == height && desc.Format == fmt) return false;
+        }
+        D3D11_TEXTURE2D_DESC desc = {};
+        desc.Width = width; desc.Height = height;
+        desc.MipLevels = 1; desc.ArraySize = 1;
+        desc.Format = fmt;
+        desc.SampleDesc.Count = 1;
+        desc.Usage = D3D11_USAGE_STAGING;
+        desc.CPUAccessFlags = D3D11_CPU_ACCESS_READ;
+        m_device->CreateTexture2D(&desc, nullptr, &staging);
+        return true;
+    }
+
+    void InitD3D(HWND hwnd) {
+        D3D_FEATURE_LEVEL levels[] = { D3D_FEATURE_LEVEL_11_1, D3D_FEATURE_LEVEL_11_0 };
+        UINT flags = D3D11_CREATE_DEVICE_BGRA_SUPPORT;
+        D3D11CreateDevice(nullptr, D3D_DRIVER_TYPE_HARDWARE, nullptr, flags, levels, 2, D3D11_SDK_VERSION, &m_device, nullptr, &m_context);
+
+        ComPtr<IDXGIFactory2> factory;
+        CreateDXGIFactory1(__uuidof(IDXGIFactory2), (void**)&factory);
+        DXGI_SWAP_CHAIN_DESC1 scDesc = {};
+        scDesc.Format = DXGI_FORMAT_B8G8R8A8_UNORM;
+        scDesc.SampleDesc.Count = 1;
+        scDesc.BufferUsage = DXGI_USAGE_UNORDERED_ACCESS | DXGI_USAGE_RENDER_TARGET_OUTPUT;
+        scDesc.BufferCount = 2;
+        scDesc.SwapEffect = DXGI_SWAP_EFFECT_FLIP_DISCARD;
+        scDesc.Scaling = DXGI_SCALING_STRETCH;
+
+        factory->CreateSwapChainForHwnd(m_device.Get(), hwnd, &scDesc, nullptr, nullptr, &m_swapChain);
+    }
+
+    void InitShaders() {
+        ComPtr<ID3DBlob> blob, err;
+        D3DCompile(HLSL_NV12_TO_RGB, strlen(HLSL_NV12_TO_RGB), nullptr, nullptr, nullptr, "CSMain", "cs_5_0", 0, 0, &blob, &err);
+        if (blob) m_device->CreateComputeShader(blob->GetBufferPointer(), blob->GetBufferSize(), nullptr, &m_csNv12ToRgb);
+        blob.Reset();
+
+        D3DCompile(HLSL_RESIZE, strlen(HLSL_RESIZE), nullptr, nullptr, nullptr, "CSMain", "cs_5_0", 0, 0, &blob, &err);
+        if (blob) m_device->CreateComputeShader(blob->GetBufferPointer(), blob->GetBufferSize(), nullptr, &m_csResize);
+        blob.Reset();
+
+        D3DCompile(HLSL_BLOCK_HASH, strlen(HLSL_BLOCK_HASH), nullptr, nullptr, nullptr, "CSMain", "cs_5_0", 0, 0, &blob, &err);
+        if (blob) m_device->CreateComputeShader(blob->GetBufferPointer(), blob->GetBufferSize(), nullptr, &m_csBlockHash);
+
+        D3D11_BUFFER_DESC bd = {};
+        bd.ByteWidth = sizeof(ResizeParams);
+        bd.Usage = D3D11_USAGE_DYNAMIC;
+        bd.BindFlags = D3D11_BIND_CONSTANT_BUFFER;
+        bd.CPUAccessFlags = D3D11_CPU_ACCESS_WRITE;
+        m_device->CreateBuffer(&bd, nullptr, &m_cbResizeParams);
+    }
+};
+
+// ==========================================
+// ЛОГИКА КОНФИГА
+// ==========================================
+
+void ModifyBasicIni(int width, int height, int fps, int codecIndex) {
+    wchar_t buffer[MAX_PATH];
+    if (GetModuleFileNameW(NULL, buffer, MAX_PATH) == 0) return;
+
+    fs::path exeDir = fs::path(buffer).parent_path();
+    fs::path iniPath = exeDir / "config" / "obs-studio" / "basic" / "profiles" / "Untitled" / "basic.ini";
+
+    if (!fs::exists(iniPath)) return;
+    const CodecOption& selCodec = AVAILABLE_CODECS[codecIndex];
+    std::vector<std::string> lines;
     std::ifstream inFile(iniPath);
     std::string line;
     std::string sRes = std::to_string(width) + "x" + std::to_string(height);
     std::string sFps = std::to_string(fps);
-    int idToWrite = (selCodec.id == 1) ? 9999 : selCodec.obsId;
+    int idToWrite = (selCodec.id == 1) ? 9999 : (selCodec.id == 2) ? 9998 : selCodec.obsId;
+
+    if (inFile.is_open()) {
+        while (std::getline(inFile, line)) {
+            if (line.find("RescaleRes=") == 0) line = "RescaleRes=" + sRes;
+            else if (line.find("RecRescaleRes=") == 0) line = "RecRescaleRes=" + sRes;
+            else if (line.find("FFRescaleRes=") == 0) line = "FFRescaleRes=" + sRes;
+            else if (line.find("BaseCX=") == 0) line = "BaseCX=" + std::to_string(width);
+            else if (line.find("BaseCY=") == 0) line = "BaseCY=" + std::to_string(height);
+            else if (line.find("OutputCX=") == 0) line = "OutputCX=" + std::to_string(width);
+            else if (line.find("OutputCY=") == 0) line = "OutputCY=" + std::to_string(height);
+            else if (line.find("FPSNum=") == 0) line = "FPSNum=" + sFps;
+            else if (line.find("FFVEncoderId=") == 0) line = "FFVEncoderId=" + std::to_string(idToWrite);
+            lines.push_back(line);
+        }
+        inFile.close();
+    }
+
+    std::ofstream outFile(iniPath);
+    if (outFile.is_open()) {
+        for (const auto& l : lines) outFile << l << "\n";
+        outFile.close();
+    }
+}
+
+void ReadConfigSettings(int& width, int& height, int& fps, int& codecId) {
+    wchar_t buffer[MAX_PATH];
+    GetModuleFileNameW(NULL, buffer, MAX_PATH);
+    fs::path iniPath = fs::path(buffer).parent_path() / "config" / "obs-studio" / "basic" / "profiles" / "Untitled" / "basic.ini";
+
+    width = 1280; height = 720; fps = 60; codecId = 0;
+    int encoderId = 27;
+
+    std::ifstream inFile(iniPath);
+    if (inFile.is_open()) {
+        std::string line;
+        while (std::getline(inFile, line)) {
+            try {
+                if (line.find("BaseCX=") == 0) width = std::stoi(line.substr(7));
+                else if (line.find("BaseCY=") == 0) height = std::stoi(line.substr(7));
+                else if (line.find("FPSNum=") == 0) fps = std::stoi(line.substr(7));
+                else if (line.find("FFVEncoderId=") == 0) encoderId = std::stoi(line.substr(13));
+            }
+            catch (...) {}
+        }
+    }
+    codecId = (encoderId == 9999) ? 1 : (encoderId == 9998) ? 2 : 0;
+}
+
+// --- STREAMS.INI (дополнительные выходы) ---
+// Файл рядом с exe, по одной записи на строку, '#' - комментарий:
+//   rendition=<W>x<H> <rgb|bgra|h264> <fpsDivisor> <port>
+//   roi=<id> <W>x<H> <rgb|bgra|h264> <fpsDivisor> <port> <x> <y> <w> <h>
+//   roi=<id> <W>x<H> <rgb|bgra|h264> <fpsDivisor> <port> window <заголовок окна>
+//   source=<dxgi|synthetic> [<W>x<H>]
+//   scaler=<gpu|box|bilinear>
+//   latency_loopback=<0|1>
+//   latency_budget_ms=<p99 budget, 0 - off>
+//   thread=<capture|decode|reader|network|worker|recorder> <priority> <any|cores> [mmcss=<task>] [isolate]
+//   pipe_streams=<N> [basePort]  (режим OBS: ещё N-1 pipe obs_video_<i>, UDP на basePort+i-1)
+//   ingest=<pipe|udp|rtp> [<ip>:]<port>  (основной поток по сети; multicast ip - вход в группу)
+//   static_keepalive_ms=<ms>  (режим захвата: период keepalive при статичной картинке, 0 - без адаптации)
+const int PIPE_STREAMS_MAX = 16;
+const int PIPE_STREAMS_BASE_PORT = UDP_PORT + 10;
+
+enum class IngestKind { Pipe, Udp, Rtp };
+
+struct StreamSettings {
+    std::vector<RenditionConfig> renditions;
+    std::string source = "dxgi";
+    ScaleFilter scaler = ScaleFilter::Gpu;
+    bool latencyLoopback = false;
+    int latencyBudgetMs = 0;
+    ThreadTopology topology;
+    int pipeStreams = 1;
+    int pipeBasePort = PIPE_STREAMS_BASE_PORT;
+    IngestKind ingest = IngestKind::Pipe;
+    uint32_t ingestIp = INADDR_ANY; // network byte order
+    int ingestPort = 0;
+    int64_t staticKeepaliveMs = STATIC_KEEPALIVE_DEFAULT_MS;
+    int sourceWidth = 1920;
+    int sourceHeight = 1080;
+    int replayWindowSec = REPLAY_WINDOW_DEFAULT_S;
+    int replayBudgetMb = REPLAY_BUDGET_DEFAULT_MB;
+};
+
+bool ParseRenditionFormat(const std::string& name, RenditionFormat& format) {
+    if (name == "rgb") format = RenditionFormat::Rgb24;
+    else if (name == "bgra") format = RenditionFormat::Bgra;
+    else if (name == "h264") format = RenditionFormat::H264;
+    else return false;
+    return true;
+}
+
+StreamSettings ReadStreamSettings() {
+    StreamSettings settings;
+    wchar_t buffer[MAX_PATH];
+    if (GetModuleFileNameW(NULL, buffer, MAX_PATH) == 0) return settings;
+    std::ifstream inFile(fs::path(buffer).parent_path() / "streams.ini");
+    if (!inFile.is_open()) return settings;
+
+    std::string line;
+    while (std::getline(inFile, line)) {
+        if (line.empty() || line[0] == '#') continue;
+        size_t eq = line.find('=');
+        if (eq == std::string::npos) continue;
+        std::string key = line.substr(0, eq);
+        std::istringstream args(line.substr(eq + 1));
+
+        if (key == "rendition" || key == "roi") {
+            RenditionConfig cfg;
+            std::string res, fmt;
+            if (key == "roi") args >> cfg.roiId;
+            args >> res >> fmt >> cfg.fpsDivisor >> cfg.port;
+            if (args.fail() || sscanf(res.c_str(), "%dx%d", &cfg.width, &cfg.height) != 2 || !ParseRenditionFormat(fmt, cfg.format) ||
+                cfg.width < 16 || cfg.height < 16 || cfg.fpsDivisor < 1 || cfg.port <= 0 || cfg.port > 65535) {
+                LogToGUI("streams.ini: invalid line: " + line);
+                continue;
+            }
+            cfg.width &= ~1;
+            cfg.height &= ~1;
+            if (cfg.roiId >= 0) {
+                std::string rest;
+                std::getline(args >> std::ws, rest);
+                if (HandleControlCommand("roi " + std::to_string(cfg.roiId) + " " + rest) != "ok") {
+                    LogToGUI("streams.ini: invalid ROI source: " + line);
+                    continue;
+                }
+            }
+            settings.renditions.push_back(cfg);
+        }
+        else if (key == "source") {
+            std::string name, res;
+            args >> name >> res;
+            int w = 0, h = 0;
+            if (name == "synthetic" && !res.empty()) {
+                if (sscanf(res.c_str(), "%dx%d", &w, &h) != 2 || w < 64 || h < 16) {
+                    LogToGUI("streams.ini: invalid line: " + line);
+                    continue;
+                }
+                settings.sourceWidth = w;
+                settings.sourceHeight = h;
+            }
+            else if (name != "dxgi" && name != "synthetic") {
+                LogToGUI("streams.ini: unknown source: " + line);
+                continue;
+            }
+            settings.source = name;
+        }
+        else if (key == "scaler") {
+            std::string name;
+            args >> name;
+            if (name == "gpu") settings.scaler = ScaleFilter::Gpu;
+            else if (name == "box") settings.scaler = ScaleFilter::Box;
+            else if (name == "bilinear") settings.scaler = ScaleFilter::Bilinear;
+            else LogToGUI("streams.ini: unknown scaler: " + line);
+        }
+        else if (key == "thread") {
+            if (!settings.topology.Parse(args)) LogToGUI("streams.ini: invalid line: " + line);
+        }
+        else if (key == "latency_loopback") {
+            int enabled = 0;
+            args >> enabled;
+            settings.latencyLoopback = enabled != 0;
+        }
+        else if (key == "pipe_streams") {
+            int count = 0, port = PIPE_STREAMS_BASE_PORT;
+            args >> count;
+            if (!(args >> port)) port = PIPE_STREAMS_BASE_PORT;
+            if (count < 1 || count > PIPE_STREAMS_MAX || port <= 0 || port + count - 2 > 65535) {
+                LogToGUI("streams.ini: invalid line: " + line);
+                continue;
+            }
+            settings.pipeStreams = count;
+            settings.pipeBasePort = port;
+        }
+        else if (key == "ingest") {
+            std::string kind, addr;
+            args >> kind >> addr;
+            if (kind == "pipe") {
+                settings.ingest = IngestKind::Pipe;
+                continue;
+            }
+            size_t colon = addr.rfind(':');
+            std::string host = colon == std::string::npos ? "" : addr.substr(0, colon);
+            int port = atoi(addr.c_str() + (colon == std::string::npos ? 0 : colon + 1));
+            in_addr ip = {};
+            ip.s_addr = INADDR_ANY;
+            // Свой же broadcast выход на UDP_PORT вернулся бы на вход
+            if ((kind != "udp" && kind != "rtp") || port <= 0 || port > 65535 || port == UDP_PORT ||
+                (!host.empty() && inet_pton(AF_INET, host.c_str(), &ip) != 1)) {
+                LogToGUI("streams.ini: invalid line: " + line);
+                continue;
+            }
+            settings.ingest = kind == "udp" ? IngestKind::Udp : IngestKind::Rtp;
+            settings.ingestIp = ip.s_addr;
+            settings.ingestPort = port;
+        }
+        else if (key == "static_keepalive_ms") {
+            args >> settings.staticKeepaliveMs;
+            if (args.fail() || settings.staticKeepaliveMs < 0) {
+                LogToGUI("streams.ini: invalid line: " + line);
+                settings.staticKeepaliveMs = STATIC_KEEPALIVE_DEFAULT_MS;
+            }
+        }
+        else if (key == "replay") {
+            int seconds = 0, budgetMb = REPLAY_BUDGET_DEFAULT_MB;
+            args >> seconds;
+            if (!(args >> budgetMb)) budgetMb = REPLAY_BUDGET_DEFAULT_MB;
+            if (seconds < REPLAY_WINDOW_MIN_S || seconds > REPLAY_WINDOW_MAX_S || budgetMb < 1 || budgetMb > REPLAY_BUDGET_MAX_MB) {
+                LogToGUI("streams.ini: invalid line: " + line);
+                continue;
+            }
+            settings.replayWindowSec = seconds;
+            settings.replayBudgetMb = budgetMb;
+        }
+        else if (key == "latency_budget_ms") {
+            args >> settings.latencyBudgetMs;
+            if (args.fail() || settings.latencyBudgetMs < 0) {
+                LogToGUI("streams.ini: invalid line: " + line);
+                settings.latencyBudgetMs = 0;
+            }
+        }
+    }
+    return settings;
+}
 
-    if (inFile.is_open()) {
-        while (std::getline(inFile, line)) {
-            if (line.find("RescaleRes=") == 0) line = "RescaleRes=" + sRes;
-            else if (line.find("RecRescaleRes=") == 0) line = "RecRescaleRes=" + sRes;
-            else if (line.find("FFRescaleRes=") == 0) line = "FFRescaleRes=" + sRes;
-            else if (line.find("BaseCX=") == 0) line = "BaseCX=" + std::to_string(width);
-            else if (line.find("BaseCY=") == 0) line = "BaseCY=" + std::to_string(height);
-            else if (line.find("OutputCX=") == 0) line = "OutputCX=" + std::to_string(width);
-            else if (line.find("OutputCY=") == 0) line = "OutputCY=" + std::to_string(height);
-            else if (line.find("FPSNum=") == 0) line = "FPSNum=" + sFps;
-            else if (line.find("FFVEncoderId=") == 0) line = "FFVEncoderId=" + std::to_string(idToWrite);
-            lines.push_back(line);
+// --- INCREMENTAL PORTABLE CONFIG SYNC ---
+// Манифест хранит размер/время источника и копии после последней синхронизации,
+// чтобы при следующем запуске OBS копировать только изменившиеся файлы.
+const wchar_t* SYNC_MANIFEST_NAME = L".sync_manifest";
+const uint32_t SYNC_MANIFEST_MAGIC = 0x314D5953; // "SYM1"
+const unsigned SYNC_MAX_WORKERS = 8;
+
+struct SyncEntry {
+    uint64_t srcSize = 0;
+    int64_t srcTime = 0;
+    uint64_t dstSize = 0;
+    int64_t dstTime = 0;
+    uint64_t hash = 0; // 0 = not computed
+};
+
+struct SyncJob {
+    std::wstring rel;
+    SyncEntry entry;
+    const SyncEntry* previous;
+    bool copied;
+    bool ok;
+};
+
+static int64_t FileTimeTicks(const fs::file_time_type& t) {
+    return (int64_t)t.time_since_epoch().count();
+}
+
+static bool StatFile(const fs::path& p, uint64_t& size, int64_t& time) {
+    std::error_code ec;
+    size = fs::file_size(p, ec);
+    if (ec) return false;
+    auto t = fs::last_write_time(p, ec);
+    if (ec) return false;
+    time = FileTimeTicks(t);
+    return true;
+}
+
+// FNV-1a over 8-byte words: not cryptographic, only detects rewritten-but-identical files.
+static uint64_t HashFileContent(const fs::path& p) {
+    std::ifstream f(p, std::ios::binary);
+    if (!f) return 0;
+    uint64_t h = 1469598103934665603ULL;
+    std::vector<char> buf(1 << 16);
+    while (f) {
+        f.read(buf.data(), buf.size());
+        size_t n = (size_t)f.gcount();
+        size_t i = 0;
+        for (; i + 8 <= n; i += 8) {
+            uint64_t w;
+            memcpy(&w, buf.data() + i, 8);
+            h = (h ^ w) * 1099511628211ULL;
+        }
+        for (; i < n; i++) h = (h ^ (uint8_t)buf[i]) * 1099511628211ULL;
+    }
+    return h ? h : 1;
+}
+
+static std::map<std::wstring, SyncEntry> LoadSyncManifest(const fs::path& path) {
+    std::map<std::wstring, SyncEntry> result;
+    std::ifstream f(path, std::ios::binary);
+    uint32_t magic = 0, count = 0;
+    if (!f.read((char*)&magic, sizeof(magic)) || magic != SYNC_MANIFEST_MAGIC) return result;
+    if (!f.read((char*)&count, sizeof(count))) return result;
+    for (uint32_t i = 0; i < count; i++) {
+        uint32_t len = 0;
+        if (!f.read((char*)&len, sizeof(len)) || len > 4096) return {};
+        std::wstring rel(len, L'\0');
+        SyncEntry e;
+        if (!f.read((char*)&rel[0], len * sizeof(wchar_t))) return {};
+        if (!f.read((char*)&e, sizeof(e))) return {};
+        result[rel] = e;
+    }
+    return result;
+}
+
+static void SaveSyncManifest(const fs::path& path, const std::map<std::wstring, SyncEntry>& entries) {
+    std::ofstream f(path, std::ios::binary | std::ios::trunc);
+    if (!f) return;
+    uint32_t magic = SYNC_MANIFEST_MAGIC, count = (uint32_t)entries.size();
+    f.write((const char*)&magic, sizeof(magic));
+    f.write((const char*)&count, sizeof(count));
+    for (const auto& kv : entries) {
+        uint32_t len = (uint32_t)kv.first.size();
+        f.write((const char*)&len, sizeof(len));
+        f.write((const char*)kv.first.data(), len * sizeof(wchar_t));
+        f.write((const char*)&kv.second, sizeof(kv.second));
+    }
+}
+
+static void RunSyncJob(SyncJob& job, const fs::path& src, const fs::path& dst) {
+    fs::path srcPath = src / job.rel;
+    fs::path dstPath = dst / job.rel;
+    SyncEntry& e = job.entry;
+    job.ok = true;
+    job.copied = false;
+
+    uint64_t dstSize = 0;
+    int64_t dstTime = 0;
+    bool dstExists = StatFile(dstPath, dstSize, dstTime);
+
+    // Same size but different mtime: compare content before copying
+    if (dstExists && dstSize == e.srcSize) {
+        e.hash = HashFileContent(srcPath);
+        uint64_t dstHash = 0;
+        const SyncEntry* prev = job.previous;
+        if (prev && prev->hash && prev->dstSize == dstSize && prev->dstTime == dstTime) dstHash = prev->hash;
+        else dstHash = HashFileContent(dstPath);
+        if (e.hash && e.hash == dstHash) {
+            e.dstSize = dstSize;
+            e.dstTime = dstTime;
+            return;
+        }
+    }
+
+    std::error_code ec;
+    fs::copy_file(srcPath, dstPath, fs::copy_options::overwrite_existing, ec);
+    if (ec || !StatFile(dstPath, e.dstSize, e.dstTime)) {
+        job.ok = false;
+        return;
+    }
+    job.copied = true;
+}
+
+void SyncPortableConfig(const fs::path& src, const fs::path& dst) {
+    std::error_code ec;
+    fs::create_directories(dst, ec);
+    fs::path manifestPath = dst / SYNC_MANIFEST_NAME;
+    std::map<std::wstring, SyncEntry> manifest = LoadSyncManifest(manifestPath);
+    std::map<std::wstring, SyncEntry> next;
+    std::set<std::wstring> srcDirs, srcFiles;
+    std::vector<SyncJob> jobs;
+
+    for (auto it = fs::recursive_directory_iterator(src, ec); !ec && it != fs::recursive_directory_iterator(); it.increment(ec)) {
+        std::wstring rel = it->path().lexically_relative(src).wstring();
+        if (it->is_directory(ec)) {
+            srcDirs.insert(rel);
+            fs::create_directories(dst / rel, ec);
+            ec.clear();
+            continue;
+        }
+        if (!it->is_regular_file(ec)) continue;
+
+        SyncEntry e;
+        if (!StatFile(it->path(), e.srcSize, e.srcTime)) continue;
+        srcFiles.insert(rel);
+
+        auto old = manifest.find(rel);
+        const SyncEntry* prev = (old != manifest.end()) ? &old->second : nullptr;
+        if (prev && prev->srcSize == e.srcSize && prev->srcTime == e.srcTime) {
+            uint64_t dstSize = 0;
+            int64_t dstTime = 0;
+            if (StatFile(dst / rel, dstSize, dstTime) && dstSize == prev->dstSize && dstTime == prev->dstTime) {
+                next[rel] = *prev;
+                continue;
+            }
+        }
+        jobs.push_back({ rel, e, prev, false, false });
+    }
+    if (ec) {
+        LogToGUI("Config sync: failed to scan " + src.string());
+        return;
+    }
+
+    std::atomic<size_t> nextJob(0);
+    auto worker = [&]() {
+        for (size_t i = nextJob++; i < jobs.size(); i = nextJob++) RunSyncJob(jobs[i], src, dst);
+    };
+    unsigned workerCount = std::min<unsigned>(SYNC_MAX_WORKERS, std::max(1u, std::thread::hardware_concurrency()));
+    workerCount = (unsigned)std::min<size_t>(workerCount, jobs.size());
+    std::vector<std::thread> workers;
+    for (unsigned i = 1; i < workerCount; i++) workers.emplace_back(worker);
+    worker();
+    for (auto& t : workers) t.join();
+
+    int copied = 0, failed = 0;
+    for (const auto& job : jobs) {
+        if (!job.ok) { failed++; continue; }
+        if (job.copied) copied++;
+        next[job.rel] = job.entry;
+    }
+
+    // Удаляем только то, чего больше нет в источнике (логи OBS, удалённые сцены и т.п.)
+    std::vector<fs::path> stale;
+    for (auto it = fs::recursive_directory_iterator(dst, ec); !ec && it != fs::recursive_directory_iterator(); it.increment(ec)) {
+        std::wstring rel = it->path().lexically_relative(dst).wstring();
+        if (rel == SYNC_MANIFEST_NAME) continue;
+        if (it->is_directory(ec)) {
+            if (!srcDirs.count(rel)) {
+                stale.push_back(it->path());
+                it.disable_recursion_pending();
+            }
+        }
+        else if (!srcFiles.count(rel)) {
+            stale.push_back(it->path());
+        }
+    }
+    for (const auto& p : stale) fs::remove_all(p, ec);
+
+    SaveSyncManifest(manifestPath, next);
+    LogToGUI("Config sync: " + std::to_string(copied) + " copied, " + std::to_string(stale.size()) + " removed, " +
+        std::to_string(next.size() - copied) + " unchanged" + (failed ? ", " + std::to_string(failed) + " failed" : ""));
+}
+
+void SetupPortableOBS() {
+    wchar_t buffer[MAX_PATH];
+    if (GetModuleFileNameW(NULL, buffer, MAX_PATH) == 0) return;
+    fs::path exeDir = fs::path(buffer).parent_path();
+    fs::path sourceConfig = exeDir / "config";
+    fs::path targetConfig = exeDir / "obs-studio" / "config";
+    if (fs::exists(sourceConfig)) {
+        SyncPortableConfig(sourceConfig, targetConfig);
+    }
+    else if (fs::exists(targetConfig)) {
+        fs::remove_all(targetConfig);
+    }
+}
+
+void LaunchOBS() {
+    SetupPortableOBS();
+    wchar_t buffer[MAX_PATH];
+    GetModuleFileNameW(NULL, buffer, MAX_PATH);
+    fs::path exeDir = fs::path(buffer).parent_path();
+    fs::path obsExePath = exeDir / "obs-studio" / "bin" / "64bit" / "obs64.exe";
+    if (!fs::exists(obsExePath)) return;
+    if (!g_hJob) {
+        g_hJob = CreateJobObject(nullptr, nullptr);
+        JOBOBJECT_EXTENDED_LIMIT_INFORMATION jeli = { 0 };
+        jeli.BasicLimitInformation.LimitFlags = JOB_OBJECT_LIMIT_KILL_ON_JOB_CLOSE;
+        SetInformationJobObject(g_hJob, JobObjectExtendedLimitInformation, &jeli, sizeof(jeli));
+    }
+    std::wstring cmdLine = L"\"" + obsExePath.wstring() + L"\" --portable --profile \"Untitled\" --collection \"Untitled\" --startrecording --minimize-to-tray";
+    STARTUPINFOW si = { sizeof(si) };
+    PROCESS_INFORMATION pi = {};
+    if (CreateProcessW(nullptr, &cmdLine[0], nullptr, nullptr, FALSE, 0, nullptr, obsExePath.parent_path().c_str(), &si, &pi)) {
+        if (g_hJob) AssignProcessToJobObject(g_hJob, pi.hProcess);
+        CloseHandle(pi.hProcess);
+        CloseHandle(pi.hThread);
+    }
+}
+
+// ==========================================
+// ЛЁГКИЙ MPEG-TS ДЕМУКСЕР (PIPE INPUT)
+// ==========================================
+// Разбирает PAT/PMT, собирает PES видеопотока (H.264/HEVC) в access unit и отдаёт
+// его декодеру, как только приходит следующий payload_unit_start. Без пробинга
+// avformat и без промежуточного буфера AVIO; avformat остаётся запасным вариантом.
+const int TS_PACKET_SIZE = 188;
+const int TS_READ_CHUNK = TS_PACKET_SIZE * 348; // ~64 KB
+const size_t TS_PROBE_LIMIT = 2 * 1024 * 1024;
+const size_t TS_AU_INITIAL_CAPACITY = 256 * 1024;
+const int TS_SYNC_LOCK_PACKETS = 3; // 0x47 должен повториться в стольких пакетах подряд
+const bool USE_NATIVE_TS_DEMUX = true;
+
+class TsDemuxer {
+public:
+    // Владение пакетом передаётся получателю
+    using PacketCallback = std::function<void(AVPacket*)>;
+
+private:
+    int m_pmtPid = -1;
+    int m_pmtVersion = -1;
+    int m_videoPid = -1;
+    AVCodecID m_codecId = AV_CODEC_ID_NONE;
+    bool m_codecChanged = false;
+    int m_lastCc[8192];
+
+    // Access unit собирается сразу в AVBufferRef, который потом уходит в AVPacket
+    AVBufferRef* m_au = nullptr;
+    size_t m_auSize = 0;
+    int64_t m_auPts = AV_NOPTS_VALUE;
+    int64_t m_auDts = AV_NOPTS_VALUE;
+    bool m_auRandomAccess = false;
+    bool m_auCorrupt = false;
+    int64_t m_auIngestUs = 0;
+
+    uint8_t m_partial[TS_PACKET_SIZE];
+    int m_partialSize = 0;
+
+    // Поиск синхронизации: хвост, в котором ещё может начинаться пакет
+    bool m_locked = false;
+    uint8_t m_syncTail[(TS_SYNC_LOCK_PACKETS - 1) * TS_PACKET_SIZE];
+    int m_syncTailSize = 0;
+
+public:
+    int64_t lastPcr = AV_NOPTS_VALUE; // 27 MHz
+    int64_t chunkTimeUs = 0;  // время чтения текущего куска, ставит вызывающий перед Feed
+    int64_t lastIngestUs = 0; // время прихода первого байта последнего отданного AU
+    uint64_t continuityErrors = 0;
+    uint64_t syncLosses = 0;
+
+    TsDemuxer() {
+        std::fill(std::begin(m_lastCc), std::end(m_lastCc), -1);
+    }
+
+    ~TsDemuxer() {
+        av_buffer_unref(&m_au);
+    }
+
+    bool HasVideo() const { return m_videoPid >= 0; }
+    AVCodecID GetCodecId() const { return m_codecId; }
+    // Новая версия PMT сменила кодек: открытый декодер больше не подходит
+    bool CodecChanged() const { return m_codecChanged; }
+
+    void Feed(const uint8_t* data, size_t size, const PacketCallback& onPacket) {
+        while (size > 0) {
+            size_t used = m_locked ? FeedLocked(data, size, onPacket) : Resync(data, size, onPacket);
+            data += used;
+            size -= used;
+        }
+    }
+
+    void Flush(const PacketCallback& onPacket) {
+        EmitAccessUnit(onPacket);
+    }
+
+private:
+    // Разбирает пакеты, пока на границах стоит 0x47. Возвращает число использованных байт;
+    // при потере синхронизации текущий AU отбрасывается, остаток уходит в Resync.
+    size_t FeedLocked(const uint8_t* data, size_t size, const PacketCallback& onPacket) {
+        size_t pos = 0;
+        // Дособираем TS пакет, разрезанный между чтениями (m_partial всегда начинается с 0x47)
+        if (m_partialSize > 0) {
+            size_t take = std::min((size_t)(TS_PACKET_SIZE - m_partialSize), size);
+            memcpy(m_partial + m_partialSize, data, take);
+            m_partialSize += (int)take;
+            pos = take;
+            if (m_partialSize < TS_PACKET_SIZE) return pos;
+            m_partialSize = 0;
+            if (pos < size && data[pos] != 0x47) return LoseSync(pos);
+            ParsePacket(m_partial, onPacket);
+        }
+
+        while (size - pos >= TS_PACKET_SIZE) {
+            if (data[pos] != 0x47) return LoseSync(pos);
+            ParsePacket(data + pos, onPacket);
+            pos += TS_PACKET_SIZE;
+        }
+        if (pos < size) {
+            if (data[pos] != 0x47) return LoseSync(pos);
+            m_partialSize = (int)(size - pos);
+            memcpy(m_partial, data + pos, m_partialSize);
+        }
+        return size;
+    }
+
+    size_t LoseSync(size_t pos) {
+        syncLosses++;
+        m_locked = false;
+        m_auCorrupt = true;
+        return pos;
+    }
+
+    // 0x47 внутри payload - обычный байт, поэтому синхронизация захватывается только там,
+    // где он повторяется TS_SYNC_LOCK_PACKETS раз через 188 байт. Поиск идёт по склейке
+    // m_syncTail + data без копирования data.
+    size_t Resync(const uint8_t* data, size_t size, const PacketCallback& onPacket) {
+        size_t tail = (size_t)m_syncTailSize;
+        size_t total = tail + size;
+        auto at = [&](size_t i) { return i < tail ? m_syncTail[i] : data[i - tail]; };
+        const size_t span = (TS_SYNC_LOCK_PACKETS - 1) * TS_PACKET_SIZE;
+
+        for (size_t i = 0; i + span < total; i++) {
+            bool found = true;
+            for (int k = 0; k < TS_SYNC_LOCK_PACKETS && found; k++) found = at(i + k * TS_PACKET_SIZE) == 0x47;
+            if (!found) continue;
+
+            m_locked = true;
+            m_syncTailSize = 0;
+            if (i >= tail) return i - tail;
+            // Начало пакета ещё в хвосте: целые пакеты разбираем, остаток - в m_partial
+            for (; tail - i >= TS_PACKET_SIZE; i += TS_PACKET_SIZE) ParsePacket(m_syncTail + i, onPacket);
+            m_partialSize = (int)(tail - i);
+            memcpy(m_partial, m_syncTail + i, m_partialSize);
+            return 0;
+        }
+
+        // Не нашли: сохраняем последние span байт, в них ещё может начинаться пакет
+        size_t keep = std::min(total, span);
+        if (size >= keep) memcpy(m_syncTail, data + size - keep, keep);
+        else {
+            memmove(m_syncTail, m_syncTail + tail - (keep - size), keep - size);
+            memcpy(m_syncTail + keep - size, data, size);
+        }
+        m_syncTailSize = (int)keep;
+        return size;
+    }
+
+    void ParsePacket(const uint8_t* p, const PacketCallback& onPacket) {
+        bool pusi = (p[1] & 0x40) != 0;
+        int pid = ((p[1] & 0x1F) << 8) | p[2];
+        int afc = (p[3] >> 4) & 0x3;
+        int cc = p[3] & 0xF;
+        if (pid == 0x1FFF) return;
+
+        int offset = 4;
+        bool randomAccess = false;
+        if (afc & 0x2) {
+            int afLen = p[4];
+            if (afLen > 0 && afLen <= 183) {
+                uint8_t flags = p[5];
+                randomAccess = (flags & 0x40) != 0;
+                // discontinuity_indicator: счётчик начинается заново, это не потеря
+                if (flags & 0x80) m_lastCc[pid] = -1;
+                if ((flags & 0x10) && afLen >= 7) {
+                    const uint8_t* pcr = p + 6;
+                    int64_t base = ((int64_t)pcr[0] << 25) | (pcr[1] << 17) | (pcr[2] << 9) | (pcr[3] << 1) | (pcr[4] >> 7);
+                    int ext = ((pcr[4] & 0x1) << 8) | pcr[5];
+                    lastPcr = base * 300 + ext;
+                }
+            }
+            offset += 1 + afLen;
+        }
+        if (!(afc & 0x1) || offset >= TS_PACKET_SIZE) return;
+
+        // Пропуск continuity counter: текущий AU битый, декодеру его не отдаём
+        if (m_lastCc[pid] >= 0 && cc != ((m_lastCc[pid] + 1) & 0xF) && cc != m_lastCc[pid]) {
+            continuityErrors++;
+            if (pid == m_videoPid) m_auCorrupt = true;
+        }
+        m_lastCc[pid] = cc;
+
+        const uint8_t* payload = p + offset;
+        int payloadSize = TS_PACKET_SIZE - offset;
+
+        if (pid == 0 && pusi) ParsePat(payload, payloadSize);
+        else if (pid == m_pmtPid && pusi) ParsePmt(payload, payloadSize);
+        else if (pid == m_videoPid) {
+            if (pusi) {
+                EmitAccessUnit(onPacket);
+                StartPes(payload, payloadSize, randomAccess);
+            }
+            else if (m_au) {
+                Append(payload, payloadSize);
+            }
+        }
+    }
+
+    // Возвращает начало секции после pointer_field или nullptr
+    static const uint8_t* SectionStart(const uint8_t* payload, int size, int& sectionLen) {
+        int pointer = payload[0];
+        if (1 + pointer + 3 > size) return nullptr;
+        const uint8_t* sec = payload + 1 + pointer;
+        sectionLen = ((sec[1] & 0x0F) << 8) | sec[2];
+        if (1 + pointer + 3 + sectionLen > size || sectionLen < 9) return nullptr;
+        return sec;
+    }
+
+    void ParsePat(const uint8_t* payload, int size) {
+        int sectionLen;
+        const uint8_t* sec = SectionStart(payload, size, sectionLen);
+        if (!sec || sec[0] != 0x00 || !(sec[5] & 0x01)) return;
+        // 8 байт заголовка, CRC32 в конце
+        for (int i = 8; i + 4 <= 3 + sectionLen - 4; i += 4) {
+            int program = (sec[i] << 8) | sec[i + 1];
+            int pid = ((sec[i + 2] & 0x1F) << 8) | sec[i + 3];
+            if (program != 0) {
+                if (pid != m_pmtPid) m_pmtVersion = -1;
+                m_pmtPid = pid;
+                return;
+            }
+        }
+    }
+
+    void ParsePmt(const uint8_t* payload, int size) {
+        int sectionLen;
+        const uint8_t* sec = SectionStart(payload, size, sectionLen);
+        if (!sec || sec[0] != 0x02 || !(sec[5] & 0x01)) return;
+        // Повтор той же версии PMT ничего не меняет
+        int version = (sec[5] >> 1) & 0x1F;
+        if (version == m_pmtVersion) return;
+        int programInfoLen = ((sec[10] & 0x0F) << 8) | sec[11];
+        int end = 3 + sectionLen - 4;
+        for (int i = 12 + programInfoLen; i + 5 <= end;) {
+            int streamType = sec[i];
+            int pid = ((sec[i + 1] & 0x1F) << 8) | sec[i + 2];
+            int esInfoLen = ((sec[i + 3] & 0x0F) << 8) | sec[i + 4];
+            AVCodecID id = AV_CODEC_ID_NONE;
+            if (streamType == 0x1B) id = AV_CODEC_ID_H264;
+            else if (streamType == 0x24) id = AV_CODEC_ID_HEVC;
+            if (id != AV_CODEC_ID_NONE) {
+                SelectVideo(pid, id);
+                break;
+            }
+            i += 5 + esInfoLen;
+        }
+        m_pmtVersion = version;
+    }
+
+    void SelectVideo(int pid, AVCodecID id) {
+        if (pid != m_videoPid) {
+            // AU старого PID не дособрать
+            m_auSize = 0;
+            m_videoPid = pid;
+            m_lastCc[pid] = -1;
+        }
+        if (m_codecId != AV_CODEC_ID_NONE && id != m_codecId) m_codecChanged = true;
+        m_codecId = id;
+    }
+
+    void StartPes(const uint8_t* payload, int size, bool randomAccess) {
+        if (size < 9 || payload[0] != 0 || payload[1] != 0 || payload[2] != 1) return;
+        int flags = payload[7];
+        int headerLen = payload[8];
+        if (9 + headerLen > size) return;
+
+        m_auPts = (flags & 0x80) && headerLen >= 5 ? ReadTimestamp(payload + 9) : AV_NOPTS_VALUE;
+        m_auDts = (flags & 0x40) && headerLen >= 10 ? ReadTimestamp(payload + 14) : m_auPts;
+        m_auRandomAccess = randomAccess;
+        m_auCorrupt = false;
+        m_auIngestUs = chunkTimeUs;
+        m_auSize = 0;
+        if (!m_au) m_au = g_PacketPool.AllocPayload(TS_AU_INITIAL_CAPACITY);
+        if (m_au) Append(payload + 9 + headerLen, size - 9 - headerLen);
+    }
+
+    static int64_t ReadTimestamp(const uint8_t* p) {
+        return ((int64_t)(p[0] & 0x0E) << 29) | (p[1] << 22) | ((p[2] & 0xFE) << 14) | (p[3] << 7) | (p[4] >> 1);
+    }
+
+    void Append(const uint8_t* data, int size) {
+        size_t needed = m_auSize + size;
+        if (needed + AV_INPUT_BUFFER_PADDING_SIZE > (size_t)m_au->size) {
+            if (!g_PacketPool.GrowPayload(&m_au, m_auSize, needed)) {
+                m_auCorrupt = true;
+                return;
+            }
+        }
+        memcpy(m_au->data + m_auSize, data, size);
+        m_auSize += size;
+    }
+
+    void EmitAccessUnit(const PacketCallback& onPacket) {
+        if (!m_au || m_auSize == 0) return;
+        if (m_auCorrupt || m_codecChanged) {
+            m_auSize = 0;
+            return;
+        }
+        memset(m_au->data + m_auSize, 0, AV_INPUT_BUFFER_PADDING_SIZE);
+
+        AVPacket* pkt = g_PacketPool.Acquire();
+        pkt->buf = m_au;
+        pkt->data = m_au->data;
+        pkt->size = (int)m_auSize;
+        pkt->pts = m_auPts;
+        pkt->dts = m_auDts;
+        if (m_auRandomAccess || IsKeyframe(m_au->data, m_auSize)) pkt->flags |= AV_PKT_FLAG_KEY;
+        m_au = nullptr;
+        m_auSize = 0;
+        lastIngestUs = m_auIngestUs;
+        onPacket(pkt);
+    }
+
+    // Ищем первый VCL NAL: IDR (H.264) или IRAP (HEVC)
+    bool IsKeyframe(const uint8_t* data, size_t size) const {
+        for (size_t i = 0; i + 3 < size; i++) {
+            if (data[i] != 0 || data[i + 1] != 0 || data[i + 2] != 1) continue;
+            uint8_t header = data[i + 3];
+            if (m_codecId == AV_CODEC_ID_H264) {
+                int type = header & 0x1F;
+                if (type >= 1 && type <= 5) return type == 5;
+            }
+            else {
+                int type = (header >> 1) & 0x3F;
+                if (type < 32) return type >= 16 && type <= 21;
+            }
+            i += 3;
+        }
+        return false;
+    }
+};
+
+// ==========================================
+// СЕТЕВОЙ ВХОД (MPEG-TS ПО UDP / RTP)
+// ==========================================
+// ingest=udp|rtp в streams.ini: основной поток читается из сокета вместо pipe, поэтому
+// энкодер может работать на другой машине. Дальше тот же путь: ReadPipe -> TsDemuxer -> декодер.
+// Датаграммы забираются пачками: select ждёт первую, остальные вычитываются неблокирующим
+// recvfrom до WSAEWOULDBLOCK (recvmmsg в Winsock нет). RTP раскладывается по sequence number
+// в небольшой jitter buffer; дыра, которую не закрыли за NET_JITTER_MAX_DELAY_US, пропускается,
+// а битый AU отбрасывает TsDemuxer по continuity counter. Перезапуск отправителя (новый SSRC,
+// или случайный начальный номер "позади" текущего) сбрасывает нумерацию, а не отбрасывает поток.
+const int NET_INGEST_RCVBUF = 16 * 1024 * 1024;
+const int NET_INGEST_MAX_DATAGRAM = 2048;
+const int NET_INGEST_BATCH = 256;
+const int NET_INGEST_POLL_MS = 200;
+const int NET_JITTER_SLOTS = 128; // степень двойки
+const int64_t NET_JITTER_MAX_DELAY_US = 20000;
+const int NET_RESYNC_LATE_RUN = 32; // столько опоздавших пакетов подряд - это уже новый поток
+const int NET_RESYNC_BACKWARD = NET_JITTER_SLOTS * 4; // такой откат назад не бывает перестановкой
+
+class NetIngest {
+    struct JitterSlot {
+        uint8_t data[NET_INGEST_MAX_DATAGRAM];
+        int len = 0;
+        uint16_t seq = 0;
+        int64_t arrivalUs = 0;
+        bool used = false;
+    };
+
+    SOCKET m_sock = INVALID_SOCKET;
+    IngestKind m_kind = IngestKind::Udp;
+    std::string m_name;
+
+    std::vector<JitterSlot> m_jitter;
+    int m_buffered = 0;
+    bool m_haveSeq = false;
+    uint16_t m_nextSeq = 0;
+    uint16_t m_highSeq = 0;
+    uint32_t m_ssrc = 0;
+    int m_lateRun = 0;
+
+    std::vector<uint8_t> m_out;
+    size_t m_outPos = 0;
+    uint8_t m_datagram[NET_INGEST_MAX_DATAGRAM];
+
+public:
+    uint64_t datagrams = 0;
+    uint64_t batches = 0;
+    uint64_t bytes = 0;
+    uint64_t lost = 0;
+    uint64_t reordered = 0;
+    uint64_t late = 0;
+    uint64_t malformed = 0;
+    uint64_t resyncs = 0;
+
+    ~NetIngest() { Close(); }
+
+    bool Open(IngestKind kind, uint32_t ip, int port) {
+        Close();
+        m_kind = kind;
+        char ipText[INET_ADDRSTRLEN] = "0.0.0.0";
+        in_addr addr = {};
+        addr.s_addr = ip;
+        inet_ntop(AF_INET, &addr, ipText, sizeof(ipText));
+        m_name = std::string(kind == IngestKind::Rtp ? "rtp://" : "udp://") + ipText + ":" + std::to_string(port);
+
+        m_sock = socket(AF_INET, SOCK_DGRAM, IPPROTO_UDP);
+        if (m_sock == INVALID_SOCKET) {
+            LogToGUI("Net ingest: socket() failed.");
+            return false;
+        }
+        BOOL reuse = TRUE;
+        setsockopt(m_sock, SOL_SOCKET, SO_REUSEADDR, (char*)&reuse, sizeof(reuse));
+        int rcvBuf = NET_INGEST_RCVBUF;
+        setsockopt(m_sock, SOL_SOCKET, SO_RCVBUF, (char*)&rcvBuf, sizeof(rcvBuf));
+
+        bool multicast = IN_MULTICAST(ntohl(ip));
+        sockaddr_in local = {};
+        local.sin_family = AF_INET;
+        local.sin_port = htons(port);
+        local.sin_addr.s_addr = multicast ? INADDR_ANY : ip;
+        if (bind(m_sock, (sockaddr*)&local, sizeof(local)) != 0) {
+            LogToGUI("Net ingest: bind failed for " + m_name);
+            Close();
+            return false;
+        }
+        if (multicast) {
+            ip_mreq mreq = {};
+            mreq.imr_multiaddr.s_addr = ip;
+            mreq.imr_interface.s_addr = INADDR_ANY;
+            if (setsockopt(m_sock, IPPROTO_IP, IP_ADD_MEMBERSHIP, (char*)&mreq, sizeof(mreq)) != 0) {
+                LogToGUI("Net ingest: could not join multicast group " + m_name);
+                Close();
+                return false;
+            }
+        }
+        u_long nonBlocking = 1;
+        ioctlsocket(m_sock, FIONBIO, &nonBlocking);
+
+        int actual = 0, len = sizeof(actual);
+        getsockopt(m_sock, SOL_SOCKET, SO_RCVBUF, (char*)&actual, &len);
+        LogToGUI("Net ingest: listening on " + m_name + ", receive buffer " + std::to_string(actual / 1024) + " KB");
+
+        if (m_kind == IngestKind::Rtp && m_jitter.empty()) m_jitter.resize(NET_JITTER_SLOTS);
+        return true;
+    }
+
+    void Close() {
+        if (m_sock != INVALID_SOCKET) closesocket(m_sock);
+        m_sock = INVALID_SOCKET;
+        for (JitterSlot& slot : m_jitter) slot.used = false;
+        m_buffered = 0;
+        m_haveSeq = false;
+        m_out.clear();
+        m_outPos = 0;
+    }
+
+    // >0 - прочитано байт, 0 - отдать пока нечего (тишина до NET_INGEST_POLL_MS или всё в jitter buffer), <0 - ошибка сокета
+    int Read(uint8_t* buf, int size) {
+        if (m_outPos == m_out.size()) {
+            m_out.clear();
+            m_outPos = 0;
+            if (!ReceiveBatch()) return -1;
+            if (m_out.empty()) return 0;
+        }
+        int n = (int)std::min<size_t>(size, m_out.size() - m_outPos);
+        memcpy(buf, m_out.data() + m_outPos, n);
+        m_outPos += n;
+        return n;
+    }
+
+    std::string Stats() const {
+        return "Net ingest " + m_name + ": " + std::to_string(datagrams) + " datagrams in " + std::to_string(batches) +
+            " batches, " + std::to_string(bytes / (1024 * 1024)) + " MB, " + std::to_string(lost) + " lost, " +
+            std::to_string(reordered) + " reordered, " + std::to_string(late) + " late/duplicate, " +
+            std::to_string(malformed) + " malformed, " + std::to_string(resyncs) + " resyncs";
+    }
+
+private:
+    bool ReceiveBatch() {
+        fd_set readSet;
+        FD_ZERO(&readSet);
+        FD_SET(m_sock, &readSet);
+        // За дырой ждут пакеты: select не дольше, чем до их срока, иначе они простоят весь опрос
+        int64_t waitUs = NET_INGEST_POLL_MS * 1000;
+        if (m_kind == IngestKind::Rtp && m_buffered > 0) waitUs = std::max<int64_t>(0, std::min(waitUs, JitterDeadlineUs() - LatencyNowUs()));
+        timeval timeout = { 0, (long)waitUs };
+        int ready = select(0, &readSet, nullptr, nullptr, &timeout);
+        if (ready == SOCKET_ERROR) return false;
+
+        int received = 0;
+        while (ready > 0 && received < NET_INGEST_BATCH) {
+            int len = recvfrom(m_sock, (char*)m_datagram, sizeof(m_datagram), 0, nullptr, nullptr);
+            if (len == SOCKET_ERROR) {
+                int err = WSAGetLastError();
+                if (err == WSAEWOULDBLOCK) break;
+                // Слишком большая датаграмма или ICMP port unreachable - не повод останавливать приём
+                if (err == WSAEMSGSIZE || err == WSAECONNRESET) {
+                    malformed++;
+                    continue;
+                }
+                return false;
+            }
+            received++;
+            bytes += len;
+            if (m_kind == IngestKind::Rtp) PushRtp(m_datagram, len);
+            else m_out.insert(m_out.end(), m_datagram, m_datagram + len);
+        }
+        if (received > 0) {
+            datagrams += received;
+            batches++;
+        }
+        if (m_kind == IngestKind::Rtp) ReleaseJitter(LatencyNowUs());
+        return true;
+    }
+
+    void PushRtp(const uint8_t* d, int len) {
+        if (len < RTP_HEADER_SIZE || (d[0] >> 6) != 2) {
+            malformed++;
+            return;
+        }
+        int header = RTP_HEADER_SIZE + 4 * (d[0] & 0x0F);
+        if ((d[0] & 0x10) && len >= header + 4) header += 4 + 4 * ((d[header + 2] << 8) | d[header + 3]);
+        else if (d[0] & 0x10) header = len;
+        int padding = (d[0] & 0x20) ? d[len - 1] : 0;
+        int payload = len - header - padding;
+        if (payload <= 0) {
+            malformed++;
+            return;
+        }
+
+        uint16_t seq = (uint16_t)((d[2] << 8) | d[3]);
+        uint32_t ssrc = ((uint32_t)d[8] << 24) | ((uint32_t)d[9] << 16) | ((uint32_t)d[10] << 8) | d[11];
+        if (m_haveSeq && ssrc != m_ssrc) Resync();
+        if (!m_haveSeq) {
+            m_haveSeq = true;
+            m_ssrc = ssrc;
+            m_nextSeq = m_highSeq = seq;
+            m_lateRun = 0;
+        }
+        int16_t ahead = (int16_t)(seq - m_nextSeq);
+        if (ahead < 0) {
+            late++;
+            // Отправитель перезапустился с номером "позади" текущего: без сброса поток стоял бы
+            // до тех пор, пока номера не догонят m_nextSeq (до 32767 пакетов)
+            if (++m_lateRun < NET_RESYNC_LATE_RUN && ahead > -NET_RESYNC_BACKWARD) return;
+            Resync();
+            m_haveSeq = true;
+            m_ssrc = ssrc;
+            m_nextSeq = m_highSeq = seq;
+        }
+        m_lateRun = 0;
+        // Пакет не помещается в окно: голова уходит без ожидания дыр
+        while ((int16_t)(seq - m_nextSeq) >= NET_JITTER_SLOTS) {
+            if (m_buffered == 0) {
+                // Перезапуск отправителя или долгий обрыв
+                lost += (uint16_t)(seq - m_nextSeq);
+                m_nextSeq = seq;
+                break;
+            }
+            JitterSlot& head = m_jitter[m_nextSeq & (NET_JITTER_SLOTS - 1)];
+            if (head.used) {
+                m_out.insert(m_out.end(), head.data, head.data + head.len);
+                head.used = false;
+                m_buffered--;
+            }
+            else lost++;
+            m_nextSeq++;
+        }
+        if ((int16_t)(seq - m_highSeq) < 0) reordered++;
+        else m_highSeq = seq;
+
+        JitterSlot& slot = m_jitter[seq & (NET_JITTER_SLOTS - 1)];
+        if (slot.used) {
+            late++;
+            return;
+        }
+        memcpy(slot.data, d + header, payload);
+        slot.len = payload;
+        slot.seq = seq;
+        slot.arrivalUs = LatencyNowUs();
+        slot.used = true;
+        m_buffered++;
+    }
+
+    // Новый поток: накопленное отдаётся по порядку (дыры пропускаются), нумерация начинается заново
+    void Resync() {
+        for (int i = 0; m_buffered > 0 && i < NET_JITTER_SLOTS; i++) {
+            JitterSlot& slot = m_jitter[(uint16_t)(m_nextSeq + i) & (NET_JITTER_SLOTS - 1)];
+            if (!slot.used) continue;
+            m_out.insert(m_out.end(), slot.data, slot.data + slot.len);
+            slot.used = false;
+            m_buffered--;
+        }
+        m_haveSeq = false;
+        m_lateRun = 0;
+        resyncs++;
+    }
+
+    // Когда ReleaseJitter пропустит дыру перед первым ожидающим пакетом
+    int64_t JitterDeadlineUs() const {
+        for (int i = 0; i < NET_JITTER_SLOTS; i++) {
+            const JitterSlot& slot = m_jitter[(uint16_t)(m_nextSeq + i) & (NET_JITTER_SLOTS - 1)];
+            if (slot.used) return slot.arrivalUs + NET_JITTER_MAX_DELAY_US;
+        }
+        return LatencyNowUs();
+    }
+
+    // Отдаёт подряд идущие пакеты; дыру пропускает, когда следующий за ней пакет ждёт дольше допустимого
+    void ReleaseJitter(int64_t nowUs) {
+        while (m_buffered > 0) {
+            JitterSlot& slot = m_jitter[m_nextSeq & (NET_JITTER_SLOTS - 1)];
+            if (slot.used) {
+                m_out.insert(m_out.end(), slot.data, slot.data + slot.len);
+                slot.used = false;
+                m_buffered--;
+                m_nextSeq++;
+                continue;
+            }
+            int gap = 1;
+            while (!m_jitter[(m_nextSeq + gap) & (NET_JITTER_SLOTS - 1)].used) gap++;
+            if (nowUs - m_jitter[(m_nextSeq + gap) & (NET_JITTER_SLOTS - 1)].arrivalUs < NET_JITTER_MAX_DELAY_US) break;
+            lost += gap;
+            m_nextSeq += (uint16_t)gap;
+        }
+    }
+};
+
+// ==========================================
+// ИСТОЧНИКИ ЗАХВАТА
+// ==========================================
+// RunDXGICaptureLoop получает кадры через CaptureSource и сам их не создаёт.
+// Кроме дублирования рабочего стола есть синтетический источник (source=synthetic в streams.ini).
+// Он нужен, чтобы гонять конвейер convert/encode/send без реального рабочего стола:
+// на сервере без монитора, в RDP-сессии, при нагрузочных прогонах.
+
+// Метаданные кадра для StaticContentDetector
+struct CaptureFrameInfo {
+    int64_t lastPresentTime = 0; // 0 - изображение не менялось (например, сдвинулся только курсор)
+    UINT accumulatedFrames = 0;
+
+    bool Presented() const { return lastPresentTime != 0 || accumulatedFrames > 0; }
+};
+
+class CaptureSource {
+public:
+    virtual ~CaptureSource() {}
+    virtual const char* Name() const = 0;
+    virtual bool Open(ID3D11Device* device) = 0;
+    // S_OK и текстура, действительная до ReleaseFrame; DXGI_ERROR_WAIT_TIMEOUT, если нового кадра нет
+    virtual HRESULT AcquireFrame(UINT timeoutMs, ID3D11Texture2D** texture, CaptureFrameInfo* info) = 0;
+    virtual void ReleaseFrame() = 0;
+};
+
+class DxgiCaptureSource : public CaptureSource {
+    ID3D11Device* m_device = nullptr;
+    ComPtr<IDXGIOutput1> m_output;
+    ComPtr<IDXGIOutputDuplication> m_duplication;
+    ComPtr<IDXGIResource> m_resource;
+    ComPtr<ID3D11Texture2D> m_texture;
+    bool m_holdingFrame = false;
+
+public:
+    ~DxgiCaptureSource() { ReleaseFrame(); }
+
+    const char* Name() const override { return "DXGI desktop duplication"; }
+
+    bool Open(ID3D11Device* device) override {
+        m_device = device;
+        ComPtr<IDXGIDevice> dxgiDevice;
+        device->QueryInterface(__uuidof(IDXGIDevice), (void**)&dxgiDevice);
+        ComPtr<IDXGIAdapter> adapter;
+        dxgiDevice->GetParent(__uuidof(IDXGIAdapter), (void**)&adapter);
+        ComPtr<IDXGIOutput> output;
+        adapter->EnumOutputs(0, &output);
+        output.As(&m_output);
+        HRESULT hr = m_output ? m_output->DuplicateOutput(device, &m_duplication) : E_FAIL;
+        if (FAILED(hr)) {
+            LogToGUI("Failed to DuplicateOutput. Make sure OBS is not blocking it.");
+            return false;
+        }
+
+        DXGI_OUTPUT_DESC outputDesc;
+        if (SUCCEEDED(output->GetDesc(&outputDesc))) {
+            g_Rois.SetDesktopOrigin(outputDesc.DesktopCoordinates.left, outputDesc.DesktopCoordinates.top);
+        }
+        return true;
+    }
+
+    HRESULT AcquireFrame(UINT timeoutMs, ID3D11Texture2D** texture, CaptureFrameInfo* info) override {
+        ReleaseFrame();
+        if (!m_duplication) {
+            m_output->DuplicateOutput(m_device, &m_duplication);
+            if (!m_duplication) return DXGI_ERROR_ACCESS_LOST;
+        }
+        DXGI_OUTDUPL_FRAME_INFO frameInfo;
+        HRESULT hr = m_duplication->AcquireNextFrame(timeoutMs, &frameInfo, &m_resource);
+        if (hr == DXGI_ERROR_WAIT_TIMEOUT) return hr;
+        if (FAILED(hr)) {
+            // Смена режима, UAC, полноэкранное приложение: пересоздаём дублирование
+            m_duplication.Reset();
+            m_output->DuplicateOutput(m_device, &m_duplication);
+            return hr;
         }
-        inFile.close();
+        m_holdingFrame = true;
+        info->lastPresentTime = frameInfo.LastPresentTime.QuadPart;
+        info->accumulatedFrames = frameInfo.AccumulatedFrames;
+        m_resource.As(&m_texture);
+        *texture = m_texture.Get();
+        return m_texture ? S_OK : E_NOINTERFACE;
     }
 
-    std::ofstream outFile(iniPath);
-    if (outFile.is_open()) {
-        for (const auto& l : lines) outFile << l << "\n";
-        outFile.close();
+    void ReleaseFrame() override {
+        m_texture.Reset();
+        m_resource.Reset();
+        if (m_holdingFrame && m_duplication) m_duplication->ReleaseFrame();
+        m_holdingFrame = false;
     }
-}
+};
 
-void ReadConfigSettings(int& width, int& height, int& fps, int& codecId) {
-    wchar_t buffer[MAX_PATH];
-    GetModuleFileNameW(NULL, buffer, MAX_PATH);
-    fs::path iniPath = fs::path(buffer).parent_path() / "config" / "obs-studio" / "basic" / "profiles" / "Untitled" / "basic.ini";
+// Цветные полосы с бегущей вертикальной полосой. Каждый кадр обновляются только два
+// столбца (старое и новое положение полосы), как обычные damage-регионы рабочего стола.
+class SyntheticCaptureSource : public CaptureSource {
+    int m_width, m_height;
+    ComPtr<ID3D11Texture2D> m_texture;
+    ComPtr<ID3D11DeviceContext> m_context;
+    std::vector<uint32_t> m_bars;
+    std::vector<uint32_t> m_marker;
+    int m_markerX = 0;
+    uint64_t m_frame = 0;
 
-    width = 1280; height = 720; fps = 60; codecId = 0;
-    int encoderId = 27;
+    static const int MARKER_WIDTH = 32;
 
-    std::ifstream inFile(iniPath);
-    if (inFile.is_open()) {
-        std::string line;
-        while (std::getline(inFile, line)) {
-            try {
-                if (line.find("BaseCX=") == 0) width = std::stoi(line.substr(7));
-                else if (line.find("BaseCY=") == 0) height = std::stoi(line.substr(7));
-                else if (line.find("FPSNum=") == 0) fps = std::stoi(line.substr(7));
-                else if (line.find("FFVEncoderId=") == 0) encoderId = std::stoi(line.substr(13));
-            }
-            catch (...) {}
-        }
+    uint32_t BarColor(int x) const {
+        static const uint32_t colors[] = { 0xFFC0C0C0, 0xFFC0C000, 0xFF00C0C0, 0xFF00C000, 0xFFC000C0, 0xFFC00000, 0xFF0000C0, 0xFF101010 };
+        return colors[(size_t)x * 8 / m_width];
     }
-    codecId = (encoderId == 9999) ? 1 : 0;
-}
 
-void SetupPortableOBS() {
-    wchar_t buffer[MAX_PATH];
-    if (GetModuleFileNameW(NULL, buffer, MAX_PATH) == 0) return;
-    fs::path exeDir = fs::path(buffer).parent_path();
-    fs::path sourceConfig = exeDir / "config";
-    fs::path targetConfig = exeDir / "obs-studio" / "config";
-    if (fs::exists(targetConfig)) fs::remove_all(targetConfig);
-    if (fs::exists(sourceConfig)) {
-        fs::create_directories(targetConfig.parent_path());
-        fs::copy(sourceConfig, targetConfig, fs::copy_options::recursive);
+    void UpdateColumns(int x, int width, const uint32_t* pixels, UINT pitch) {
+        D3D11_BOX box = { (UINT)x, 0, 0, (UINT)(x + width), (UINT)m_height, 1 };
+        m_context->UpdateSubresource(m_texture.Get(), 0, &box, pixels, pitch, 0);
     }
-}
 
-void LaunchOBS() {
-    SetupPortableOBS();
-    wchar_t buffer[MAX_PATH];
-    GetModuleFileNameW(NULL, buffer, MAX_PATH);
-    fs::path exeDir = fs::path(buffer).parent_path();
-    fs::path obsExePath = exeDir / "obs-studio" / "bin" / "64bit" / "obs64.exe";
-    if (!fs::exists(obsExePath)) return;
-    if (!g_hJob) {
-        g_hJob = CreateJobObject(nullptr, nullptr);
-        JOBOBJECT_EXTENDED_LIMIT_INFORMATION jeli = { 0 };
-        jeli.BasicLimitInformation.LimitFlags = JOB_OBJECT_LIMIT_KILL_ON_JOB_CLOSE;
-        SetInformationJobObject(g_hJob, JobObjectExtendedLimitInformation, &jeli, sizeof(jeli));
+public:
+    SyntheticCaptureSource(int width, int height) : m_width(width), m_height(height) {}
+
+    const char* Name() const override { return "synthetic test pattern"; }
+
+    bool Open(ID3D11Device* device) override {
+        D3D11_TEXTURE2D_DESC desc = {};
+        desc.Width = m_width;
+        desc.Height = m_height;
+        desc.MipLevels = 1;
+        desc.ArraySize = 1;
+        desc.Format = DXGI_FORMAT_B8G8R8A8_UNORM;
+        desc.SampleDesc.Count = 1;
+        desc.Usage = D3D11_USAGE_DEFAULT;
+        desc.BindFlags = D3D11_BIND_SHADER_RESOURCE;
+
+        m_bars.resize((size_t)m_width * m_height);
+        for (int y = 0; y < m_height; y++) {
+            for (int x = 0; x < m_width; x++) m_bars[(size_t)y * m_width + x] = BarColor(x);
+        }
+        D3D11_SUBRESOURCE_DATA init = { m_bars.data(), (UINT)m_width * 4, 0 };
+        if (FAILED(device->CreateTexture2D(&desc, &init, &m_texture))) {
+            LogToGUI("Failed to create synthetic capture texture.");
+            return false;
+        }
+        device->GetImmediateContext(&m_context);
+        m_marker.assign((size_t)MARKER_WIDTH * m_height, 0xFFFFFFFF);
+        return true;
     }
-    std::wstring cmdLine = L"\"" + obsExePath.wstring() + L"\" --portable --profile \"Untitled\" --collection \"Untitled\" --startrecording --minimize-to-tray";
-    STARTUPINFOW si = { sizeof(si) };
-    PROCESS_INFORMATION pi = {};
-    if (CreateProcessW(nullptr, &cmdLine[0], nullptr, nullptr, FALSE, 0, nullptr, obsExePath.parent_path().c_str(), &si, &pi)) {
-        if (g_hJob) AssignProcessToJobObject(g_hJob, pi.hProcess);
-        CloseHandle(pi.hProcess);
-        CloseHandle(pi.hThread);
+
+    HRESULT AcquireFrame(UINT timeoutMs, ID3D11Texture2D** texture, CaptureFrameInfo* info) override {
+        // Восстанавливаем полосы под старым маркером и рисуем маркер на новом месте
+        UpdateColumns(m_markerX, MARKER_WIDTH, m_bars.data() + m_markerX, (UINT)m_width * 4);
+        m_markerX = (int)((m_frame * 8) % (uint64_t)(m_width - MARKER_WIDTH));
+        UpdateColumns(m_markerX, MARKER_WIDTH, m_marker.data(), MARKER_WIDTH * 4);
+        m_frame++;
+        info->lastPresentTime = LatencyNowUs();
+        info->accumulatedFrames = 1;
+        *texture = m_texture.Get();
+        return S_OK;
+    }
+
+    void ReleaseFrame() override {}
+};
+
+std::unique_ptr<CaptureSource> CreateCaptureSource(const StreamSettings& settings) {
+    if (settings.source == "synthetic") {
+        return std::make_unique<SyntheticCaptureSource>(settings.sourceWidth, settings.sourceHeight);
     }
+    return std::make_unique<DxgiCaptureSource>();
 }
 
 // ==========================================
@@ -719,28 +4773,33 @@ void RunDXGICaptureLoop(D3DRenderer* renderer) {
 
     LogToGUI("Starting DXGI Capture: " + std::to_string(targetW) + "x" + std::to_string(targetH) + " @ " + std::to_string(targetFps) + " FPS");
 
-    ID3D11Device* device = renderer->GetDevice();
-    ComPtr<IDXGIDevice> dxgiDevice;
-    device->QueryInterface(__uuidof(IDXGIDevice), (void**)&dxgiDevice);
-    ComPtr<IDXGIAdapter> adapter;
-    dxgiDevice->GetParent(__uuidof(IDXGIAdapter), (void**)&adapter);
-    ComPtr<IDXGIOutput> output;
-    adapter->EnumOutputs(0, &output);
-    ComPtr<IDXGIOutput1> output1;
-    output.As(&output1);
-    ComPtr<IDXGIOutputDuplication> duplication;
-    HRESULT hr = output1->DuplicateOutput(device, &duplication);
-
-    if (FAILED(hr)) {
-        LogToGUI("Failed to DuplicateOutput. Make sure OBS is not blocking it.");
-        return;
+    StreamSettings streamSettings = ReadStreamSettings();
+    SetThreadTopology(streamSettings.topology);
+    g_Replay.SetLimits(streamSettings.replayWindowSec, streamSettings.replayBudgetMb);
+    ThreadRoleScope role(ThreadRole::Capture);
+    std::unique_ptr<CaptureSource> source = CreateCaptureSource(streamSettings);
+    if (!source->Open(renderer->GetDevice())) return;
+    LogToGUI(std::string("Capture source: ") + source->Name());
+
+    g_MainOutput.payloadType = (codecId == 1) ? RTP_PT_RAW : RTP_PT_MP2T;
+
+    FrameEncoder encoderStorage;
+    FrameEncoder* encoder = nullptr;
+    if (codecId == 2) {
+        if (encoderStorage.Open(targetW, targetH, targetFps)) encoder = &encoderStorage;
+        else LogToGUI("Falling back to raw RGB output.");
     }
+    g_MainOutput.SizeHistory(encoder ? ENCODER_BITRATE / 8 : (int64_t)targetW * targetH * 3 * targetFps);
 
-    PostMessage(g_hMainWindow, WM_OBS_STARTED, 0, 0);
+    renderer->SetRenditions(streamSettings.renditions, targetFps);
+    renderer->SetScaleFilter(streamSettings.scaler);
+    g_Recorder.BeginSession(encoder ? RecordKind::TransportStream : RecordKind::RawFrames);
+    g_Latency.Reset();
+    g_Latency.budgetMs = streamSettings.latencyBudgetMs;
+    if (streamSettings.latencyLoopback) StartLatencyReceiver();
 
-    DXGI_OUTDUPL_FRAME_INFO frameInfo;
-    ComPtr<IDXGIResource> desktopResource;
-    ComPtr<ID3D11Texture2D> frameTexture;
+    PostMessage(g_hMainWindow, WM_OBS_STARTED, 0, 0);
+    StaticContentDetector detector(streamSettings.staticKeepaliveMs * 1000ll);
 
     using namespace std::chrono;
     auto frameInterval = microseconds(1000000 / targetFps);
@@ -752,40 +4811,128 @@ void RunDXGICaptureLoop(D3DRenderer* renderer) {
             std::this_thread::sleep_for(milliseconds(1));
             continue;
         }
+        RecordWakeDelay(duration_cast<microseconds>(now - nextFrameTime).count());
         nextFrameTime += frameInterval;
 
-        desktopResource.Reset();
-        frameTexture.Reset();
-
-        hr = duplication->AcquireNextFrame(100, &frameInfo, &desktopResource);
-        if (hr == DXGI_ERROR_WAIT_TIMEOUT) continue;
-        if (FAILED(hr)) {
-            duplication.Reset();
-            output1->DuplicateOutput(device, &duplication);
-            continue;
-        }
-
-        desktopResource.As(&frameTexture);
-        if (frameTexture) {
-            renderer->ProcessDXGIFrame(frameTexture.Get(), targetW, targetH);
+        ID3D11Texture2D* frameTexture = nullptr;
+        CaptureFrameInfo info;
+        HRESULT hr = source->AcquireFrame(100, &frameTexture, &info);
+        if (FAILED(hr) && (hr != DXGI_ERROR_WAIT_TIMEOUT || !detector.Enabled())) continue;
+        int64_t captureUs = LatencyNowUs();
+        bool acquired = SUCCEEDED(hr);
+
+        // Только курсор или таймаут: m_scaledTexture уже содержит это изображение
+        uint64_t fingerprint = 0;
+        bool haveFingerprint = false;
+        if (acquired && (info.Presented() || !renderer->HasPreparedFrame())) {
+            // Ресайз не удался: кадр пропускается, предыдущий не отправляется повторно
+            if (!renderer->PrepareFrame(frameTexture, targetW, targetH)) {
+                renderer->SkipFrame(encoder);
+                source->ReleaseFrame();
+                continue;
+            }
+            if (detector.Enabled()) haveFingerprint = renderer->FingerprintFrame(targetW, targetH, encoder, fingerprint);
         }
-        duplication->ReleaseFrame();
+        FrameAction action = detector.OnFrame(acquired && info.Presented(), haveFingerprint ? &fingerprint : nullptr, captureUs);
+        // Таймаут без keepalive, как и раньше, ничего не отправляет
+        if (action == FrameAction::Skip || (!acquired && action == FrameAction::Send)) renderer->SkipFrame(encoder);
+        else renderer->OutputFrame(frameTexture, targetW, targetH, encoder, captureUs, action == FrameAction::Keepalive);
+        if (acquired) source->ReleaseFrame();
+
+        std::string rateReport;
+        if (detector.Report(captureUs, rateReport)) LogToGUI(rateReport);
     }
+    source.reset();
+    StopLatencyReceiver();
+    g_Latency.Report();
+    encoderStorage.Close();
+    renderer->SetRenditions({}, targetFps);
+    g_Recorder.EndSession();
+    g_SharedFrames.Close();
 }
 
 // --- FFMPEG PIPE READER ---
-struct ReaderCtx { HANDLE hPipe; };
-int ReadPacket(void* opaque, uint8_t* buf, int buf_size) {
-    ReaderCtx* ctx = (ReaderCtx*)opaque;
+// prefix: байты, уже прочитанные (и ретранслированные) при пробинге нативного демуксера.
+// ReadPacket отдаёт их avformat первыми и повторно в UDP/запись не отправляет.
+// index 0 - основной поток: превью, replay, запись и g_MainOutput. Остальные только
+// ретранслируются в свой UdpOutput. Pipe открыт в overlapped режиме, чтобы остановка
+// не ждала зависшего источника.
+const DWORD PIPE_IO_POLL_MS = 200;
+
+struct ReaderCtx {
+    HANDLE hPipe = INVALID_HANDLE_VALUE;
+    HANDLE ioEvent = nullptr;
+    NetIngest* net = nullptr; // вместо pipe, если задан ingest=udp|rtp
+    std::vector<uint8_t> prefix;
+    size_t prefixPos = 0;
+    int index = 0;
+    UdpOutput* output = &g_MainOutput;
+    const std::atomic<bool>* stop = nullptr;
+
+    bool IsPrimary() const { return index == 0; }
+    bool Active() const { return g_Running && !g_RestartRequested && !(stop && *stop); }
+    std::string Tag() const { return index ? "Stream " + std::to_string(index) + ": " : ""; }
+};
+
+// Ждёт завершения overlapped операции, пока поток активен; иначе отменяет её
+bool WaitPipeIo(ReaderCtx* ctx, OVERLAPPED* ov, DWORD* transferred) {
+    while (WaitForSingleObject(ov->hEvent, PIPE_IO_POLL_MS) == WAIT_TIMEOUT) {
+        if (ctx->Active()) continue;
+        CancelIoEx(ctx->hPipe, ov);
+        GetOverlappedResult(ctx->hPipe, ov, transferred, TRUE);
+        return false;
+    }
+    return GetOverlappedResult(ctx->hPipe, ov, transferred, FALSE) != FALSE;
+}
+
+bool ConnectPipe(ReaderCtx* ctx) {
+    OVERLAPPED ov = {};
+    ov.hEvent = ctx->ioEvent;
+    if (ConnectNamedPipe(ctx->hPipe, &ov)) return true;
+    DWORD err = GetLastError();
+    if (err == ERROR_PIPE_CONNECTED) return true;
+    if (err != ERROR_IO_PENDING) return false;
+    DWORD unused = 0;
+    return WaitPipeIo(ctx, &ov, &unused);
+}
+
+int ReadPipe(ReaderCtx* ctx, uint8_t* buf, int buf_size) {
     DWORD bytesRead = 0;
-    if (!ReadFile(ctx->hPipe, buf, buf_size, &bytesRead, NULL)) return AVERROR_EOF;
+    OVERLAPPED ov = {};
+    ov.hEvent = ctx->ioEvent;
+    if (ctx->net) {
+        int n;
+        while ((n = ctx->net->Read(buf, buf_size)) == 0) {
+            if (!ctx->Active()) return AVERROR_EOF;
+        }
+        if (n < 0) return AVERROR_EOF;
+        bytesRead = n;
+    }
+    else if (!ReadFile(ctx->hPipe, buf, buf_size, &bytesRead, &ov)) {
+        if (GetLastError() != ERROR_IO_PENDING || !WaitPipeIo(ctx, &ov, &bytesRead)) return AVERROR_EOF;
+    }
     if (bytesRead == 0) return AVERROR_EOF;
     if (g_IsStreamNetwork) {
-        SendUdpData(buf, bytesRead);
+        if (ctx->IsPrimary()) SendUdpData(buf, bytesRead);
+        else if (g_UdpSocket != INVALID_SOCKET) ctx->output->Send(g_UdpSocket, buf, bytesRead);
+    }
+    if (g_IsRecording && ctx->IsPrimary()) {
+        g_Recorder.WriteStream(buf, bytesRead);
     }
     return bytesRead;
 }
 
+int ReadPacket(void* opaque, uint8_t* buf, int buf_size) {
+    ReaderCtx* ctx = (ReaderCtx*)opaque;
+    if (ctx->prefixPos < ctx->prefix.size()) {
+        int n = (int)std::min<size_t>(buf_size, ctx->prefix.size() - ctx->prefixPos);
+        memcpy(buf, ctx->prefix.data() + ctx->prefixPos, n);
+        ctx->prefixPos += n;
+        return n;
+    }
+    return ReadPipe(ctx, buf, buf_size);
+}
+
 static enum AVPixelFormat GetHwFormat(AVCodecContext* ctx, const enum AVPixelFormat* pix_fmts) {
     const enum AVPixelFormat* p;
     for (p = pix_fmts; *p != -1; p++) {
@@ -794,46 +4941,221 @@ static enum AVPixelFormat GetHwFormat(AVCodecContext* ctx, const enum AVPixelFor
     return AV_PIX_FMT_NV12;
 }
 
-void RunPacketReaderThread(AVFormatContext* fmtCtx, PacketQueue* queue, int videoStreamIdx) {
+void RunPacketReaderThread(ReaderCtx* ctx, AVFormatContext* fmtCtx, PacketQueue* queue, int videoStreamIdx) {
+    ThreadRoleScope role(ThreadRole::Reader);
     AVPacket* pkt = av_packet_alloc();
-    while (g_Running && !g_RestartRequested) {
+    while (ctx->Active()) {
         if (av_read_frame(fmtCtx, pkt) < 0) break;
         if (pkt->stream_index == videoStreamIdx) {
-            AVPacket* newPkt = av_packet_alloc();
-            av_packet_ref(newPkt, pkt);
+            if (ctx->IsPrimary()) {
+                g_Latency.MarkIngest(pkt->pts, LatencyNowUs());
+                g_Replay.Push(pkt);
+            }
+            // Буфер payload avformat уже берёт из своего пула, оболочку берём из нашего
+            AVPacket* newPkt = g_PacketPool.Acquire();
+            av_packet_move_ref(newPkt, pkt);
             queue->push(newPkt);
         }
-        av_packet_unref(pkt);
+        else av_packet_unref(pkt);
     }
     av_packet_free(&pkt);
     queue->setFinished();
 }
 
-void RunFFmpegLoop(D3DRenderer* renderer) {
-    LogToGUI("Creating Named Pipe...");
-    HANDLE hPipe = CreateNamedPipeA("\\\\.\\pipe\\obs_video", PIPE_ACCESS_DUPLEX, PIPE_TYPE_BYTE | PIPE_WAIT, 1, PIPE_BUFFER_SIZE, PIPE_BUFFER_SIZE, 0, nullptr);
-    if (hPipe == INVALID_HANDLE_VALUE) {
-        LogToGUI("Error: Failed to create pipe.");
-        std::this_thread::sleep_for(std::chrono::seconds(1));
-        return;
+void RunTsReaderThread(ReaderCtx* ctx, TsDemuxer* demuxer, PacketQueue* queue) {
+    ThreadRoleScope role(ThreadRole::Reader);
+    std::vector<uint8_t> chunk(TS_READ_CHUNK);
+    bool primary = ctx->IsPrimary();
+    auto onPacket = [queue, demuxer, primary](AVPacket* pkt) {
+        if (primary) {
+            g_Latency.MarkIngest(pkt->pts, demuxer->lastIngestUs);
+            g_Replay.Push(pkt);
+        }
+        queue->push(pkt);
+    };
+    while (ctx->Active()) {
+        int n = ReadPipe(ctx, chunk.data(), (int)chunk.size());
+        if (n <= 0) break;
+        demuxer->chunkTimeUs = LatencyNowUs();
+        demuxer->Feed(chunk.data(), n, onPacket);
+        if (demuxer->CodecChanged()) {
+            LogToGUI(ctx->Tag() + "TS demux: PMT switched codec to " + avcodec_get_name(demuxer->GetCodecId()) + ", reopening decoder.");
+            break;
+        }
     }
+    demuxer->Flush(onPacket);
+    if (demuxer->continuityErrors > 0 || demuxer->syncLosses > 0) {
+        LogToGUI(ctx->Tag() + "TS demux: " + std::to_string(demuxer->continuityErrors) + " CC errors, " +
+            std::to_string(demuxer->syncLosses) + " sync losses");
+    }
+    queue->setFinished();
+}
 
-    std::thread obsThread(LaunchOBS);
-    obsThread.detach();
+// Читает начало потока, пока демуксер не найдёт видео в PMT. Прочитанное сохраняется
+// в ctx.prefix, чтобы при неудаче отдать его avformat. AU, собранные при пробинге, - в probed.
+bool ProbeNativeTs(ReaderCtx& ctx, TsDemuxer& demuxer, std::vector<AVPacket*>& probed) {
+    std::vector<uint8_t> chunk(TS_READ_CHUNK);
+    auto onPacket = [&probed](AVPacket* pkt) { probed.push_back(pkt); };
+    while (ctx.Active() && !demuxer.HasVideo() && ctx.prefix.size() < TS_PROBE_LIMIT) {
+        int n = ReadPipe(&ctx, chunk.data(), (int)chunk.size());
+        if (n <= 0) break;
+        ctx.prefix.insert(ctx.prefix.end(), chunk.begin(), chunk.begin() + n);
+        demuxer.Feed(chunk.data(), n, onPacket);
+    }
+    if (demuxer.HasVideo()) return true;
+    for (AVPacket* pkt : probed) g_PacketPool.Release(&pkt);
+    probed.clear();
+    return false;
+}
 
-    LogToGUI("Waiting for OBS connection...");
-    // ConnectNamedPipe блокирует поток до подключения клиента (OBS)
-    if (!ConnectNamedPipe(hPipe, nullptr) && GetLastError() != ERROR_PIPE_CONNECTED) {
-        LogToGUI("Error: ConnectNamedPipe failed.");
-        CloseHandle(hPipe);
-        return;
+AVCodecContext* OpenPipeDecoder(D3DRenderer* renderer, const AVCodecParameters* codecPar) {
+    const AVCodec* decoder = avcodec_find_decoder(codecPar->codec_id);
+    if (!decoder) {
+        LogToGUI("Error: Decoder not found.");
+        return nullptr;
     }
-    LogToGUI("OBS Connected to pipe.");
-    PostMessage(g_hMainWindow, WM_OBS_STARTED, 0, 0);
+    AVCodecContext* decCtx = avcodec_alloc_context3(decoder);
+    avcodec_parameters_to_context(decCtx, codecPar);
+    AVBufferRef* hwDeviceRef = av_hwdevice_ctx_alloc(AV_HWDEVICE_TYPE_D3D11VA);
+    if (hwDeviceRef) {
+        AVHWDeviceContext* deviceCtx = (AVHWDeviceContext*)hwDeviceRef->data;
+        AVD3D11VADeviceContext* d3d11Ctx = (AVD3D11VADeviceContext*)deviceCtx->hwctx;
+        d3d11Ctx->device = renderer->GetDevice();
+        d3d11Ctx->device->AddRef();
+        av_hwdevice_ctx_init(hwDeviceRef);
+        decCtx->hw_device_ctx = av_buffer_ref(hwDeviceRef);
+        av_buffer_unref(&hwDeviceRef);
+        decCtx->get_format = GetHwFormat;
+    }
+    decCtx->thread_count = 1;
+    decCtx->flags |= AV_CODEC_FLAG_LOW_DELAY;
+
+    if (avcodec_open2(decCtx, decoder, nullptr) < 0) {
+        LogToGUI("Error: Could not open codec.");
+        avcodec_free_context(&decCtx);
+        return nullptr;
+    }
+    return decCtx;
+}
+
+// --- CONSUMER-AWARE DECODING ---
+// Ретрансляция в UDP идёт из ReadPacket и декодера не требует. Декодируем только
+// если кому-то нужны пиксели; редким потребителям (свёрнутое превью, health check,
+// см. RegisterLowRatePixelConsumer) хватает ключевых кадров.
+enum class DecodeDemand { None = 0, KeyframesOnly = 1, Full = 2 };
+
+DecodeDemand GetDecodeDemand() {
+    if (g_IsShowStream && !IsIconic(g_hMainWindow)) return DecodeDemand::Full;
+    if (g_IsShowStream || g_LowRatePixelConsumers > 0) return DecodeDemand::KeyframesOnly;
+    return DecodeDemand::None;
+}
+
+const char* DecodeDemandName(DecodeDemand demand) {
+    switch (demand) {
+    case DecodeDemand::Full: return "full decode";
+    case DecodeDemand::KeyframesOnly: return "keyframes only";
+    default: return "relay only (no decode)";
+    }
+}
+
+void DecodePacketQueue(D3DRenderer* renderer, AVCodecContext* decCtx, PacketQueue& packetQueue, const ReaderCtx& ctx) {
+    AVFrame* frame = av_frame_alloc();
+    bool finished = false;
+
+    DecodeDemand demand = DecodeDemand::None;
+    bool waitingForKey = true;
+    uint64_t decodedPackets = 0, skippedPackets = 0;
+
+    LogToGUI(ctx.Tag() + "Starting loop...");
+    while (ctx.Active()) {
+        int64_t wakeDelayUs = -1;
+        AVPacket* pkt = packetQueue.pop(finished, &wakeDelayUs);
+        if (finished && !pkt) break;
+        if (!pkt) continue;
+        RecordWakeDelay(wakeDelayUs);
+        if (ctx.IsPrimary()) g_Latency.Record(LAT_DEQUEUED, g_Latency.IngestTime(pkt->pts));
+
+        DecodeDemand wanted = GetDecodeDemand();
+        if (wanted != demand) {
+            // Повышение уровня возобновляется только со следующего ключевого кадра
+            if (wanted > demand) waitingForKey = true;
+            if (wanted == DecodeDemand::None) avcodec_flush_buffers(decCtx);
+            demand = wanted;
+            LogToGUI(ctx.Tag() + "Decoder: " + DecodeDemandName(demand));
+        }
+
+        bool isKey = (pkt->flags & AV_PKT_FLAG_KEY) != 0;
+        if (demand == DecodeDemand::None || (waitingForKey && !isKey) || (demand == DecodeDemand::KeyframesOnly && !isKey)) {
+            skippedPackets++;
+            g_PacketPool.Release(&pkt);
+            continue;
+        }
+        if (waitingForKey) {
+            avcodec_flush_buffers(decCtx);
+            waitingForKey = false;
+        }
+        decodedPackets++;
+
+        if (avcodec_send_packet(decCtx, pkt) >= 0) {
+            while (avcodec_receive_frame(decCtx, frame) >= 0) {
+                int64_t ingestUs = g_Latency.IngestTime(frame->pts);
+                g_Latency.Record(LAT_DECODED, ingestUs);
+                if (ctx.IsPrimary()) {
+                    g_LastDecodedWidth = frame->width;
+                    g_LastDecodedHeight = frame->height;
+                    g_LastDecodedUs = LatencyNowUs();
+                }
+                if (renderer->RenderFrame(frame)) g_Latency.Record(LAT_PRESENT, ingestUs);
+                av_frame_unref(frame);
+            }
+        }
+        g_PacketPool.Release(&pkt);
+    }
+    packetQueue.setFinished();
+    LogToGUI(ctx.Tag() + "Packets decoded: " + std::to_string(decodedPackets) + ", relay-only: " + std::to_string(skippedPackets));
+    if (ctx.IsPrimary()) {
+        LogToGUI(g_PacketPool.Stats());
+        g_Latency.Report();
+    }
+    av_frame_free(&frame);
+}
+
+// Возвращает true, если поток сменил кодек и его нужно пробить заново
+bool RunNativeTsPipeline(D3DRenderer* renderer, ReaderCtx& ctx, TsDemuxer& demuxer, std::vector<AVPacket*>& probed) {
+    AVCodecParameters* codecPar = avcodec_parameters_alloc();
+    codecPar->codec_type = AVMEDIA_TYPE_VIDEO;
+    codecPar->codec_id = demuxer.GetCodecId();
+
+    AVCodecContext* decCtx = OpenPipeDecoder(renderer, codecPar);
+    if (!decCtx) {
+        for (AVPacket* pkt : probed) g_PacketPool.Release(&pkt);
+        avcodec_parameters_free(&codecPar);
+        return false;
+    }
+    if (ctx.IsPrimary()) g_Replay.Configure(codecPar, { 1, 90000 });
+    avcodec_parameters_free(&codecPar);
+
+    LogToGUI(ctx.Tag() + "Native TS demuxer: " + avcodec_get_name(demuxer.GetCodecId()));
+    PacketQueue packetQueue;
+    for (AVPacket* pkt : probed) {
+        if (ctx.IsPrimary()) g_Replay.Push(pkt);
+        packetQueue.push(pkt);
+    }
+    probed.clear();
+    // Пробинг уже отдал свои байты демуксеру, повторно их читать не нужно
+    ctx.prefix.clear();
+
+    std::thread readerThread(RunTsReaderThread, &ctx, &demuxer, &packetQueue);
+    DecodePacketQueue(renderer, decCtx, packetQueue, ctx);
+    if (readerThread.joinable()) readerThread.join();
+    packetQueue.clear();
+    avcodec_free_context(&decCtx);
+    return demuxer.CodecChanged();
+}
 
+void RunAvformatPipeline(D3DRenderer* renderer, ReaderCtx& ctx) {
     size_t ioBufferSize = 1024 * 1024; // Increase buffer for stability
     unsigned char* ioBuffer = (unsigned char*)av_malloc(ioBufferSize + AV_INPUT_BUFFER_PADDING_SIZE);
-    ReaderCtx ctx = { hPipe };
     AVIOContext* avioCtx = avio_alloc_context(ioBuffer, ioBufferSize, 0, &ctx, ReadPacket, nullptr, nullptr);
 
     AVFormatContext* fmtCtx = avformat_alloc_context();
@@ -851,88 +5173,206 @@ void RunFFmpegLoop(D3DRenderer* renderer) {
     // Removed "low_delay" from flags to prevent header drop on startup if buffer is slow
     // av_dict_set(&options, "flags", "low_delay", 0); 
 
-    LogToGUI("Opening input stream...");
+    LogToGUI(ctx.Tag() + "Opening input stream...");
     int err = avformat_open_input(&fmtCtx, nullptr, in_fmt, &options);
+    av_dict_free(&options);
     if (err < 0) {
         char errBuf[128];
         av_strerror(err, errBuf, 128);
-        LogToGUI(std::string("Error opening input: ") + errBuf);
-        CloseHandle(hPipe);
+        LogToGUI(ctx.Tag() + "Error opening input: " + errBuf);
         return;
     }
-    av_dict_free(&options);
-    LogToGUI("Stream Opened Successfully.");
+    LogToGUI(ctx.Tag() + "Stream Opened Successfully.");
 
     int videoStreamIdx = av_find_best_stream(fmtCtx, AVMEDIA_TYPE_VIDEO, -1, -1, nullptr, 0);
     if (videoStreamIdx < 0) {
-        LogToGUI("Error: No video stream found.");
-        CloseHandle(hPipe);
+        LogToGUI(ctx.Tag() + "Error: No video stream found.");
+        avformat_close_input(&fmtCtx);
         return;
     }
 
     AVCodecParameters* codecPar = fmtCtx->streams[videoStreamIdx]->codecpar;
-    const AVCodec* decoder = avcodec_find_decoder(codecPar->codec_id);
-    AVCodecContext* decCtx = avcodec_alloc_context3(decoder);
-    avcodec_parameters_to_context(decCtx, codecPar);
-    AVBufferRef* hwDeviceRef = av_hwdevice_ctx_alloc(AV_HWDEVICE_TYPE_D3D11VA);
-    if (hwDeviceRef) {
-        AVHWDeviceContext* deviceCtx = (AVHWDeviceContext*)hwDeviceRef->data;
-        AVD3D11VADeviceContext* d3d11Ctx = (AVD3D11VADeviceContext*)deviceCtx->hwctx;
-        d3d11Ctx->device = renderer->GetDevice();
-        d3d11Ctx->device->AddRef();
-        av_hwdevice_ctx_init(hwDeviceRef);
-        decCtx->hw_device_ctx = av_buffer_ref(hwDeviceRef);
-        av_buffer_unref(&hwDeviceRef);
-        decCtx->get_format = GetHwFormat;
-    }
-    decCtx->thread_count = 1;
-    decCtx->flags |= AV_CODEC_FLAG_LOW_DELAY;
-
-    if (avcodec_open2(decCtx, decoder, nullptr) < 0) {
-        LogToGUI("Error: Could not open codec.");
+    AVCodecContext* decCtx = OpenPipeDecoder(renderer, codecPar);
+    if (!decCtx) {
+        avformat_close_input(&fmtCtx);
         return;
     }
 
+    if (ctx.IsPrimary()) g_Replay.Configure(codecPar, fmtCtx->streams[videoStreamIdx]->time_base);
+
     PacketQueue packetQueue;
-    std::thread readerThread(RunPacketReaderThread, fmtCtx, &packetQueue, videoStreamIdx);
-    AVFrame* frame = av_frame_alloc();
-    bool finished = false;
+    std::thread readerThread(RunPacketReaderThread, &ctx, fmtCtx, &packetQueue, videoStreamIdx);
+    DecodePacketQueue(renderer, decCtx, packetQueue, ctx);
+    if (readerThread.joinable()) readerThread.join();
+    packetQueue.clear();
+    avcodec_free_context(&decCtx);
+    avformat_close_input(&fmtCtx);
+}
 
-    LogToGUI("Starting loop...");
-    while (g_Running && !g_RestartRequested) {
-        AVPacket* pkt = packetQueue.pop(finished);
-        if (finished && !pkt) break;
-        if (!pkt) continue;
+// --- MULTI-STREAM INGEST ---
+// Каждый поток: свой pipe и поток чтения, поэтому зависший источник не задерживает
+// остальные. Демукс, очередь и декодер есть только у основного потока, дополнительные
+// ретранслируются прямо из ReadPipe. Общие: UDP сокет и NACK.
+std::string PipeStreamName(int index) {
+    std::string name = "\\\\.\\pipe\\obs_video";
+    return index ? name + "_" + std::to_string(index) : name;
+}
 
-        if (avcodec_send_packet(decCtx, pkt) >= 0) {
-            while (avcodec_receive_frame(decCtx, frame) >= 0) {
-                renderer->RenderFrame(frame);
-                av_frame_unref(frame);
-            }
+// Одно подключение клиента: пробинг, демукс, декодирование до EOF или остановки
+void RunPipeConnection(D3DRenderer* renderer, ReaderCtx& ctx) {
+    // Смена кодека в PMT: то же соединение пробится заново с новым декодером
+    bool reprobe = true;
+    while (reprobe && ctx.Active()) {
+        reprobe = false;
+        TsDemuxer demuxer;
+        std::vector<AVPacket*> probed;
+        if (USE_NATIVE_TS_DEMUX && ProbeNativeTs(ctx, demuxer, probed)) {
+            reprobe = RunNativeTsPipeline(renderer, ctx, demuxer, probed);
+        }
+        else if (ctx.Active()) {
+            if (USE_NATIVE_TS_DEMUX) LogToGUI(ctx.Tag() + "Native TS demuxer: no video PID found, using avformat.");
+            RunAvformatPipeline(renderer, ctx);
         }
-        av_packet_free(&pkt);
     }
+}
 
-    packetQueue.setFinished();
-    if (readerThread.joinable()) readerThread.join();
-    packetQueue.clear();
-    av_frame_free(&frame);
-    avcodec_free_context(&decCtx);
-    avformat_close_input(&fmtCtx);
-    CloseHandle(hPipe);
+// Дополнительный поток: relay-only, после отключения клиента ждёт следующего
+void RunExtraPipeStream(int index, int port, const std::atomic<bool>* stop) {
+    ThreadRoleScope role(ThreadRole::Reader);
+    UdpOutput output;
+    output.Init(INADDR_BROADCAST, port);
+    output.payloadType = RTP_PT_MP2T;
+    output.SizeHistory(ENCODER_BITRATE / 8);
+    RegisterUdpOutput(&output);
+
+    ReaderCtx base;
+    base.index = index;
+    base.output = &output;
+    base.stop = stop;
+    std::string name = PipeStreamName(index);
+    HANDLE ioEvent = CreateEvent(nullptr, TRUE, FALSE, nullptr);
+    std::vector<uint8_t> relayBuffer(1024 * 1024);
+    while (base.Active()) {
+        HANDLE hPipe = CreateNamedPipeA(name.c_str(), PIPE_ACCESS_DUPLEX | FILE_FLAG_OVERLAPPED, PIPE_TYPE_BYTE | PIPE_WAIT, 1, PIPE_BUFFER_SIZE, PIPE_BUFFER_SIZE, 0, nullptr);
+        if (hPipe == INVALID_HANDLE_VALUE) {
+            LogToGUI(base.Tag() + "Error: Failed to create pipe " + name);
+            break;
+        }
+        ReaderCtx ctx = base;
+        ctx.hPipe = hPipe;
+        ctx.ioEvent = ioEvent;
+        if (ConnectPipe(&ctx)) {
+            LogToGUI(ctx.Tag() + "Client connected, UDP port " + std::to_string(port));
+            // ReadPipe сам отправляет прочитанное в output: ни пробинга, ни PES, ни очереди
+            uint64_t relayed = 0;
+            int n;
+            while (ctx.Active() && (n = ReadPipe(&ctx, relayBuffer.data(), (int)relayBuffer.size())) > 0) relayed += n;
+            if (ctx.Active()) LogToGUI(ctx.Tag() + "Client disconnected, relayed " + std::to_string(relayed / (1024 * 1024)) + " MB.");
+        }
+        DisconnectNamedPipe(hPipe);
+        CloseHandle(hPipe);
+    }
+    CloseHandle(ioEvent);
+    UnregisterUdpOutput(&output);
+}
+
+// Дополнительные потоки не зависят от подключения основного клиента: живут между вызовами
+// RunFFmpegLoop и останавливаются только перезапуском движка, сменой режима или выходом.
+class ExtraPipeStreams {
+    std::atomic<bool> m_stop{ false };
+    std::vector<std::thread> m_threads;
+
+public:
+    ~ExtraPipeStreams() { Stop(); }
+
+    void Start(const StreamSettings& settings) {
+        if (!m_threads.empty()) return;
+        m_stop = false;
+        for (int i = 1; i < settings.pipeStreams; i++) {
+            m_threads.emplace_back(RunExtraPipeStream, i, settings.pipeBasePort + i - 1, &m_stop);
+        }
+        if (!m_threads.empty()) LogToGUI("Extra pipe streams: " + std::to_string(m_threads.size()));
+    }
+
+    void Stop() {
+        m_stop = true;
+        for (std::thread& t : m_threads) t.join();
+        m_threads.clear();
+    }
+};
+
+void RunFFmpegLoop(D3DRenderer* renderer, ExtraPipeStreams& extraStreams) {
+    StreamSettings streamSettings = ReadStreamSettings();
+    SetThreadTopology(streamSettings.topology);
+    g_Replay.SetLimits(streamSettings.replayWindowSec, streamSettings.replayBudgetMb);
+    ThreadRoleScope role(ThreadRole::Decode);
+    g_MainOutput.payloadType = RTP_PT_MP2T;
+    // Битрейт OBS неизвестен заранее: номинальный из профиля (см. начало файла), как у энкодера
+    g_MainOutput.SizeHistory(ENCODER_BITRATE / 8);
+    ReaderCtx ctx;
+    NetIngest net;
+    if (streamSettings.ingest != IngestKind::Pipe) {
+        if (!net.Open(streamSettings.ingest, streamSettings.ingestIp, streamSettings.ingestPort)) {
+            std::this_thread::sleep_for(std::chrono::seconds(1));
+            return;
+        }
+        ctx.net = &net;
+    }
+    else {
+        LogToGUI("Creating Named Pipe...");
+        ctx.hPipe = CreateNamedPipeA(PipeStreamName(0).c_str(), PIPE_ACCESS_DUPLEX | FILE_FLAG_OVERLAPPED, PIPE_TYPE_BYTE | PIPE_WAIT, 1, PIPE_BUFFER_SIZE, PIPE_BUFFER_SIZE, 0, nullptr);
+        if (ctx.hPipe == INVALID_HANDLE_VALUE) {
+            LogToGUI("Error: Failed to create pipe.");
+            std::this_thread::sleep_for(std::chrono::seconds(1));
+            return;
+        }
+    }
+
+    extraStreams.Start(streamSettings);
+
+    bool connected = true;
+    if (!ctx.net) {
+        std::thread obsThread(LaunchOBS);
+        obsThread.detach();
+
+        ctx.ioEvent = CreateEvent(nullptr, TRUE, FALSE, nullptr);
+        LogToGUI("Waiting for OBS connection...");
+        // Ожидание клиента (OBS) прерывается перезапуском или закрытием окна
+        connected = ConnectPipe(&ctx);
+        if (connected) LogToGUI("OBS Connected to pipe.");
+        else if (ctx.Active()) LogToGUI("Error: ConnectNamedPipe failed.");
+    }
+    if (connected) {
+        PostMessage(g_hMainWindow, WM_OBS_STARTED, 0, 0);
+        g_Latency.Reset();
+        g_Latency.budgetMs = streamSettings.latencyBudgetMs;
+        g_Recorder.BeginSession(RecordKind::TransportStream);
+        RunPipeConnection(renderer, ctx);
+    }
+    if (ctx.net) LogToGUI(net.Stats());
+
+    if (ctx.ioEvent) CloseHandle(ctx.ioEvent);
+    if (ctx.hPipe != INVALID_HANDLE_VALUE) CloseHandle(ctx.hPipe);
+    g_Recorder.EndSession();
     LogToGUI("FFmpeg Loop Ended.");
 }
 
 void DecoderManagerThread(D3DRenderer* renderer) {
     CoInitializeEx(nullptr, COINIT_MULTITHREADED);
     av_log_set_level(AV_LOG_ERROR);
+    ExtraPipeStreams extraStreams;
     while (g_Running) {
         g_RestartRequested = false;
         int w, h, fps, codecId;
         ReadConfigSettings(w, h, fps, codecId);
 
-        if (codecId == 1) RunDXGICaptureLoop(renderer);
-        else RunFFmpegLoop(renderer);
+        if (codecId == 1 || codecId == 2) {
+            extraStreams.Stop();
+            RunDXGICaptureLoop(renderer);
+        }
+        else RunFFmpegLoop(renderer, extraStreams);
+        // Отключение основного клиента дополнительные потоки не останавливает
+        if (g_RestartRequested || !g_Running) extraStreams.Stop();
 
         if (g_RestartRequested) {
             LogToGUI("Restarting stream engine...");
@@ -999,6 +5439,11 @@ LRESULT CALLBACK WindowProc(HWND hwnd, UINT uMsg, WPARAM wParam, LPARAM lParam)
         g_hChkShow = CreateWindowA("BUTTON", "Show Stream", WS_VISIBLE | WS_CHILD | BS_AUTOCHECKBOX, 680, y1, 100, 20, hwnd, (HMENU)ID_CHK_SHOW, NULL, NULL);
         g_hChkStream = CreateWindowA("BUTTON", "Stream UDP", WS_VISIBLE | WS_CHILD | BS_AUTOCHECKBOX, 680, y1 + 25, 100, 20, hwnd, (HMENU)ID_CHK_STREAM, NULL, NULL);
 
+        g_hChkRecord = CreateWindowA("BUTTON", "Record", WS_VISIBLE | WS_CHILD | BS_AUTOCHECKBOX, 20, y2, 80, 20, hwnd, (HMENU)ID_CHK_RECORD, NULL, NULL);
+        g_hChkShm = CreateWindowA("BUTTON", "Shared Memory", WS_VISIBLE | WS_CHILD | BS_AUTOCHECKBOX, 220, y2, 120, 20, hwnd, (HMENU)ID_CHK_SHM, NULL, NULL);
+        g_hChkRtp = CreateWindowA("BUTTON", "RTP + NACK", WS_VISIBLE | WS_CHILD | BS_AUTOCHECKBOX, 350, y2, 110, 20, hwnd, (HMENU)ID_CHK_RTP, NULL, NULL);
+        g_hBtnReplay = CreateWindowA("BUTTON", "Save Replay", WS_VISIBLE | WS_CHILD | BS_PUSHBUTTON, 110, y2 - 2, 100, 25, hwnd, (HMENU)ID_BTN_REPLAY, NULL, NULL);
+
         // Apply Button
         g_hBtnApply = CreateWindowA("BUTTON", "Apply & Restart", WS_VISIBLE | WS_CHILD | BS_PUSHBUTTON, 800, y1, 120, 25, hwnd, (HMENU)ID_BTN_APPLY, NULL, NULL);
 
@@ -1006,6 +5451,9 @@ LRESULT CALLBACK WindowProc(HWND hwnd, UINT uMsg, WPARAM wParam, LPARAM lParam)
         SendMessage(g_hChkShow, BM_SETCHECK, BST_UNCHECKED, 0);
         SendMessage(g_hChkStream, BM_SETCHECK, BST_UNCHECKED, 0);
         SendMessage(g_hChkCustom, BM_SETCHECK, BST_UNCHECKED, 0);
+        SendMessage(g_hChkRecord, BM_SETCHECK, BST_UNCHECKED, 0);
+        SendMessage(g_hChkShm, BM_SETCHECK, BST_UNCHECKED, 0);
+        SendMessage(g_hChkRtp, BM_SETCHECK, BST_UNCHECKED, 0);
 
         // Console & Video
         g_hConsoleWindow = CreateWindowA("EDIT", "", WS_VISIBLE | WS_CHILD | WS_BORDER | WS_VSCROLL | ES_MULTILINE | ES_AUTOVSCROLL | ES_READONLY, 0, TOP_PANEL_HEIGHT, WINDOW_WIDTH - 16, CONSOLE_HEIGHT, hwnd, (HMENU)ID_CONSOLE_BOX, NULL, NULL);
@@ -1043,7 +5491,7 @@ LRESULT CALLBACK WindowProc(HWND hwnd, UINT uMsg, WPARAM wParam, LPARAM lParam)
             SetWindowTextA(g_hEditFps, std::to_string(fps).c_str());
         }
 
-        SendMessage(g_hComboCodec, CB_SETCURSEL, (codec == 1) ? 1 : 0, 0);
+        SendMessage(g_hComboCodec, CB_SETCURSEL, (codec >= 0 && codec < (int)AVAILABLE_CODECS.size()) ? codec : 0, 0);
         LogToGUI("System initialized. UDP Port: " + std::to_string(UDP_PORT));
         UpdateVideoLayout(w, h);
     }
@@ -1054,6 +5502,10 @@ LRESULT CALLBACK WindowProc(HWND hwnd, UINT uMsg, WPARAM wParam, LPARAM lParam)
         if (g_hBtnApply) EnableWindow(g_hBtnApply, TRUE);
         return 0;
 
+    case WM_RECORDER_LOG:
+        g_Recorder.FlushLog();
+        return 0;
+
     case WM_COMMAND:
         if (LOWORD(wParam) == ID_CHK_SHOW) {
             g_IsShowStream = (SendMessage(g_hChkShow, BM_GETCHECK, 0, 0) == BST_CHECKED);
@@ -1061,6 +5513,20 @@ LRESULT CALLBACK WindowProc(HWND hwnd, UINT uMsg, WPARAM wParam, LPARAM lParam)
         else if (LOWORD(wParam) == ID_CHK_STREAM) {
             g_IsStreamNetwork = (SendMessage(g_hChkStream, BM_GETCHECK, 0, 0) == BST_CHECKED);
         }
+        else if (LOWORD(wParam) == ID_CHK_RECORD) {
+            g_IsRecording = (SendMessage(g_hChkRecord, BM_GETCHECK, 0, 0) == BST_CHECKED);
+            if (g_IsRecording) g_Recorder.Start();
+            else g_Recorder.Stop();
+        }
+        else if (LOWORD(wParam) == ID_CHK_SHM) {
+            g_IsSharedMemory = (SendMessage(g_hChkShm, BM_GETCHECK, 0, 0) == BST_CHECKED);
+        }
+        else if (LOWORD(wParam) == ID_CHK_RTP) {
+            g_IsReliableUdp = (SendMessage(g_hChkRtp, BM_GETCHECK, 0, 0) == BST_CHECKED);
+        }
+        else if (LOWORD(wParam) == ID_BTN_REPLAY) {
+            g_Replay.DumpAsync();
+        }
         else if (LOWORD(wParam) == ID_CHK_CUSTOM) {
             bool isCustom = (SendMessage(g_hChkCustom, BM_GETCHECK, 0, 0) == BST_CHECKED);
             ToggleCustomControls(isCustom);
@@ -1122,6 +5588,7 @@ LRESULT CALLBACK WindowProc(HWND hwnd, UINT uMsg, WPARAM wParam, LPARAM lParam)
 
 int main() {
     InitNetwork();
+    StartControlServer();
     WNDCLASSW wc = {};
     wc.lpfnWndProc = WindowProc;
     wc.lpszClassName = L"OBSReceiverHub";
@@ -1146,7 +5613,9 @@ int main() {
     g_Running = false;
     if (g_hJob) CloseHandle(g_hJob);
     if (t.joinable()) t.join();
-    if (g_UdpSocket != INVALID_SOCKET) closesocket(g_UdpSocket);
-    WSACleanup();
+    g_Replay.WaitDump();
+    g_Recorder.Shutdown();
+    StopControlServer();
+    ShutdownNetwork();
     return 0;
 }
\ No newline at end of file
@@ -0,0 +1,847 @@
+/* Stream load generator / soak test for DXGIscreencapture (OBS mode).
+
+   Feeds N concurrent MPEG-TS streams into the engine inputs and writes a CSV report:
+     pipe: \\.\pipe\obs_video, \\.\pipe\obs_video_1 .. (pipe_streams=N in streams.ini)
+           On Linux the same names are FIFOs (default /tmp/obs_video, /tmp/obs_video_<i>).
+     udp / rtp: <host>:<port + i> (ingest=udp|rtp in streams.ini for stream 0)
+
+   Usage:
+     LoadGenerator [--input file.ts | --synthetic 1280x720@30] [--frame-bytes N]
+                   [--streams N] [--out pipe|udp|rtp] [--pipe-name base] [--dest host:port]
+                   [--speed realtime|max|<N>x] [--duration sec] [--interval sec]
+                   [--probe-ms ms] [--listen port[,port...]] [--watch-pid pid]
+                   [--report loadgen_report.csv]
+
+   Recorded files are paced by their PCR and looped. Synthetic streams carry raw-sized
+   (NV12) H.264-shaped access units: they load the pipe/relay/demux path, not the decoder.
+   Every --probe-ms each stream inserts a TS packet on PID 0x1FFE with its send time.
+   The engine relays those bytes unchanged, so --listen on the relay ports (8221 for the
+   primary stream, pipe_streams basePort+i-1 for the others) gives end-to-end latency and
+   probe loss. The report has one row per --interval and a final "total" row. Interval rows
+   count everything within the interval; the "total" row covers the run until the streams stop.
+*/
+
+#define _CRT_SECURE_NO_WARNINGS
+#define NOMINMAX
+
+#ifdef _WIN32
+#define WIN32_LEAN_AND_MEAN
+#include <winsock2.h>
+#include <ws2tcpip.h>
+#include <windows.h>
+#include <psapi.h>
+#pragma comment(lib, "ws2_32.lib")
+#pragma comment(lib, "psapi.lib")
+typedef HANDLE PipeHandle;
+#define INVALID_PIPE INVALID_HANDLE_VALUE
+#else
+#include <sys/socket.h>
+#include <sys/stat.h>
+#include <sys/resource.h>
+#include <netinet/in.h>
+#include <arpa/inet.h>
+#include <fcntl.h>
+#include <unistd.h>
+#include <errno.h>
+typedef int SOCKET;
+typedef int PipeHandle;
+#define INVALID_SOCKET (-1)
+#define INVALID_PIPE (-1)
+#define closesocket close
+#endif
+
+#include <stdint.h>
+#include <string.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <csignal>
+#include <string>
+#include <vector>
+#include <thread>
+#include <mutex>
+#include <atomic>
+#include <chrono>
+#include <fstream>
+#include <sstream>
+#include <algorithm>
+#include <memory>
+
+// --- КОНСТАНТЫ И ГЛОБАЛЬНЫЕ ПЕРЕМЕННЫЕ ---
+const int TS_PACKET_SIZE = 188;
+const int UDP_TS_PACKETS = 7; // 1316 байт, как UDP_PACKET_SIZE в движке
+const int RTP_HEADER_SIZE = 12;
+const int RTP_PT_MP2T = 33;
+const int WRITE_CHUNK = TS_PACKET_SIZE * 348; // ~64 KB, как TS_READ_CHUNK в движке
+const int PROBE_PID = 0x1FFE;
+const int VIDEO_PID = 0x100;
+const int PMT_PID = 0x1000;
+const char PROBE_MAGIC[8] = { 'L', 'G', 'P', 'R', 'O', 'B', 'E', '1' };
+const int PROBE_SIZE = 8 + 4 + 8 + 8; // magic, stream, seq, sendUs
+const int64_t WRITE_STALL_US = 100000;
+const int64_t PACING_LATE_US = 100000;
+const int LATENCY_BUCKET_US = 100;
+const int LATENCY_BUCKETS = 100000; // до 10 с
+
+std::atomic<bool> g_Stop(false);
+std::atomic<bool> g_StopListeners(false);
+
+int64_t NowUs() {
+    return std::chrono::duration_cast<std::chrono::microseconds>(std::chrono::steady_clock::now().time_since_epoch()).count();
+}
+
+void Log(const std::string& message) {
+    static std::mutex mutex;
+    std::lock_guard<std::mutex> lock(mutex);
+    fprintf(stderr, "%s\n", message.c_str());
+}
+
+enum class OutputKind { Pipe, Udp, Rtp };
+
+struct Options {
+    std::string input;               // пусто - синтетика
+    int width = 1280, height = 720, fps = 30;
+    int frameBytes = 0;              // 0 - размер NV12 кадра
+    int streams = 1;
+    OutputKind out = OutputKind::Pipe;
+#ifdef _WIN32
+    std::string pipeName = "\\\\.\\pipe\\obs_video";
+#else
+    std::string pipeName = "/tmp/obs_video";
+#endif
+    std::string destHost = "127.0.0.1";
+    int destPort = 5000;
+    double speed = 1.0;              // 0 - максимальная скорость
+    int durationSec = 0;             // 0 - до Ctrl+C
+    int intervalSec = 10;
+    int probeMs = 20;
+    std::vector<int> listenPorts;
+    int watchPid = 0;
+    std::string report = "loadgen_report.csv";
+};
+
+// ==========================================
+// СТАТИСТИКА
+// ==========================================
+struct StreamStats {
+    std::atomic<uint64_t> bytes{ 0 };
+    std::atomic<uint64_t> writeErrors{ 0 };
+    std::atomic<uint64_t> writeStalls{ 0 };
+    std::atomic<uint64_t> lateEvents{ 0 };
+    std::atomic<uint64_t> reconnects{ 0 };
+    std::atomic<uint64_t> loops{ 0 };
+    std::atomic<uint64_t> probesSent{ 0 };
+};
+
+// Гистограмма задержки с шагом LATENCY_BUCKET_US: окно интервала и весь прогон
+class LatencyHistogram {
+    std::vector<uint64_t> m_buckets = std::vector<uint64_t>(LATENCY_BUCKETS, 0);
+    uint64_t m_count = 0;
+    int64_t m_maxUs = 0;
+
+public:
+    void Add(int64_t us) {
+        int bucket = (int)std::min<int64_t>(std::max<int64_t>(us, 0) / LATENCY_BUCKET_US, LATENCY_BUCKETS - 1);
+        m_buckets[bucket]++;
+        m_count++;
+        m_maxUs = std::max(m_maxUs, us);
+    }
+
+    void Merge(const LatencyHistogram& other) {
+        for (int i = 0; i < LATENCY_BUCKETS; i++) m_buckets[i] += other.m_buckets[i];
+        m_count += other.m_count;
+        m_maxUs = std::max(m_maxUs, other.m_maxUs);
+    }
+
+    void Clear() {
+        std::fill(m_buckets.begin(), m_buckets.end(), 0);
+        m_count = 0;
+        m_maxUs = 0;
+    }
+
+    uint64_t Count() const { return m_count; }
+    double MaxMs() const { return m_maxUs / 1000.0; }
+
+    double PercentileMs(double p) const {
+        if (m_count == 0) return 0;
+        uint64_t target = (uint64_t)(p * (m_count - 1)) + 1, seen = 0;
+        for (int i = 0; i < LATENCY_BUCKETS; i++) {
+            seen += m_buckets[i];
+            if (seen >= target) return (i + 1) * LATENCY_BUCKET_US / 1000.0;
+        }
+        return MaxMs();
+    }
+};
+
+struct ReceiveStats {
+    std::mutex mutex;
+    LatencyHistogram window;
+    LatencyHistogram total;
+    std::vector<int64_t> lastSeq;
+    uint64_t probes = 0;
+    uint64_t lost = 0;
+    uint64_t duplicates = 0;
+    std::atomic<uint64_t> bytes{ 0 };
+};
+
+std::vector<std::unique_ptr<StreamStats>> g_Streams;
+ReceiveStats g_Received;
+
+// Пиковая память в МБ: своя и наблюдаемого процесса (движка)
+double PeakMemoryMb(int pid) {
+#ifdef _WIN32
+    HANDLE process = pid ? OpenProcess(PROCESS_QUERY_LIMITED_INFORMATION, FALSE, (DWORD)pid) : GetCurrentProcess();
+    if (!process) return 0;
+    PROCESS_MEMORY_COUNTERS counters = {};
+    BOOL ok = GetProcessMemoryInfo(process, &counters, sizeof(counters));
+    if (pid) CloseHandle(process);
+    return ok ? counters.PeakWorkingSetSize / (1024.0 * 1024.0) : 0;
+#else
+    if (!pid) {
+        rusage usage = {};
+        getrusage(RUSAGE_SELF, &usage);
+        return usage.ru_maxrss / 1024.0;
+    }
+    std::ifstream status("/proc/" + std::to_string(pid) + "/status");
+    std::string line;
+    while (std::getline(status, line)) {
+        if (line.compare(0, 6, "VmHWM:") == 0) return atof(line.c_str() + 6) / 1024.0;
+    }
+    return 0;
+#endif
+}
+
+// ==========================================
+// MPEG-TS МУКСИНГ
+// ==========================================
+uint32_t Crc32Mpeg(const uint8_t* data, size_t size) {
+    uint32_t crc = 0xFFFFFFFF;
+    for (size_t i = 0; i < size; i++) {
+        crc ^= (uint32_t)data[i] << 24;
+        for (int bit = 0; bit < 8; bit++) crc = (crc & 0x80000000) ? (crc << 1) ^ 0x04C11DB7 : crc << 1;
+    }
+    return crc;
+}
+
+class TsWriter {
+    uint8_t m_cc[8192] = {};
+
+public:
+    // Один TS пакет с данными (не больше, чем помещается); возвращает, сколько данных ушло
+    int WritePacket(std::vector<uint8_t>& out, int pid, bool pusi, const uint8_t* data, int size, bool randomAccess = false, int64_t pcr = -1) {
+        uint8_t af[TS_PACKET_SIZE];
+        int afLen = 0;
+        bool hasAf = randomAccess || pcr >= 0;
+        if (hasAf) {
+            af[afLen++] = (uint8_t)((randomAccess ? 0x40 : 0) | (pcr >= 0 ? 0x10 : 0));
+            if (pcr >= 0) {
+                int64_t base = pcr / 300;
+                int ext = (int)(pcr % 300);
+                af[afLen++] = (uint8_t)(base >> 25);
+                af[afLen++] = (uint8_t)(base >> 17);
+                af[afLen++] = (uint8_t)(base >> 9);
+                af[afLen++] = (uint8_t)(base >> 1);
+                af[afLen++] = (uint8_t)(((base & 1) << 7) | 0x7E | (ext >> 8));
+                af[afLen++] = (uint8_t)ext;
+            }
+        }
+        int room = TS_PACKET_SIZE - 4 - (hasAf ? 1 + afLen : 0);
+        int take = std::min(size, room);
+        if (take < room) {
+            // Хвост добивается stuffing байтами в adaptation field
+            int stuff = room - take;
+            if (!hasAf) {
+                hasAf = true;
+                stuff--;
+                if (stuff > 0) {
+                    af[afLen++] = 0;
+                    stuff--;
+                }
+            }
+            memset(af + afLen, 0xFF, stuff);
+            afLen += stuff;
+        }
+
+        size_t pos = out.size();
+        out.resize(pos + TS_PACKET_SIZE);
+        uint8_t* p = out.data() + pos;
+        p[0] = 0x47;
+        p[1] = (uint8_t)((pusi ? 0x40 : 0) | ((pid >> 8) & 0x1F));
+        p[2] = (uint8_t)pid;
+        p[3] = (uint8_t)((hasAf ? 0x30 : 0x10) | m_cc[pid]);
+        m_cc[pid] = (m_cc[pid] + 1) & 0xF;
+        int offset = 4;
+        if (hasAf) {
+            p[offset++] = (uint8_t)afLen;
+            memcpy(p + offset, af, afLen);
+            offset += afLen;
+        }
+        memcpy(p + offset, data, take);
+        return take;
+    }
+
+    void WriteSection(std::vector<uint8_t>& out, int pid, std::vector<uint8_t> section) {
+        uint32_t crc = Crc32Mpeg(section.data(), section.size());
+        for (int shift = 24; shift >= 0; shift -= 8) section.push_back((uint8_t)(crc >> shift));
+        section.insert(section.begin(), 0); // pointer_field
+        WritePacket(out, pid, true, section.data(), (int)section.size());
+    }
+
+    void WritePatPmt(std::vector<uint8_t>& out) {
+        WriteSection(out, 0, { 0x00, 0xB0, 13, 0x00, 0x01, 0xC1, 0x00, 0x00,
+            0x00, 0x01, (uint8_t)(0xE0 | (PMT_PID >> 8)), (uint8_t)PMT_PID });
+        WriteSection(out, PMT_PID, { 0x02, 0xB0, 18, 0x00, 0x01, 0xC1, 0x00, 0x00,
+            (uint8_t)(0xE0 | (VIDEO_PID >> 8)), (uint8_t)VIDEO_PID, 0xF0, 0x00,
+            0x1B, (uint8_t)(0xE0 | (VIDEO_PID >> 8)), (uint8_t)VIDEO_PID, 0xF0, 0x00 });
+    }
+
+    void WritePes(std::vector<uint8_t>& out, const uint8_t* au, size_t size, int64_t pts90k, bool key) {
+        uint8_t header[14] = { 0x00, 0x00, 0x01, 0xE0, 0x00, 0x00, 0x80, 0x80, 5 };
+        header[9] = (uint8_t)(0x21 | ((pts90k >> 29) & 0x0E));
+        header[10] = (uint8_t)(pts90k >> 22);
+        header[11] = (uint8_t)(0x01 | ((pts90k >> 14) & 0xFE));
+        header[12] = (uint8_t)(pts90k >> 7);
+        header[13] = (uint8_t)(0x01 | ((pts90k << 1) & 0xFE));
+
+        // Первый пакет: PES заголовок + начало AU, PCR = PTS (27 МГц)
+        std::vector<uint8_t> first(header, header + sizeof(header));
+        size_t firstTake = std::min<size_t>(size, TS_PACKET_SIZE - 4 - 8 - sizeof(header));
+        first.insert(first.end(), au, au + firstTake);
+        int taken = WritePacket(out, VIDEO_PID, true, first.data(), (int)first.size(), key, pts90k * 300);
+        size_t pos = taken - sizeof(header);
+        while (pos < size) pos += WritePacket(out, VIDEO_PID, false, au + pos, (int)(size - pos));
+    }
+
+    void WriteProbe(std::vector<uint8_t>& out, uint32_t stream, uint64_t seq, int64_t sendUs) {
+        uint8_t payload[PROBE_SIZE];
+        memcpy(payload, PROBE_MAGIC, 8);
+        memcpy(payload + 8, &stream, 4);
+        memcpy(payload + 12, &seq, 8);
+        memcpy(payload + 20, &sendUs, 8);
+        WritePacket(out, PROBE_PID, true, payload, PROBE_SIZE);
+    }
+};
+
+// ==========================================
+// ВЫХОДЫ (PIPE / FIFO / UDP / RTP)
+// ==========================================
+class StreamOutput {
+    OutputKind m_kind;
+    std::string m_pipeName;
+    PipeHandle m_pipe = INVALID_PIPE;
+    SOCKET m_sock = INVALID_SOCKET;
+    sockaddr_in m_dest = {};
+    uint16_t m_rtpSeq = 0;
+    uint32_t m_ssrc = 0;
+
+public:
+    StreamOutput(const Options& opt, int index) : m_kind(opt.out) {
+        m_pipeName = index ? opt.pipeName + "_" + std::to_string(index) : opt.pipeName;
+        if (m_kind == OutputKind::Pipe) return;
+        m_sock = socket(AF_INET, SOCK_DGRAM, IPPROTO_UDP);
+        int sendBuf = 4 * 1024 * 1024;
+        setsockopt(m_sock, SOL_SOCKET, SO_SNDBUF, (const char*)&sendBuf, sizeof(sendBuf));
+        m_dest.sin_family = AF_INET;
+        m_dest.sin_port = htons((uint16_t)(opt.destPort + index));
+        inet_pton(AF_INET, opt.destHost.c_str(), &m_dest.sin_addr);
+        m_ssrc = 0x4C470000u | (uint32_t)index;
+    }
+
+    ~StreamOutput() {
+        ClosePipe();
+        if (m_sock != INVALID_SOCKET) closesocket(m_sock);
+    }
+
+    std::string Name() const {
+        if (m_kind == OutputKind::Pipe) return m_pipeName;
+        char ip[INET_ADDRSTRLEN] = "";
+        inet_ntop(AF_INET, (void*)&m_dest.sin_addr, ip, sizeof(ip));
+        return std::string(m_kind == OutputKind::Rtp ? "rtp://" : "udp://") + ip + ":" + std::to_string(ntohs(m_dest.sin_port));
+    }
+
+    // Pipe: ждёт, пока сервер (движок) создаст pipe, или читателя FIFO
+    bool Connect() {
+        if (m_kind != OutputKind::Pipe) return true;
+        while (!g_Stop) {
+#ifdef _WIN32
+            m_pipe = CreateFileA(m_pipeName.c_str(), GENERIC_WRITE, 0, nullptr, OPEN_EXISTING, 0, nullptr);
+            if (m_pipe != INVALID_PIPE) return true;
+            if (GetLastError() == ERROR_PIPE_BUSY) WaitNamedPipeA(m_pipeName.c_str(), 500);
+            else std::this_thread::sleep_for(std::chrono::milliseconds(500));
+#else
+            mkfifo(m_pipeName.c_str(), 0666);
+            // O_NONBLOCK: открытие без читателя сразу возвращает ENXIO, Ctrl+C не зависает
+            m_pipe = open(m_pipeName.c_str(), O_WRONLY | O_NONBLOCK);
+            if (m_pipe != INVALID_PIPE) {
+                fcntl(m_pipe, F_SETFL, fcntl(m_pipe, F_GETFL) & ~O_NONBLOCK);
+                return true;
+            }
+            std::this_thread::sleep_for(std::chrono::milliseconds(200));
+#endif
+        }
+        return false;
+    }
+
+    void ClosePipe() {
+        if (m_pipe == INVALID_PIPE) return;
+#ifdef _WIN32
+        CloseHandle(m_pipe);
+#else
+        close(m_pipe);
+#endif
+        m_pipe = INVALID_PIPE;
+    }
+
+    // false - читатель отвалился, нужно переподключение
+    bool Write(const uint8_t* data, size_t size, StreamStats& stats) {
+        if (m_kind != OutputKind::Pipe) {
+            SendDatagrams(data, size, stats);
+            return true;
+        }
+        int64_t startUs = NowUs();
+        while (size > 0) {
+#ifdef _WIN32
+            DWORD written = 0;
+            if (!WriteFile(m_pipe, data, (DWORD)size, &written, nullptr)) return false;
+#else
+            ssize_t written = write(m_pipe, data, size);
+            if (written < 0 && errno == EINTR) continue;
+            if (written <= 0) return false;
+#endif
+            data += written;
+            size -= written;
+            stats.bytes += written;
+        }
+        // Медленный читатель давит на генератор: это и есть то, что хотим видеть
+        if (NowUs() - startUs > WRITE_STALL_US) stats.writeStalls++;
+        return true;
+    }
+
+private:
+    // По UDP_TS_PACKETS пакетов; хвост порции уходит короткой датаграммой, а не ждёт следующую
+    void SendDatagrams(const uint8_t* data, size_t size, StreamStats& stats) {
+        uint8_t datagram[RTP_HEADER_SIZE + TS_PACKET_SIZE * UDP_TS_PACKETS];
+        for (size_t pos = 0; pos < size;) {
+            size_t payload = std::min<size_t>(size - pos, TS_PACKET_SIZE * UDP_TS_PACKETS);
+            int header = 0;
+            if (m_kind == OutputKind::Rtp) {
+                uint32_t ts = (uint32_t)(NowUs() * 9 / 100);
+                datagram[0] = 0x80;
+                datagram[1] = RTP_PT_MP2T;
+                datagram[2] = (uint8_t)(m_rtpSeq >> 8);
+                datagram[3] = (uint8_t)m_rtpSeq;
+                for (int i = 0; i < 4; i++) datagram[4 + i] = (uint8_t)(ts >> (24 - 8 * i));
+                for (int i = 0; i < 4; i++) datagram[8 + i] = (uint8_t)(m_ssrc >> (24 - 8 * i));
+                m_rtpSeq++;
+                header = RTP_HEADER_SIZE;
+            }
+            memcpy(datagram + header, data + pos, payload);
+            int len = header + (int)payload;
+            if (sendto(m_sock, (const char*)datagram, len, 0, (sockaddr*)&m_dest, sizeof(m_dest)) == len) stats.bytes += len;
+            else stats.writeErrors++;
+            pos += payload;
+        }
+    }
+};
+
+// ==========================================
+// ИСТОЧНИКИ: TS ФАЙЛ / СИНТЕТИКА
+// ==========================================
+// Следующая порция TS пакетов и её медиа-время (мкс от начала прогона)
+class TsSource {
+public:
+    virtual ~TsSource() {}
+    virtual bool Next(std::vector<uint8_t>& out, int64_t& mediaUs) = 0;
+};
+
+class FileTsSource : public TsSource {
+    FILE* m_file = nullptr;
+    StreamStats& m_stats;
+    std::vector<uint8_t> m_chunk = std::vector<uint8_t>(WRITE_CHUNK);
+    int64_t m_lastPcr = -1;
+    int64_t m_mediaUs = 0;
+
+public:
+    FileTsSource(const std::string& path, StreamStats& stats) : m_stats(stats) {
+        m_file = fopen(path.c_str(), "rb");
+    }
+    ~FileTsSource() { if (m_file) fclose(m_file); }
+    bool IsOpen() const { return m_file != nullptr; }
+
+    bool Next(std::vector<uint8_t>& out, int64_t& mediaUs) override {
+        size_t n = fread(m_chunk.data(), 1, m_chunk.size(), m_file);
+        n -= n % TS_PACKET_SIZE;
+        if (n == 0) {
+            // Конец файла: по кругу, медиа-время продолжается
+            m_stats.loops++;
+            m_lastPcr = -1;
+            fseek(m_file, 0, SEEK_SET);
+            n = fread(m_chunk.data(), 1, m_chunk.size(), m_file);
+            n -= n % TS_PACKET_SIZE;
+            if (n == 0) return false;
+        }
+        for (size_t off = 0; off < n; off += TS_PACKET_SIZE) {
+            const uint8_t* p = m_chunk.data() + off;
+            // Пробы из файла, записанного с генератора, путали бы счёт потерь
+            if (((p[1] & 0x1F) << 8 | p[2]) == PROBE_PID) continue;
+            out.insert(out.end(), p, p + TS_PACKET_SIZE);
+            if (p[0] != 0x47 || !(p[3] & 0x20) || p[4] < 7 || !(p[5] & 0x10)) continue;
+            int64_t base = ((int64_t)p[6] << 25) | (p[7] << 17) | (p[8] << 9) | (p[9] << 1) | (p[10] >> 7);
+            int64_t pcr = base * 300 + (((p[10] & 1) << 8) | p[11]);
+            // Разрыв PCR (склейка, начало круга) не двигает время назад и не даёт скачка
+            int64_t delta = pcr - m_lastPcr;
+            if (m_lastPcr >= 0 && delta > 0 && delta < 27000000) m_mediaUs += delta / 27;
+            m_lastPcr = pcr;
+        }
+        mediaUs = m_mediaUs;
+        return true;
+    }
+};
+
+class SyntheticTsSource : public TsSource {
+    TsWriter& m_writer;
+    int m_fps;
+    std::vector<uint8_t> m_au;
+    int64_t m_frame = 0;
+
+public:
+    SyntheticTsSource(TsWriter& writer, const Options& opt) : m_writer(writer), m_fps(opt.fps) {
+        size_t size = opt.frameBytes > 0 ? (size_t)opt.frameBytes : (size_t)opt.width * opt.height * 3 / 2;
+        m_au.resize(std::max<size_t>(size, 16));
+        // AUD + начало слайса; остальное - ненулевой узор без ложных start code
+        const uint8_t prefix[] = { 0x00, 0x00, 0x00, 0x01, 0x09, 0xF0, 0x00, 0x00, 0x01, 0x65 };
+        memcpy(m_au.data(), prefix, sizeof(prefix));
+        for (size_t i = sizeof(prefix); i < m_au.size(); i++) m_au[i] = (uint8_t)(0x80 | (i * 31));
+    }
+
+    bool Next(std::vector<uint8_t>& out, int64_t& mediaUs) override {
+        bool key = (m_frame % m_fps) == 0;
+        if (key) m_writer.WritePatPmt(out);
+        m_au[9] = key ? 0x65 : 0x41;
+        int64_t pts = 90000 + m_frame * 90000 / m_fps;
+        m_writer.WritePes(out, m_au.data(), m_au.size(), pts, key);
+        mediaUs = m_frame * 1000000 / m_fps;
+        m_frame++;
+        return true;
+    }
+};
+
+// ==========================================
+// ПОТОКИ ГЕНЕРАТОРА И ПРИЁМНИКА
+// ==========================================
+void RunStream(const Options& opt, int index, int64_t startUs) {
+    StreamStats& stats = *g_Streams[index];
+    TsWriter writer; // CC пробных пакетов; у синтетики ещё и видео
+    std::unique_ptr<TsSource> source;
+    if (opt.input.empty()) source.reset(new SyntheticTsSource(writer, opt));
+    else {
+        FileTsSource* file = new FileTsSource(opt.input, stats);
+        source.reset(file);
+        if (!file->IsOpen()) {
+            Log("Stream " + std::to_string(index) + ": cannot open " + opt.input);
+            return;
+        }
+    }
+
+    StreamOutput output(opt, index);
+    if (!output.Connect()) return;
+    Log("Stream " + std::to_string(index) + ": writing to " + output.Name());
+
+    std::vector<uint8_t> buffer;
+    uint64_t probeSeq = 0;
+    int64_t nextProbeUs = NowUs();
+    int64_t pacingStartUs = NowUs();
+    while (!g_Stop && (opt.durationSec == 0 || NowUs() - startUs < opt.durationSec * 1000000ll)) {
+        buffer.clear();
+        int64_t mediaUs = 0;
+        if (!source->Next(buffer, mediaUs)) break;
+
+        int64_t nowUs = NowUs();
+        if (opt.speed > 0) {
+            int64_t dueUs = pacingStartUs + (int64_t)(mediaUs / opt.speed);
+            if (dueUs > nowUs + 1000) {
+                std::this_thread::sleep_for(std::chrono::microseconds(dueUs - nowUs));
+                nowUs = NowUs();
+            }
+            else if (nowUs - dueUs > PACING_LATE_US) {
+                // Не успеваем за реальным временем: фиксируем и не пытаемся догнать рывком
+                stats.lateEvents++;
+                pacingStartUs += nowUs - dueUs;
+            }
+        }
+        if (opt.probeMs > 0 && nowUs >= nextProbeUs) {
+            writer.WriteProbe(buffer, (uint32_t)index, probeSeq++, nowUs);
+            stats.probesSent++;
+            nextProbeUs = nowUs + opt.probeMs * 1000ll;
+        }
+        if (!output.Write(buffer.data(), buffer.size(), stats)) {
+            stats.reconnects++;
+            Log("Stream " + std::to_string(index) + ": reader closed, reconnecting");
+            output.ClosePipe();
+            if (!output.Connect()) break;
+            if (opt.speed > 0) pacingStartUs = NowUs() - (int64_t)(mediaUs / opt.speed);
+        }
+    }
+}
+
+void HandleProbe(const uint8_t* probe, int64_t nowUs) {
+    uint32_t stream;
+    uint64_t seq;
+    int64_t sendUs;
+    memcpy(&stream, probe + 8, 4);
+    memcpy(&seq, probe + 12, 8);
+    memcpy(&sendUs, probe + 20, 8);
+
+    std::lock_guard<std::mutex> lock(g_Received.mutex);
+    if (stream >= g_Received.lastSeq.size()) return;
+    int64_t& last = g_Received.lastSeq[stream];
+    if ((int64_t)seq <= last) {
+        g_Received.duplicates++;
+        return;
+    }
+    if (last >= 0) g_Received.lost += seq - last - 1;
+    last = (int64_t)seq;
+    g_Received.probes++;
+    g_Received.window.Add(nowUs - sendUs);
+    g_Received.total.Add(nowUs - sendUs);
+}
+
+// Слушает ретрансляцию движка: TS как есть или в RTP, пакеты режутся по любым границам
+void RunListener(int port) {
+    SOCKET sock = socket(AF_INET, SOCK_DGRAM, IPPROTO_UDP);
+    int reuse = 1;
+    setsockopt(sock, SOL_SOCKET, SO_REUSEADDR, (const char*)&reuse, sizeof(reuse));
+    int recvBuf = 8 * 1024 * 1024;
+    setsockopt(sock, SOL_SOCKET, SO_RCVBUF, (const char*)&recvBuf, sizeof(recvBuf));
+#ifdef _WIN32
+    DWORD timeout = 200;
+#else
+    timeval timeout = { 0, 200000 };
+#endif
+    setsockopt(sock, SOL_SOCKET, SO_RCVTIMEO, (const char*)&timeout, sizeof(timeout));
+    sockaddr_in local = {};
+    local.sin_family = AF_INET;
+    local.sin_port = htons((uint16_t)port);
+    local.sin_addr.s_addr = INADDR_ANY;
+    if (bind(sock, (sockaddr*)&local, sizeof(local)) != 0) {
+        Log("Listener: cannot bind port " + std::to_string(port));
+        closesocket(sock);
+        return;
+    }
+
+    std::vector<uint8_t> buf(65536);
+    std::vector<uint8_t> stream; // хвост предыдущей датаграммы + новая
+    while (!g_StopListeners) {
+        int len = recv(sock, (char*)buf.data(), (int)buf.size(), 0);
+        if (len <= 0) continue;
+        int64_t nowUs = NowUs();
+        g_Received.bytes += len;
+        // Ретрансляция pipe режется по произвольным границам, поэтому RTP узнаём по версии и PT, а не по 0x47
+        bool rtp = len > RTP_HEADER_SIZE && buf[0] == 0x80 && (buf[1] & 0x7F) == RTP_PT_MP2T;
+        stream.insert(stream.end(), buf.begin() + (rtp ? RTP_HEADER_SIZE : 0), buf.begin() + len);
+
+        size_t scan = 0, keepFrom;
+        while (true) {
+            auto it = std::search(stream.begin() + scan, stream.end(), PROBE_MAGIC, PROBE_MAGIC + 8);
+            if (it == stream.end()) {
+                keepFrom = stream.size() - std::min<size_t>(stream.size() - scan, PROBE_SIZE - 1);
+                break;
+            }
+            keepFrom = it - stream.begin();
+            if (stream.end() - it < PROBE_SIZE) break;
+            HandleProbe(&*it, nowUs);
+            scan = keepFrom + PROBE_SIZE;
+        }
+        stream.erase(stream.begin(), stream.begin() + keepFrom);
+    }
+    closesocket(sock);
+}
+
+// ==========================================
+// ОТЧЁТ
+// ==========================================
+struct Totals {
+    uint64_t bytes = 0, writeErrors = 0, writeStalls = 0, lateEvents = 0, reconnects = 0, loops = 0, probesSent = 0;
+};
+
+Totals operator-(const Totals& a, const Totals& b) {
+    Totals d;
+    d.bytes = a.bytes - b.bytes;
+    d.writeErrors = a.writeErrors - b.writeErrors;
+    d.writeStalls = a.writeStalls - b.writeStalls;
+    d.lateEvents = a.lateEvents - b.lateEvents;
+    d.reconnects = a.reconnects - b.reconnects;
+    d.loops = a.loops - b.loops;
+    d.probesSent = a.probesSent - b.probesSent;
+    return d;
+}
+
+Totals SumStreams() {
+    Totals t;
+    for (auto& s : g_Streams) {
+        t.bytes += s->bytes;
+        t.writeErrors += s->writeErrors;
+        t.writeStalls += s->writeStalls;
+        t.lateEvents += s->lateEvents;
+        t.reconnects += s->reconnects;
+        t.loops += s->loops;
+        t.probesSent += s->probesSent;
+    }
+    return t;
+}
+
+// Все счётчики строки - за её период (seconds)
+void WriteReportRow(std::ofstream& report, const std::string& label, double seconds, const Totals& t,
+    uint64_t rxBytes, const LatencyHistogram& latency, uint64_t probes, uint64_t lost, uint64_t duplicates, int watchPid) {
+    char line[512];
+    snprintf(line, sizeof(line), "%s,%.1f,%.2f,%llu,%.2f,%llu,%llu,%llu,%llu,%llu,%llu,%llu,%llu,%llu,%.2f,%.2f,%.2f,%.2f,%.1f,%.1f",
+        label.c_str(), seconds, seconds > 0 ? t.bytes * 8 / seconds / 1e6 : 0.0, (unsigned long long)t.bytes,
+        seconds > 0 ? rxBytes * 8 / seconds / 1e6 : 0.0,
+        (unsigned long long)t.writeErrors, (unsigned long long)t.writeStalls, (unsigned long long)t.lateEvents,
+        (unsigned long long)t.reconnects, (unsigned long long)t.loops, (unsigned long long)t.probesSent,
+        (unsigned long long)probes, (unsigned long long)lost, (unsigned long long)duplicates,
+        latency.PercentileMs(0.5), latency.PercentileMs(0.95), latency.PercentileMs(0.99), latency.MaxMs(),
+        PeakMemoryMb(0), watchPid ? PeakMemoryMb(watchPid) : 0.0);
+    report << line << "\n";
+    report.flush();
+    Log(line);
+}
+
+// ==========================================
+// КОМАНДНАЯ СТРОКА
+// ==========================================
+bool ParseOptions(int argc, char** argv, Options& opt) {
+    for (int i = 1; i < argc; i++) {
+        std::string key = argv[i];
+        if (i + 1 >= argc) return false;
+        std::string value = argv[++i];
+        if (key == "--input") opt.input = value;
+        else if (key == "--synthetic") {
+            opt.input.clear();
+            if (sscanf(value.c_str(), "%dx%d@%d", &opt.width, &opt.height, &opt.fps) != 3 || opt.width < 16 || opt.height < 16 || opt.fps < 1) return false;
+        }
+        else if (key == "--frame-bytes") opt.frameBytes = atoi(value.c_str());
+        else if (key == "--streams") opt.streams = atoi(value.c_str());
+        else if (key == "--out") {
+            if (value == "pipe") opt.out = OutputKind::Pipe;
+            else if (value == "udp") opt.out = OutputKind::Udp;
+            else if (value == "rtp") opt.out = OutputKind::Rtp;
+            else return false;
+        }
+        else if (key == "--pipe-name") opt.pipeName = value;
+        else if (key == "--dest") {
+            size_t colon = value.rfind(':');
+            if (colon == std::string::npos) return false;
+            opt.destHost = value.substr(0, colon);
+            opt.destPort = atoi(value.c_str() + colon + 1);
+        }
+        else if (key == "--speed") {
+            if (value == "realtime") opt.speed = 1.0;
+            else if (value == "max") opt.speed = 0;
+            else if ((opt.speed = atof(value.c_str())) <= 0) return false;
+        }
+        else if (key == "--duration") opt.durationSec = atoi(value.c_str());
+        else if (key == "--interval") opt.intervalSec = std::max(1, atoi(value.c_str()));
+        else if (key == "--probe-ms") opt.probeMs = atoi(value.c_str());
+        else if (key == "--listen") {
+            std::istringstream ports(value);
+            std::string port;
+            while (std::getline(ports, port, ',')) opt.listenPorts.push_back(atoi(port.c_str()));
+        }
+        else if (key == "--watch-pid") opt.watchPid = atoi(value.c_str());
+        else if (key == "--report") opt.report = value;
+        else return false;
+    }
+    return opt.streams >= 1 && opt.destPort > 0 && opt.destPort + opt.streams - 1 <= 65535;
+}
+
+void OnSignal(int) {
+    g_Stop = true;
+}
+
+int main(int argc, char** argv) {
+    Options opt;
+    if (!ParseOptions(argc, argv, opt)) {
+        fprintf(stderr, "Invalid arguments. See the comment at the top of LoadGenerator.cpp for usage.\n");
+        return 1;
+    }
+#ifdef _WIN32
+    WSADATA wsaData;
+    WSAStartup(MAKEWORD(2, 2), &wsaData);
+#else
+    signal(SIGPIPE, SIG_IGN);
+#endif
+    std::signal(SIGINT, OnSignal);
+    std::signal(SIGTERM, OnSignal);
+
+    std::ofstream report(opt.report);
+    if (!report.is_open()) {
+        fprintf(stderr, "Cannot write %s\n", opt.report.c_str());
+        return 1;
+    }
+    report << "interval,seconds,sent_mbps,sent_bytes,rx_mbps,write_errors,write_stalls,pacing_late,reconnects,file_loops,"
+        "probes_sent,probes_rx,probes_lost,probes_dup,lat_p50_ms,lat_p95_ms,lat_p99_ms,lat_max_ms,peak_mem_mb,watched_peak_mem_mb\n";
+
+    for (int i = 0; i < opt.streams; i++) g_Streams.emplace_back(new StreamStats());
+    g_Received.lastSeq.assign(opt.streams, -1);
+
+    int64_t startUs = NowUs();
+    std::vector<std::thread> threads;
+    for (int port : opt.listenPorts) threads.emplace_back(RunListener, port);
+    std::vector<std::thread> streams;
+    for (int i = 0; i < opt.streams; i++) streams.emplace_back(RunStream, std::cref(opt), i, startUs);
+
+    // Отчёт раз в интервал; генераторы сами останавливаются по --duration
+    int64_t lastUs = startUs;
+    Totals last;
+    uint64_t lastRx = 0, lastProbes = 0, lastLost = 0, lastDup = 0;
+    int interval = 0;
+    bool running = true;
+    while (running) {
+        int64_t deadline = lastUs + opt.intervalSec * 1000000ll;
+        while (!g_Stop && NowUs() < deadline) {
+            if (opt.durationSec > 0 && NowUs() - startUs >= opt.durationSec * 1000000ll) break;
+            std::this_thread::sleep_for(std::chrono::milliseconds(100));
+        }
+        running = !g_Stop && (opt.durationSec == 0 || NowUs() - startUs < opt.durationSec * 1000000ll);
+
+        int64_t nowUs = NowUs();
+        Totals t = SumStreams();
+        uint64_t rx = g_Received.bytes;
+        LatencyHistogram window;
+        uint64_t probes, lost, dup;
+        {
+            std::lock_guard<std::mutex> lock(g_Received.mutex);
+            window.Merge(g_Received.window);
+            g_Received.window.Clear();
+            probes = g_Received.probes;
+            lost = g_Received.lost;
+            dup = g_Received.duplicates;
+        }
+        WriteReportRow(report, std::to_string(++interval), (nowUs - lastUs) / 1e6, t - last, rx - lastRx,
+            window, probes - lastProbes, lost - lastLost, dup - lastDup, opt.watchPid);
+        lastUs = nowUs;
+        last = t;
+        lastRx = rx;
+        lastProbes = probes;
+        lastLost = lost;
+        lastDup = dup;
+    }
+
+    g_Stop = true;
+    for (std::thread& t : streams) t.join();
+    // Ожидание проб и join слушателей в длительность не входят: иначе sent_mbps занижен
+    int64_t endUs = NowUs();
+    // Даём ретрансляции довезти последние пробы
+    std::this_thread::sleep_for(std::chrono::milliseconds(500));
+    g_StopListeners = true;
+    for (std::thread& t : threads) t.join();
+
+    Totals t = SumStreams();
+    std::lock_guard<std::mutex> lock(g_Received.mutex);
+    WriteReportRow(report, "total", (endUs - startUs) / 1e6, t, g_Received.bytes, g_Received.total,
+        g_Received.probes, g_Received.lost, g_Received.duplicates, opt.watchPid);
+#ifdef _WIN32
+    WSACleanup();
+#endif
+    return 0;
+}
@@ -0,0 +1,154 @@
+#pragma once
+/* Shared-memory frame ring used by DXGIscreencapture for local consumers.
+
+   Layout of the named mapping (default name SFR_DEFAULT_NAME):
+     SfrHeader                     (SFR_HEADER_SIZE bytes)
+     slot[0] .. slot[slotCount-1]  (slotStride bytes each)
+   Each slot starts with SfrSlotHeader (SFR_SLOT_HEADER_SIZE bytes) followed by pixel data.
+
+   Slots are protected by a seqlock: seq is odd while the producer writes the slot.
+   A reader takes seq, uses the data in place and checks seq again; if it changed,
+   the frame was overwritten and must be dropped. Readers never write to the mapping,
+   so any number of them can attach.
+
+   Frame notification uses two named manual-reset events (SFR_EVENT_SUFFIX + "0"/"1"):
+   publishing frame N sets event N&1 and resets event (N+1)&1.
+*/
+
+#ifndef WIN32_LEAN_AND_MEAN
+#define WIN32_LEAN_AND_MEAN
+#endif
+#ifndef NOMINMAX
+#define NOMINMAX
+#endif
+#include <windows.h>
+#include <stdint.h>
+#include <string>
+#include <algorithm>
+
+#define SFR_MAGIC            0x52464653 // "SFFR"
+#define SFR_VERSION          1
+#define SFR_DEFAULT_NAME     L"Local\\DXGIScreenCaptureFrames"
+#define SFR_EVENT_SUFFIX     L".Frame"
+#define SFR_SLOT_COUNT       4
+#define SFR_HEADER_SIZE      64
+#define SFR_SLOT_HEADER_SIZE 64
+
+enum SfrPixelFormat : uint32_t {
+    SFR_FORMAT_NONE = 0,
+    SFR_FORMAT_RGB24 = 1,
+    SFR_FORMAT_BGRA = 2,
+};
+
+struct SfrHeader {
+    uint32_t magic;
+    uint32_t version;
+    uint32_t slotCount;
+    uint32_t slotStride;
+    uint32_t maxFrameSize;
+    uint32_t reserved;
+    volatile LONG64 lastFrameId; // 0 = nothing published yet
+};
+
+struct SfrSlotHeader {
+    volatile LONG seq;
+    uint32_t format;
+    uint32_t width;
+    uint32_t height;
+    uint32_t stride;
+    uint32_t size;
+    int64_t frameId;
+    int64_t timestampUs;
+};
+
+static_assert(sizeof(SfrHeader) <= SFR_HEADER_SIZE, "SfrHeader too large");
+static_assert(sizeof(SfrSlotHeader) <= SFR_SLOT_HEADER_SIZE, "SfrSlotHeader too large");
+
+inline SfrSlotHeader* SfrGetSlot(void* base, const SfrHeader* hdr, int64_t frameId) {
+    uint32_t index = (uint32_t)(frameId % hdr->slotCount);
+    return (SfrSlotHeader*)((uint8_t*)base + SFR_HEADER_SIZE + (size_t)index * hdr->slotStride);
+}
+
+inline uint8_t* SfrSlotData(SfrSlotHeader* slot) {
+    return (uint8_t*)slot + SFR_SLOT_HEADER_SIZE;
+}
+
+// Reader side. Header-only so recorder/CV processes just include this file.
+class SharedFrameReader {
+    HANDLE m_hMapping = nullptr;
+    HANDLE m_events[2] = { nullptr, nullptr };
+    void* m_view = nullptr;
+    SfrHeader* m_header = nullptr;
+    int64_t m_lastFrameId = 0;
+
+public:
+    ~SharedFrameReader() { Close(); }
+
+    bool Open(const wchar_t* name = SFR_DEFAULT_NAME) {
+        Close();
+        m_hMapping = OpenFileMappingW(FILE_MAP_READ, FALSE, name);
+        if (!m_hMapping) return false;
+        m_view = MapViewOfFile(m_hMapping, FILE_MAP_READ, 0, 0, 0);
+        m_header = (SfrHeader*)m_view;
+        if (!m_header || m_header->magic != SFR_MAGIC || m_header->version != SFR_VERSION) {
+            Close();
+            return false;
+        }
+        for (int i = 0; i < 2; i++) {
+            std::wstring evName = std::wstring(name) + SFR_EVENT_SUFFIX + (i ? L"1" : L"0");
+            m_events[i] = OpenEventW(SYNCHRONIZE, FALSE, evName.c_str());
+        }
+        m_lastFrameId = m_header->lastFrameId;
+        return true;
+    }
+
+    void Close() {
+        if (m_view) UnmapViewOfFile(m_view);
+        if (m_hMapping) CloseHandle(m_hMapping);
+        for (HANDLE& ev : m_events) {
+            if (ev) CloseHandle(ev);
+            ev = nullptr;
+        }
+        m_view = nullptr;
+        m_header = nullptr;
+        m_hMapping = nullptr;
+    }
+
+    // Waits until a frame newer than the last consumed one is published.
+    bool WaitForFrame(DWORD timeoutMs) {
+        if (!m_header) return false;
+        ULONGLONG deadline = GetTickCount64() + timeoutMs;
+        while (m_header->lastFrameId <= m_lastFrameId) {
+            ULONGLONG now = GetTickCount64();
+            if (now >= deadline) return false;
+            // Short slices: an event may be reset again between the check and the wait.
+            DWORD slice = (DWORD)std::min<ULONGLONG>(deadline - now, 5);
+            HANDLE ev = m_events[(m_lastFrameId + 1) & 1];
+            if (ev) WaitForSingleObject(ev, slice);
+            else Sleep(1);
+        }
+        return true;
+    }
+
+    // Calls fn(const SfrSlotHeader&, const uint8_t* pixels) on the newest frame in place.
+    // Returns false if nothing new was published or the slot was overwritten during fn;
+    // in the latter case the consumer must discard whatever it derived from the pixels.
+    template <typename Fn>
+    bool ReadLatest(Fn&& fn) {
+        if (!m_header) return false;
+        int64_t frameId = m_header->lastFrameId;
+        if (frameId <= m_lastFrameId) return false;
+
+        SfrSlotHeader* slot = SfrGetSlot(m_view, m_header, frameId);
+        LONG seqBefore = slot->seq;
+        MemoryBarrier();
+        if ((seqBefore & 1) || slot->frameId != frameId) return false;
+
+        fn((const SfrSlotHeader&)*slot, (const uint8_t*)SfrSlotData(slot));
+
+        MemoryBarrier();
+        if (slot->seq != seqBefore) return false;
+        m_lastFrameId = frameId;
+        return true;
+    }
+};